@@ -25,12 +25,17 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sched.h>
 #include <errno.h>
+#include <time.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 #include <glib-unix.h>
 #include "levelbar.h"
+#include "channelstrip.h"
 #include "piano.h" // From swami.
 #include "portlib.h"
 
@@ -82,13 +87,33 @@ typedef GtkGrid GtkTable;
 #define MAX_MIDI_VALS	128
 #define PROG_NAME_LEN	8
 #define TEMPER_UNKNOWN	8
+#define MAX_ROUTE_ADDRS	8
+#define SYSEX_SOURCES	4	/* sources reassembled at once per port */
+#define SYSEX_ARENA	512	/* bytes of a reassembled sysex */
+#define WIRE_BYTE_USEC	320	/* MIDI wire: 31.25 kbaud, 10 bits a byte */
+#define WIRE_FULL_USEC	1000000	/* full scale of the wire meter */
+#define PACE_ARENA	65536	/* bytes of sysex waiting per port */
+#define PACE_SLICE_USEC	10000	/* wire time left when the next sysex goes */
+#define PACE_PIECE	(PACE_SLICE_USEC / WIRE_BYTE_USEC)	/* bytes sent at once */
+#define PACE_HOLD	16384	/* bytes of events held behind a sysex */
+#define PACE_ALIGN(n)	(((n) + 7) & ~7)
+#define XFORM_DROP	0xff	/* transform: not sent */
+#define XFORM_KEEP	0xfe	/* transform: the key is not split */
+#define XFORM_MAX_ARGS	20	/* words in a line of the transform file */
+#define XFORM_RECLAIM_MSEC	50
 
 #if SND_LIB_MAJOR == 0 && SND_LIB_MINOR <= 5
 #define MIDI_CTL_MSB_BANK			SND_MCTL_MSB_BANK
+#define MIDI_CTL_LSB_BANK			SND_MCTL_LSB_BANK
+#define MIDI_CTL_MSB_DATA_ENTRY		SND_MCTL_MSB_DATA_ENTRY
+#define MIDI_CTL_LSB_DATA_ENTRY		SND_MCTL_LSB_DATA_ENTRY
 #define MIDI_CTL_MSB_MAIN_VOLUME	SND_MCTL_MSB_MAIN_VOLUME
 #define MIDI_CTL_MSB_PAN			SND_MCTL_MSB_PAN
 #define MIDI_CTL_MSB_EXPRESSION		SND_MCTL_MSB_EXPRESSION
 #define MIDI_CTL_SUSTAIN			SND_MCTL_SUSTAIN
+#define MIDI_CTL_E1_REVERB_DEPTH	SND_MCTL_E1_REVERB_DEPTH
+#define MIDI_CTL_E3_CHORUS_DEPTH	SND_MCTL_E3_CHORUS_DEPTH
+#define MIDI_CTL_E4_DETUNE_DEPTH	SND_MCTL_E4_DETUNE_DEPTH
 #define MIDI_CTL_ALL_SOUNDS_OFF		SND_MCTL_ALL_SOUNDS_OFF
 #define MIDI_CTL_RESET_CONTROLLERS	SND_MCTL_RESET_CONTROLLERS
 #define MIDI_CTL_ALL_NOTES_OFF		SND_MCTL_ALL_NOTES_OFF
@@ -103,6 +128,116 @@ typedef GtkGrid GtkTable;
 typedef struct channel_status_t channel_status_t;
 typedef struct port_status_t port_status_t;
 typedef struct midi_status_t midi_status_t;
+typedef struct midi_shard_t midi_shard_t;
+typedef struct av_ringbuf_t av_ringbuf_t;
+
+enum {
+	V_CHNUM = 0,
+	V_PROG,
+	V_VEL,
+	V_MAIN,
+	V_EXP,
+	V_PAN,
+	V_PITCH,
+	V_POLY,
+	V_TEMPER,
+	V_PIANO,
+	V_COLS
+};
+
+/* effect types */
+enum {
+	EFFECT_REVERB,
+	EFFECT_CHORUS,
+	EFFECT_VARIATION,
+	NUM_EFFECTS
+};
+
+/* device control, as numbered by GM2 */
+enum {
+	MASTER_VOLUME,
+	MASTER_BALANCE,
+	MASTER_FINE_TUNING,
+	MASTER_COARSE_TUNING,
+	NUM_MASTERS
+};
+
+/*
+ * a sysex split over several events, collected per source in the
+ * arena of the port
+ */
+typedef struct av_sysex_slot_t {
+	snd_seq_addr_t source;
+	int active;			/* waiting for the F7 */
+	int len, oversized;
+	unsigned int stamp;		/* last use */
+	unsigned char buf[SYSEX_ARENA];
+} av_sysex_slot_t;
+
+/*
+ * channel status as shown by the GUI in threaded mode; the MIDI
+ * threads write it under the seqlock of the port, and the GUI reads
+ * it once per frame
+ */
+typedef struct av_channel_snap_t {
+	short val[V_COLS];			/* bar values by column */
+	unsigned int keys[NUM_KEYS / 32];	/* piano keys on */
+	char progname[PROG_NAME_LEN + 1];
+	unsigned char is_drum, temper_type;
+} av_channel_snap_t;
+
+/* dirty bits of a channel snapshot: one per column, plus the color */
+#define SNAP_DIRTY_DRUM	(1U << V_COLS)
+#define SNAP_DIRTY_ALL	((1U << (V_COLS + 1)) - 1)
+
+/*
+ * notes sounding on a channel: the keys on, the notes counted by
+ * velocity and a list in the order of note-on, so that the maximum
+ * velocity and the polyphony are found in constant time and only
+ * the sounding notes are walked.  the list links run over key + 1
+ * with the head at 0, so a cleared index is empty.
+ */
+typedef struct av_note_index_t {
+	unsigned int keys[NUM_KEYS / 32];
+	unsigned int vels[MAX_MIDI_VALS / 32];	/* non-empty counts */
+	unsigned char count[MAX_MIDI_VALS];	/* notes by velocity */
+	unsigned char vel[NUM_KEYS];
+	unsigned char next[NUM_KEYS + 1], prev[NUM_KEYS + 1];
+} av_note_index_t;
+
+/*
+ * transform stages of a port as read from the transform file;
+ * the transpose and the velocity curve go by the channel sent to
+ */
+typedef struct av_xform_conf_t {
+	unsigned char drop[256];			/* by event type */
+	unsigned char chan[MIDI_CHANNELS];		/* channel remap */
+	unsigned char split[MIDI_CHANNELS][NUM_KEYS];	/* or XFORM_KEEP */
+	signed char transpose[MIDI_CHANNELS];
+	unsigned char vel[MIDI_CHANNELS][MAX_MIDI_VALS];
+	unsigned char ctrl[MIDI_CHANNELS][NUM_CTRLS];	/* controller remap */
+} av_xform_conf_t;
+
+/*
+ * the stages compiled together with the transpose, velocity scale
+ * and mutes of the GUI, so that the MIDI thread looks each event up
+ * once whatever stages are set.  the GUI swaps in a new table whole;
+ * the old one is freed after the loop of the shard has passed its
+ * hook, where no event is in flight.
+ */
+typedef struct av_xform_t {
+	unsigned char drop[256];
+	unsigned char chan[MIDI_CHANNELS];
+	unsigned char note_ch[MIDI_CHANNELS][NUM_KEYS];
+	unsigned char key[2][MIDI_CHANNELS][NUM_KEYS];	/* by is_drum */
+	unsigned char vel[MIDI_CHANNELS][MAX_MIDI_VALS];	/* by note_ch */
+	unsigned char ctrl[MIDI_CHANNELS][NUM_CTRLS];
+	int identity;			/* events pass unchanged */
+	/* retired, GUI thread only */
+	struct av_xform_t *next;
+	midi_shard_t *shard;
+	unsigned int epoch;
+} av_xform_t;
 
 struct channel_status_t {
 	port_status_t *port;
@@ -110,24 +245,128 @@ struct channel_status_t {
 	char progname[PROG_NAME_LEN + 1];
 	unsigned char ctrl[NUM_CTRLS];
 	int temper_type;
-	unsigned char vel[NUM_KEYS];
-	int max_vel_key, max_vel;
+	av_note_index_t notes;
+	int pitch;
+	/* controller thinning on the redirect path */
+	unsigned char ctrl_seen[NUM_CTRLS / 8];	/* value known downstream */
+	unsigned char ctrl_held[NUM_CTRLS / 8];	/* final value not sent yet */
+	unsigned int ctrl_time[NUM_CTRLS];	/* last sent (msec) */
+	int pitch_seen, pitch_held;
+	unsigned int pitch_time;
+	int num_held;
 	/* widgets */
 	GtkWidget *w_chnum, *w_prog;
 	GtkWidget *w_vel, *w_main, *w_exp;
-	GtkWidget *w_pan, *w_pitch, *w_temper_type;
+	GtkWidget *w_pan, *w_pitch, *w_poly, *w_temper_type;
 	GtkWidget *w_piano;
 };
 
 struct port_status_t {
 	midi_status_t *main;
+	midi_shard_t *shard;
 	int index;
 	port_t *port;
 	channel_status_t ch[MIDI_CHANNELS];
+	GtkWidget *w_window;
+	GtkWidget *w_strip;		/* compact view */
+	int num_held;			/* held values of thinning */
+	unsigned long thin_saved;	/* events saved by thinning */
+	/* kernel route from the sources to the destinations */
+	int route_state;
+	int num_route_src, num_route_dst;
+	snd_seq_addr_t route_src[MAX_ROUTE_ADDRS];
+	snd_seq_addr_t route_dst[MAX_ROUTE_ADDRS];
+	unsigned long route_switches;
+	int filter;			/* filtered categories */
+	_Atomic(av_xform_t *) xform;	/* swapped by the GUI */
+	/* note restarts passed to the loop of the shard */
+	atomic_uint notes_off[MIDI_CHANNELS];	/* output channels to stop */
+	atomic_uint notes_resume;	/* channels to start again */
+	/* sysex reassembly */
+	av_sysex_slot_t sysex[SYSEX_SOURCES];
+	unsigned int sysex_stamp;
+	unsigned long sysex_partial, sysex_oversized;
+	/* paced sysex output */
+	unsigned char *pace_buf;	/* chunks waiting, length first */
+	unsigned int pace_len, pace_sent, pace_part;
+	int pace_open;			/* a sysex is cut on the wire */
+	int pace_collect;		/* a sysex of pace_src is not complete */
+	snd_seq_addr_t pace_src;
+	unsigned char *hold_buf;	/* events waiting for its end */
+	unsigned int hold_len;
+	long long wire_free;		/* usec the modelled wire is idle */
+	atomic_llong wire_until;	/* the same after all waiting */
+	unsigned long pace_delayed, pace_overflows, pace_dropped;
+	atomic_int wire_shown;		/* the meter is asked to run */
+	GtkWidget *w_wire;
+	guint wire_timer;
+	/* GUI snapshot, threaded mode */
+	atomic_uint snap_seq;
+	av_channel_snap_t snap[MIDI_CHANNELS];
+	/* cells not taken by the GUI yet */
+	atomic_uint dirty_chan;
+	atomic_uint dirty_col[MIDI_CHANNELS];
+	atomic_uint dirty_keys[MIDI_CHANNELS][NUM_KEYS / 32];
+	int shown_valid;		/* GUI thread only */
+	guint snap_tick;
 };
 
-struct midi_status_t {
+enum {
+	UPDATE_MUTE,
+	UPDATE_SNAPSHOT,
+	UPDATE_MODE,
+	UPDATE_TEMPER_KEYSIG,
+	HIDE_TT_BUTTON,
+	UPDATE_OVERRUN,
+	UPDATE_WIRE,
+	UPDATE_MASTER,
+	NUM_UPDATES
+};
+
+/*
+ * GUI update ring of a shard; the MIDI thread of the shard is the
+ * only writer and the GUI thread the only reader.  the pointers
+ * run freely and are masked on access.
+ */
+struct av_ringbuf_t {
+	struct av_ringbuf *buf;
+	unsigned int size;			/* power of two */
+	atomic_uint rdptr, wrptr;
+	atomic_int resync;			/* updates were lost */
+	atomic_int waiting;			/* the reader is idle */
+	int wake_fd;
+	/* written by the MIDI thread */
+	unsigned int max_depth;
+	unsigned long overflows;
+	unsigned long drops[NUM_UPDATES];
+};
+
+/*
+ * one sequencer client with its own handle and loop thread;
+ * viewer ports are spread over the shards
+ */
+struct midi_shard_t {
+	midi_status_t *main;
+	int index;
 	port_client_t *client;
+	pthread_t thread;
+	av_ringbuf_t ringbuf;
+	int route_dirty;	/* routes to be checked by the loop */
+	atomic_uint xform_epoch;	/* passes of the loop hook */
+	atomic_int requests;	/* work of other threads, REQ_* */
+};
+
+/* work passed to the loop of a shard */
+#define REQ_RESET	(1 << 0)	/* reset the ports */
+#define REQ_RESET_OUT	(1 << 1)	/* and send the resets */
+#define REQ_RESTART	(1 << 2)	/* restart the notes of the ports */
+
+struct midi_status_t {
+	int num_shards;
+	midi_shard_t *shards;
+	int loops_running;		/* the shard threads are started */
+	int wake_fd;			/* GUI wakeup in threaded mode */
+	GSource *w_source;
 	int num_ports;
 	port_status_t *ports, *tport;
 	/* common parameter */
@@ -136,37 +375,76 @@ struct midi_status_t {
 	int timer_update, queue;
 	int temper_type_mute, tt_mute_save;
 	int pitch_adj, vel_scale;
-	GtkWidget *w_midi_mode, *w_temper_keysig, *w_time, *w_tt_button[8];
+	av_xform_conf_t *xconf;		/* per port */
+	av_xform_t *xform_retired;	/* waiting for the loops */
+	guint xform_reclaim;
+	int master[NUM_MASTERS];	/* from sysex */
+	int effect_type[NUM_EFFECTS];
+	atomic_int voices;		/* notes on over all ports */
+	int voices_shown;
+	GtkWidget *w_midi_mode, *w_temper_keysig, *w_time, *w_voices;
+	GtkWidget *w_master;
+	GtkWidget *w_tt_button[8];
 	cairo_surface_t *w_gm_xpm, *w_gm2_xpm, *w_gs_xpm, *w_xg_xpm;
 	cairo_surface_t *w_gm_xpm_off, *w_gm2_xpm_off, *w_gs_xpm_off, *w_xg_xpm_off;
 	cairo_surface_t *w_tk_xpm[32], *w_tk_xpm_adj[32], *w_tt_xpm[9];
 };
 
+/*
+ * state of the kernel route of a port; each switch is fenced by
+ * two echo events to ourselves: the first one is sent before the
+ * subscriptions change and the second one after it.  an event of
+ * a routed source received between them may or may not have been
+ * delivered directly, so only its note-offs are passed on.
+ */
 enum {
-	V_CHNUM = 0,
-	V_PROG,
-	V_VEL,
-	V_MAIN,
-	V_EXP,
-	V_PAN,
-	V_PITCH,
-	V_TEMPER,
-	V_PIANO,
-	V_COLS
+	ROUTE_USER,		/* redirected by ourselves */
+	ROUTE_ARMING,		/* -> direct, before the first echo */
+	ROUTE_ENTERING,		/* -> direct, before the second echo */
+	ROUTE_DIRECT,		/* delivered by the kernel */
+	ROUTE_RELEASING,	/* -> user, before the first echo */
+	ROUTE_LEAVING		/* -> user, before the second echo */
 };
 
+/*
+ * event categories which can be filtered out
+ */
 enum {
-	UPDATE_MUTE,
-	VEL_COLOR,
-	UPDATE_STATUS,
-	NOTE_ON,
-	NOTE_OFF,
-	PIANO_RESET,
-	UPDATE_PGM,
-	UPDATE_MODE,
-	UPDATE_TEMPER_KEYSIG,
-	UPDATE_TEMPER_TYPE,
-	HIDE_TT_BUTTON
+	FILTER_PRESSURE,
+	FILTER_CONTROL,
+	FILTER_PROGRAM,
+	FILTER_PITCH,
+	FILTER_SYSEX,
+	FILTER_CLOCK,
+	FILTER_SENSING,
+	NUM_FILTERS
+};
+
+static const char *filter_names[NUM_FILTERS] = {
+	"pressure", "control", "program", "pitch", "sysex", "clock", "sensing"
+};
+
+static const struct {
+	int filter, type;
+} filter_types[] = {
+	{ FILTER_PRESSURE, SND_SEQ_EVENT_KEYPRESS },
+	{ FILTER_PRESSURE, SND_SEQ_EVENT_CHANPRESS },
+	{ FILTER_CONTROL, SND_SEQ_EVENT_CONTROLLER },
+	{ FILTER_CONTROL, SND_SEQ_EVENT_CONTROL14 },
+	{ FILTER_CONTROL, SND_SEQ_EVENT_NONREGPARAM },
+	{ FILTER_CONTROL, SND_SEQ_EVENT_REGPARAM },
+	{ FILTER_PROGRAM, SND_SEQ_EVENT_PGMCHANGE },
+	{ FILTER_PITCH, SND_SEQ_EVENT_PITCHBEND },
+	{ FILTER_SYSEX, SND_SEQ_EVENT_SYSEX },
+	{ FILTER_CLOCK, SND_SEQ_EVENT_CLOCK },
+	{ FILTER_CLOCK, SND_SEQ_EVENT_TICK },
+	{ FILTER_CLOCK, SND_SEQ_EVENT_START },
+	{ FILTER_CLOCK, SND_SEQ_EVENT_CONTINUE },
+	{ FILTER_CLOCK, SND_SEQ_EVENT_STOP },
+	{ FILTER_CLOCK, SND_SEQ_EVENT_SONGPOS },
+	{ FILTER_CLOCK, SND_SEQ_EVENT_SONGSEL },
+	{ FILTER_CLOCK, SND_SEQ_EVENT_QFRAME },
+	{ FILTER_SENSING, SND_SEQ_EVENT_SENSING },
 };
 
 enum {
@@ -181,7 +459,7 @@ enum {
  */
 static int parse_addr(char *, int *, int *, int *);
 static void usage(void);
-static midi_status_t *midi_status_new(int);
+static midi_status_t *midi_status_new(int, int);
 static void midi_status_free(midi_status_t *);
 static void create_port_window(port_status_t *);
 #ifdef USE_GTK4
@@ -193,6 +471,14 @@ static GtkWidget *create_viewer(port_status_t *);
 static void create_viewer_titles(GtkWidget *);
 static void create_channel_viewer(GtkWidget *, port_status_t *, int);
 static void mute_channel(GtkToggleButton *, channel_status_t *);
+static GtkWidget *create_strip(port_status_t *);
+static void strip_mute_toggled(GtkWidget *, guint, port_status_t *);
+static void set_channel_mute(channel_status_t *, int);
+static GtkWidget *create_filter_buttons(port_status_t *);
+static void toggle_filter(GtkToggleButton *, port_status_t *);
+static void set_port_filter(port_status_t *, int);
+static int filter_category(int);
+static int is_viewed(int);
 static GtkWidget *display_midi_init(GtkWidget *, midi_status_t *);
 static cairo_surface_t *create_midi_pixmap(char *, int, int, int, int *);
 #ifdef USE_GTK4
@@ -205,51 +491,150 @@ static gboolean draw_temper_keysig(GtkWidget *, cairo_t *, gpointer);
 static gboolean draw_temper_type(GtkWidget *, cairo_t *, gpointer);
 #endif
 static gboolean update_time(gpointer);
-static void suppress_temper_type(GtkToggleButton *, midi_status_t *);
+static void toggle_temper_type(GtkToggleButton *, midi_status_t *);
+static void suppress_temper_type(midi_status_t *, int, int);
 static GtkWidget *create_pitch_changer(midi_status_t *);
 static void adjust_pitch(GtkAdjustment *, midi_status_t *);
 static GtkWidget *create_velocity_changer(midi_status_t *);
 static void adjust_velocity(GtkAdjustment *, midi_status_t *);
 static void restart_notes(midi_status_t *);
-static void send_notes_off(channel_status_t *);
+static unsigned int notes_off_mask(channel_status_t *, av_xform_t *);
+static void send_notes_off(port_status_t *, unsigned int);
 static void resume_notes_on(channel_status_t *);
+static void restart_channel(channel_status_t *, unsigned int, int);
+static void restart_ports(midi_shard_t *);
 static int port_subscribed(port_t *, int, snd_seq_event_t *, port_status_t *);
 static int port_unused(port_t *, int, snd_seq_event_t *, port_status_t *);
-static int process_event(port_t *, int, snd_seq_event_t *, port_status_t *);
-static void replace_event(port_t *, int, snd_seq_event_t *, port_status_t *);
+static int port_overrun(port_t *, int, snd_seq_event_t *, port_status_t *);
+static int port_route_changed(port_t *, int, snd_seq_event_t *, port_status_t *);
+static void add_viewer_handlers(port_status_t *);
+static void add_tuning_handlers(port_status_t *);
+static int ev_redirect(port_t *, int, snd_seq_event_t *, port_status_t *);
+static int ev_note(port_t *, int, snd_seq_event_t *, port_status_t *);
+static int ev_note_off(port_t *, int, snd_seq_event_t *, port_status_t *);
+static int ev_program(port_t *, int, snd_seq_event_t *, port_status_t *);
+static int ev_controller(port_t *, int, snd_seq_event_t *, port_status_t *);
+static int ev_pitch(port_t *, int, snd_seq_event_t *, port_status_t *);
+static int ev_sysex(port_t *, int, snd_seq_event_t *, port_status_t *);
+static int ev_tuning(port_t *, int, snd_seq_event_t *, port_status_t *);
+static int ev_echo(port_t *, int, snd_seq_event_t *, port_status_t *);
+static void replace_event(snd_seq_event_t *, port_status_t *);
 static void redirect_event(port_status_t *, snd_seq_event_t *);
+static int thin_event(port_status_t *, snd_seq_event_t *);
+static int send_held(port_status_t *, channel_status_t *, unsigned int, int);
+static void thin_timer(port_client_t *, midi_shard_t *);
+static void shard_timer(port_client_t *, midi_shard_t *);
+static int wire_bytes(snd_seq_event_t *);
+static void wire_add(port_status_t *, int, long long);
+static void pace_event(port_status_t *, snd_seq_event_t *);
+static int pace_held(port_status_t *, snd_seq_event_t *);
+static int pace_continues(port_status_t *, snd_seq_event_t *);
+static int pace_hold(port_status_t *, snd_seq_event_t *);
+static int pace_release(port_status_t *, long long);
+static void pace_pass(port_status_t *, snd_seq_event_t *, long long);
+static void wire_write(port_status_t *, snd_seq_event_t *, long long);
+static void pace_sysex(port_status_t *, snd_seq_event_t *, long long);
+static void pace_write(port_status_t *, unsigned char *, int, long long);
+static long long pace_run(port_status_t *, long long, int);
+static long long pace_send(port_status_t *, long long, int);
+static void pace_timer(midi_shard_t *);
+static gboolean update_wire(gpointer);
+static void av_wire_update(port_status_t *, int);
+static int xform_event(port_status_t *, av_xform_t *, snd_seq_event_t *,
+		       snd_seq_event_t *);
+static void send_event(port_status_t *, snd_seq_event_t *);
+static av_xform_t *xform_get(port_status_t *);
+static void xform_conf_init(av_xform_conf_t *);
+static av_xform_t *xform_compile(port_status_t *);
+static void xform_update(port_status_t *, int);
+static void xform_retire(port_status_t *, av_xform_t *);
+static gboolean xform_reclaim(gpointer);
+static int load_transform(midi_status_t *, const char *);
+static int parse_xform_line(av_xform_conf_t *, int, char **);
+static int parse_velocity(unsigned char *, int, char **);
+static int parse_number(const char *, int, int, int *);
+static int parse_target(const char *, int, int *);
+static void reload_transform(GtkButton *, midi_status_t *);
+static void shard_hook(port_client_t *, midi_shard_t *);
+static void update_routes(midi_status_t *);
+static void route_changed(port_status_t *);
+static void route_hook(port_client_t *, midi_shard_t *);
+static void route_update(port_status_t *);
+static int direct_wanted(port_status_t *);
+static int get_route_addrs(port_status_t *, int, snd_seq_addr_t *);
+static void route_switch(port_status_t *, int);
+static void route_unsubscribe(port_status_t *);
+static void send_route_echo(port_status_t *);
+static int route_pass(port_status_t *, snd_seq_event_t *);
 static void change_note(port_status_t *, int, int, int, int);
+static int note_index_set(av_note_index_t *, int, int);
+static int note_index_max_vel(av_note_index_t *);
+static int note_index_poly(av_note_index_t *);
 static void change_program(port_status_t *, int, int, int);
 static void change_controller(port_status_t *, int, int, int, int);
 static void all_sounds_off(channel_status_t *, int);
 static void reset_controllers(channel_status_t *, int);
 static void all_notes_off(channel_status_t *, int);
 static void change_pitch(port_status_t *, int, int, int);
+static void sysex_init(void);
+static void sysex_chunk(port_status_t *, snd_seq_event_t *, int);
+static av_sysex_slot_t *sysex_slot(port_status_t *, snd_seq_addr_t *, int);
 static void parse_sysex(port_status_t *, int, unsigned char *, int);
 static int get_channel(unsigned char);
 static void visualize_temper_type(midi_status_t *, int);
 static void reset_all(midi_status_t *, int, int, int);
+static void reset_ports(midi_shard_t *, int, int);
+static int on_shard(midi_shard_t *);
+static void reset_master(midi_status_t *);
 static void send_resets(channel_status_t *);
 static int is_redirect(port_status_t *);
-static void av_mute_update(GtkWidget *, int, int);
-static void set_vel_bar_color(GtkWidget *, int, int);
-static void av_channel_update(GtkWidget *, int, int);
-static void av_note_update(GtkWidget *, int, int, int);
-static void av_piano_reset(GtkWidget *, int);
-static void av_program_update(GtkWidget *, char *, int);
+static int is_continuous_ctrl(int);
+static int is_state_ctrl(int);
+static void av_mute_update(channel_status_t *, int, int);
+static void set_vel_bar_color(channel_status_t *);
+static void av_channel_update(channel_status_t *, int, int);
+static void av_note_update(channel_status_t *, int, int);
+static void av_piano_reset(channel_status_t *);
+static void av_program_update(channel_status_t *);
 static void display_midi_mode(GtkWidget *, int);
 static void display_temper_keysig(GtkWidget *, int);
-static void display_temper_type(GtkWidget *, int);
+static void display_master(GtkWidget *, int);
+static void display_temper_type(channel_status_t *);
+static GtkWidget *channel_widget(channel_status_t *, int);
+static void show_vel_color(channel_status_t *, int);
+static void show_value(channel_status_t *, int, int);
+static void show_poly(channel_status_t *, int);
+static void show_voices(midi_status_t *);
+static void show_program(channel_status_t *, const char *);
+static void show_temper(channel_status_t *);
+static void show_key(channel_status_t *, int, int);
+static cairo_surface_t *temper_icon(channel_status_t *);
+static unsigned int snap_begin(port_status_t *);
+static void snap_end(port_status_t *, unsigned int, int, unsigned int);
+static void snap_read(port_status_t *, av_channel_snap_t *);
+static void snap_fill(port_status_t *);
+static void av_snapshot_schedule(port_status_t *);
+static void av_snapshot_apply(port_status_t *, unsigned int);
 static void av_hide_tt_button(GtkWidget *, int, int);
-static void av_ringbuf_init(void);
-static void av_ringbuf_free(void);
-static int av_ringbuf_read(int *, GtkWidget **, long *);
+static void av_overrun_update(GtkWidget *, int, int);
+static void av_ringbuf_init(av_ringbuf_t *, int, int);
+static void av_ringbuf_free(av_ringbuf_t *);
+static int av_ringbuf_read(av_ringbuf_t *, int *, GtkWidget **, long *);
 static int av_ringbuf_write(int, GtkWidget *, long);
+static void av_ringbuf_process(midi_shard_t *);
+static void resync_shard(midi_shard_t *);
 static void *midi_loop(void *);
-static gboolean idle_cb(gpointer);
-static int get_file_desc(midi_status_t *);
+static int av_ringbuf_park(av_ringbuf_t *);
+static GSource *av_source_new(midi_status_t *);
+static gboolean av_source_dispatch(GSource *, GSourceFunc, gpointer);
 static gboolean handle_input(gint, GIOCondition, gpointer);
 static int set_realtime_priority(int);
+static int parse_flush(char *);
+static int parse_overload(char *);
+static int parse_filter(char *);
+static void print_stats(midi_status_t *);
+static void print_ringbuf_stats(midi_shard_t *);
+static void bench_watch(midi_status_t *);
 
 /*
  * local common variables
@@ -258,9 +643,55 @@ static int do_output = TRUE;
 static int rt_prio = FALSE;
 static int use_tuning_port = FALSE;
 static int use_thread = TRUE;
-static pthread_t midi_thread;
+/* ring buffer of the shard running in the current thread */
+static __thread av_ringbuf_t *cur_ringbuf;
 static int show_piano = TRUE;
 static int aseqview_cols = V_COLS;
+static int batch_size = 0;
+static int flush_policy = -1, flush_hold;
+static int show_stats = FALSE;
+static int num_shards = 1;
+static int pool_size[PORT_NUM_POOLS];
+static int backlog_size = -1, overload = -1;
+static int thin_period = 0;
+static int direct_route = FALSE;
+static int filter_mask[MAX_PORTS];
+static int ringbuf_size = 512;
+static int compact_view = FALSE;
+static int pace_output = FALSE;
+static char *transform_file;
+static int bench_frames;
+static long long bench_start;
+
+/*
+ * the port is redirected by ourselves
+ */
+static inline int route_is_user(port_status_t *port)
+{
+	return g_atomic_int_get(&port->route_state) == ROUTE_USER;
+}
+
+/* long-only options */
+enum {
+	OPT_BATCH = 0x100,
+	OPT_FLUSH,
+	OPT_STATS,
+	OPT_SHARDS,
+	OPT_POOL_INPUT,
+	OPT_POOL_OUTPUT,
+	OPT_INPUT_BUFFER,
+	OPT_OUTPUT_BUFFER,
+	OPT_BACKLOG,
+	OPT_OVERLOAD,
+	OPT_THIN,
+	OPT_DIRECT,
+	OPT_FILTER,
+	OPT_RINGBUF,
+	OPT_COMPACT,
+	OPT_PACE,
+	OPT_TRANSFORM,
+	OPT_BENCH
+};
 
 static struct option long_option[] = {
 	{ "nooutput", 0, NULL, 'o' },
@@ -273,6 +704,24 @@ static struct option long_option[] = {
 	{ "thread", 0, NULL, 't' },
 	{ "nothread", 0, NULL, 'm' },
 	{ "nopiano", 0, NULL, 'P' },
+	{ "batch", 1, NULL, OPT_BATCH },
+	{ "flush", 1, NULL, OPT_FLUSH },
+	{ "stats", 0, NULL, OPT_STATS },
+	{ "shards", 1, NULL, OPT_SHARDS },
+	{ "pool-input", 1, NULL, OPT_POOL_INPUT },
+	{ "pool-output", 1, NULL, OPT_POOL_OUTPUT },
+	{ "input-buffer", 1, NULL, OPT_INPUT_BUFFER },
+	{ "output-buffer", 1, NULL, OPT_OUTPUT_BUFFER },
+	{ "backlog", 1, NULL, OPT_BACKLOG },
+	{ "overload", 1, NULL, OPT_OVERLOAD },
+	{ "thin", 1, NULL, OPT_THIN },
+	{ "direct", 0, NULL, OPT_DIRECT },
+	{ "filter", 1, NULL, OPT_FILTER },
+	{ "ringbuf", 1, NULL, OPT_RINGBUF },
+	{ "compact", 0, NULL, OPT_COMPACT },
+	{ "pace", 0, NULL, OPT_PACE },
+	{ "transform", 1, NULL, OPT_TRANSFORM },
+	{ "bench", 1, NULL, OPT_BENCH },
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -281,7 +730,7 @@ static struct option long_option[] = {
  */
 int main(int argc, char **argv)
 {
-	int p, c;
+	int p, c, i;
 	int src_client[MAX_PORTS], src_port[MAX_PORTS];
 	int dest_client[MAX_PORTS], dest_port[MAX_PORTS];
 	int tuning_client = -1, tuning_port;
@@ -289,6 +738,7 @@ int main(int argc, char **argv)
 	midi_status_t *st;
 	port_status_t *port;
 	
+	bench_start = g_get_monotonic_time();
 #ifdef USE_GTK4
 	gtk_init();
 #else
@@ -337,6 +787,77 @@ int main(int argc, char **argv)
 			show_piano = FALSE;
 			aseqview_cols = V_COLS - 1;
 			break;
+		case OPT_BATCH:
+			batch_size = atoi(optarg);
+			break;
+		case OPT_FLUSH:
+			if (parse_flush(optarg) < 0) {
+				fprintf(stderr, "invalid argument %s for --flush\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_STATS:
+			show_stats = TRUE;
+			break;
+		case OPT_SHARDS:
+			num_shards = atoi(optarg);
+			break;
+		case OPT_POOL_INPUT:
+			pool_size[PORT_POOL_INPUT] = atoi(optarg);
+			break;
+		case OPT_POOL_OUTPUT:
+			pool_size[PORT_POOL_OUTPUT] = atoi(optarg);
+			break;
+		case OPT_INPUT_BUFFER:
+			pool_size[PORT_BUFFER_INPUT] = atoi(optarg);
+			break;
+		case OPT_OUTPUT_BUFFER:
+			pool_size[PORT_BUFFER_OUTPUT] = atoi(optarg);
+			break;
+		case OPT_BACKLOG:
+			backlog_size = atoi(optarg);
+			if (backlog_size < 0) {
+				fprintf(stderr, "invalid argument %s for --backlog\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_OVERLOAD:
+			if (parse_overload(optarg) < 0) {
+				fprintf(stderr, "invalid argument %s for --overload\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_THIN:
+			thin_period = atoi(optarg);
+			break;
+		case OPT_DIRECT:
+			direct_route = TRUE;
+			break;
+		case OPT_FILTER:
+			if (parse_filter(optarg) < 0) {
+				fprintf(stderr, "invalid argument %s for --filter\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_RINGBUF:
+			ringbuf_size = atoi(optarg);
+			break;
+		case OPT_COMPACT:
+			compact_view = TRUE;
+			break;
+		case OPT_PACE:
+			pace_output = TRUE;
+			break;
+		case OPT_TRANSFORM:
+			transform_file = optarg;
+			break;
+		case OPT_BENCH:
+			bench_frames = atoi(optarg);
+			if (bench_frames <= 0) {
+				fprintf(stderr, "invalid argument %s for --bench\n", optarg);
+				return 1;
+			}
+			break;
 		default:
 			usage();
 			return 1;
@@ -344,10 +865,54 @@ int main(int argc, char **argv)
 	}
 	if (num_ports < 1 || num_ports > MAX_PORTS)
 		g_error("invalid port numbers %d\n", num_ports);
+	if (num_shards < 1)
+		g_error("invalid shard numbers %d\n", num_shards);
+	if (ringbuf_size < 1 || ringbuf_size > 1 << 20)
+		g_error("invalid ring buffer size %d\n", ringbuf_size);
+	if (num_shards > num_ports)
+		num_shards = num_ports;
+	if (use_tuning_port && num_shards > 1) {
+		/* the tuning port feeds the ports of all shards */
+		fprintf(stderr, "--shards is ignored with -T\n");
+		num_shards = 1;
+	}
+	if (direct_route && (!do_output || use_tuning_port ||
+			     thin_period > 0 || pace_output)) {
+		fprintf(stderr, "--direct is ignored with -o, -T, --thin or --pace\n");
+		direct_route = FALSE;
+	}
+	if (!do_output)
+		pace_output = FALSE;
 	/* create instance */
-	st = midi_status_new(num_ports);
+	sysex_init();
+	st = midi_status_new(num_ports, num_shards);
+	if (transform_file) {
+		if (load_transform(st, transform_file) < 0)
+			return 1;
+		restart_notes(st);
+	}
+	for (i = 0; i < st->num_shards; i++) {
+		port_client_t *client = st->shards[i].client;
+		if (batch_size && port_client_set_batch(client, batch_size) < 0)
+			g_error("invalid batch size %d\n", batch_size);
+		if (flush_policy >= 0)
+			port_client_set_flush_policy(client, flush_policy, flush_hold);
+		for (c = 0; c < PORT_NUM_POOLS; c++)
+			if (pool_size[c] &&
+			    port_client_set_pool(client, c, pool_size[c]) < 0)
+				g_error("invalid pool size %d\n", pool_size[c]);
+		if ((backlog_size >= 0 || overload >= 0) &&
+		    port_client_set_backlog(client, backlog_size, overload) < 0)
+			g_error("invalid backlog size %d\n", backlog_size);
+		if (thin_period > 0 || pace_output)
+			port_client_set_timer(client, (port_timer_t) shard_timer,
+					      &st->shards[i]);
+		port_client_set_hook(client, (port_timer_t) shard_hook,
+				     &st->shards[i]);
+	}
 	for (p = 0; p < num_ports; p++) {
 		port = &st->ports[p];
+		set_port_filter(port, filter_mask[p]);
 		/* create window */
 		create_port_window(port);
 		/* add callbacks */
@@ -355,9 +920,18 @@ int main(int argc, char **argv)
 				(port_callback_t) port_subscribed, port);
 		port_add_callback(port->port, PORT_UNUSE_CB,
 				(port_callback_t) port_unused, port);
-		port_add_callback(port->port, PORT_MIDI_EVENT_CB,
-				(port_callback_t) process_event, port);
+		port_add_callback(port->port, PORT_OVERRUN_CB,
+				(port_callback_t) port_overrun, port);
+		if (direct_route) {
+			port_add_callback(port->port, PORT_USE_CB,
+					(port_callback_t) port_route_changed, port);
+			port_add_callback(port->port, PORT_UNSUBSCRIBE_CB,
+					(port_callback_t) port_route_changed, port);
+		}
+		add_viewer_handlers(port);
 	}
+	if (bench_frames)
+		bench_watch(st);
 	/* use tuning-control port */
 	if (use_tuning_port) {
 		port = st->tport;
@@ -365,11 +939,16 @@ int main(int argc, char **argv)
 				(port_callback_t) port_subscribed, port);
 		port_add_callback(port->port, PORT_UNUSE_CB,
 				(port_callback_t) port_unused, port);
-		port_add_callback(port->port, PORT_MIDI_EVENT_CB,
-				(port_callback_t) process_event, port);
+		add_tuning_handlers(port);
+	}
+	if (use_thread) {
+		st->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (st->wake_fd < 0)
+			g_error("can't create eventfd\n");
+		for (i = 0; i < st->num_shards; i++)
+			av_ringbuf_init(&st->shards[i].ringbuf, ringbuf_size,
+					st->wake_fd);
 	}
-	if (use_thread)
-		av_ringbuf_init();
 	/* explicit subscription to ports */
 	for (p = 0; p < num_ports; p++)
 		if (src_client[p] >= 0
@@ -386,11 +965,18 @@ int main(int argc, char **argv)
 	if (use_tuning_port && tuning_client >= 0
 			&& tuning_client != SND_SEQ_ADDRESS_SUBSCRIBERS)
 		port_connect_from(st->tport->port, tuning_client, tuning_port);
+	if (direct_route)
+		update_routes(st);
 	if (use_thread) {
-		pthread_create(&midi_thread, NULL, midi_loop, st);
-		g_idle_add(idle_cb, st);
+		st->loops_running = TRUE;
+		for (i = 0; i < st->num_shards; i++)
+			pthread_create(&st->shards[i].thread, NULL, midi_loop,
+				       &st->shards[i]);
+		st->w_source = av_source_new(st);
 	} else {
-		g_unix_fd_add(get_file_desc(st), G_IO_IN, handle_input, st);
+		for (i = 0; i < st->num_shards; i++)
+			g_unix_fd_add(port_client_get_fd(st->shards[i].client),
+				      G_IO_IN, handle_input, &st->shards[i]);
 		if (rt_prio)
 			set_realtime_priority(SCHED_FIFO);
 	}
@@ -401,12 +987,24 @@ int main(int argc, char **argv)
 	gtk_main();
 #endif
 	if (use_thread) {
-		port_client_stop(st->client);
-		pthread_join(midi_thread, NULL);
+		for (i = 0; i < st->num_shards; i++)
+			port_client_stop(st->shards[i].client);
+		for (i = 0; i < st->num_shards; i++) {
+			pthread_join(st->shards[i].thread, NULL);
+			av_ringbuf_free(&st->shards[i].ringbuf);
+		}
+		g_source_destroy(st->w_source);
+		g_source_unref(st->w_source);
+		close(st->wake_fd);
 	}
+	/* kernel routes outlive us */
+	for (p = 0; p < num_ports; p++)
+		if (st->ports[p].route_state >= ROUTE_ARMING &&
+		    st->ports[p].route_state <= ROUTE_DIRECT)
+			route_unsubscribe(&st->ports[p]);
+	if (show_stats)
+		print_stats(st);
 	midi_status_free(st);
-	if (use_thread)
-		av_ringbuf_free();
 #ifdef USE_GTK4
 	g_main_loop_unref(main_loop);
 #endif
@@ -480,18 +1078,379 @@ static void usage(void)
 	printf("   -t,--thread       use multi-threads (default)\n");
 	printf("   -m,--nothread     don't use multi-threads\n");
 	printf("   -P,--nopiano      don't show piano\n");
+	printf("   --batch #         max events dispatched per input batch\n");
+	printf("   --flush policy    output flush: immediate, batch or max-hold usec\n");
+	printf("   --stats           print engine statistics at exit\n");
+	printf("   --shards #        spread ports over # sequencer clients\n");
+	printf("   --pool-input #    kernel input pool size (events)\n");
+	printf("   --pool-output #   kernel output pool size (events)\n");
+	printf("   --input-buffer #  input buffer size (bytes)\n");
+	printf("   --output-buffer # output buffer size (bytes)\n");
+	printf("   --backlog #       events kept per port when output is busy\n");
+	printf("   --overload policy block, drop-newest, drop-oldest or coalesce\n");
+	printf("   --thin msec       thin out redirected controllers to one per msec\n");
+	printf("   --direct          route in the kernel while events are unchanged\n");
+	printf("   --filter [p:]list drop event categories on port p (default all):\n");
+	printf("                     pressure,control,program,pitch,sysex,clock,sensing\n");
+	printf("   --ringbuf #       GUI update buffer size per shard (default 512)\n");
+	printf("   --compact         draw the channels of a port in a single widget\n");
+	printf("   --pace            pace the redirected sysex to the MIDI wire speed\n");
+	printf("   --transform file  transform the redirected events as in the file\n");
+	printf("   --bench frames    time the startup and # redraws of all meters, then quit\n");
+}
+
+/*
+ * parse filtered event categories from command line;
+ * without a port number, they are set to all ports
+ */
+static int parse_filter(char *arg)
+{
+	char *sep, *tok;
+	int port = -1, mask = 0, i;
+
+	if (isdigit(*arg) && (sep = strchr(arg, ':')) != NULL) {
+		port = atoi(arg);
+		if (port >= MAX_PORTS)
+			return -1;
+		arg = sep + 1;
+	}
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		for (i = 0; i < NUM_FILTERS; i++)
+			if (!strcmp(tok, filter_names[i]))
+				break;
+		if (i >= NUM_FILTERS)
+			return -1;
+		mask |= 1 << i;
+	}
+	if (port >= 0)
+		filter_mask[port] = mask;
+	else
+		for (i = 0; i < MAX_PORTS; i++)
+			filter_mask[i] = mask;
+	return 0;
+}
+
+/*
+ * parse output flush policy from command line
+ */
+static int parse_flush(char *arg)
+{
+	if (!strcmp(arg, "immediate"))
+		flush_policy = PORT_FLUSH_IMMEDIATE;
+	else if (!strcmp(arg, "batch"))
+		flush_policy = PORT_FLUSH_BATCH;
+	else if (isdigit(*arg)) {
+		flush_policy = PORT_FLUSH_TIMED;
+		flush_hold = atoi(arg);
+	} else
+		return -1;
+	return 0;
+}
+
+/*
+ * parse output overload policy from command line
+ */
+static int parse_overload(char *arg)
+{
+	if (!strcmp(arg, "block"))
+		overload = PORT_OVERLOAD_BLOCK;
+	else if (!strcmp(arg, "drop-newest"))
+		overload = PORT_OVERLOAD_DROP_NEWEST;
+	else if (!strcmp(arg, "drop-oldest"))
+		overload = PORT_OVERLOAD_DROP_OLDEST;
+	else if (!strcmp(arg, "coalesce"))
+		overload = PORT_OVERLOAD_COALESCE;
+	else
+		return -1;
+	return 0;
+}
+
+/*
+ * read the transform file into the stages of the ports; the lines
+ * before the first "port" line apply to all ports.  on an error,
+ * the stages are left as they were.
+ */
+static int load_transform(midi_status_t *st, const char *file)
+{
+	FILE *fp;
+	av_xform_conf_t *conf;
+	char buf[256], *argv[XFORM_MAX_ARGS], *s;
+	int argc, line = 0, p, first = 0, last = st->num_ports, err = 0;
+
+	if ((fp = fopen(file, "r")) == NULL) {
+		perror(file);
+		return -1;
+	}
+	conf = g_new(av_xform_conf_t, st->num_ports);
+	for (p = 0; p < st->num_ports; p++)
+		xform_conf_init(&conf[p]);
+	while (!err && fgets(buf, sizeof(buf), fp)) {
+		line++;
+		if ((s = strchr(buf, '#')) != NULL)
+			*s = 0;
+		argc = 0;
+		for (s = strtok(buf, " \t\r\n"); s && argc < XFORM_MAX_ARGS;
+		     s = strtok(NULL, " \t\r\n"))
+			argv[argc++] = s;
+		if (!argc)
+			continue;
+		if (s)
+			err = -1;
+		else if (!strcmp(argv[0], "port")) {
+			if (argc != 2 ||
+			    parse_number(argv[1], 0, st->num_ports - 1, &p) < 0)
+				err = -1;
+			else
+				first = p, last = p + 1;
+		} else {
+			for (p = first; p < last && !err; p++)
+				err = parse_xform_line(&conf[p], argc, argv);
+		}
+	}
+	fclose(fp);
+	if (err) {
+		fprintf(stderr, "%s:%d: invalid transform\n", file, line);
+		g_free(conf);
+		return -1;
+	}
+	g_free(st->xconf);
+	st->xconf = conf;
+	return 0;
+}
+
+/*
+ * parse a line of the transform file:
+ *   channel CH OUT|drop
+ *   split CH LOW HIGH OUT|drop
+ *   transpose CH SEMITONES
+ *   velocity CH IN:OUT ...
+ *   control CH CC OUT|drop
+ *   drop CATEGORY
+ * CH is a channel number, or "*" for all channels
+ */
+static int parse_xform_line(av_xform_conf_t *conf, int argc, char **argv)
+{
+	unsigned char curve[MAX_MIDI_VALS];
+	int ch, first, last, lo, hi, val, i;
+
+	if (!strcmp(argv[0], "drop")) {
+		if (argc != 2)
+			return -1;
+		for (i = 0; i < NUM_FILTERS; i++)
+			if (!strcmp(argv[1], filter_names[i]))
+				break;
+		if (i >= NUM_FILTERS)
+			return -1;
+		for (val = 0; val < G_N_ELEMENTS(filter_types); val++)
+			if (filter_types[val].filter == i)
+				conf->drop[filter_types[val].type] = 1;
+		return 0;
+	}
+	if (argc < 3)
+		return -1;
+	if (!strcmp(argv[1], "*"))
+		first = 0, last = MIDI_CHANNELS;
+	else if (parse_number(argv[1], 0, MIDI_CHANNELS - 1, &first) < 0)
+		return -1;
+	else
+		last = first + 1;
+	if (!strcmp(argv[0], "channel") && argc == 3) {
+		if (parse_target(argv[2], MIDI_CHANNELS, &val) < 0)
+			return -1;
+		for (ch = first; ch < last; ch++)
+			conf->chan[ch] = val;
+	} else if (!strcmp(argv[0], "split") && argc == 5) {
+		if (parse_number(argv[2], 0, NUM_KEYS - 1, &lo) < 0 ||
+		    parse_number(argv[3], lo, NUM_KEYS - 1, &hi) < 0 ||
+		    parse_target(argv[4], MIDI_CHANNELS, &val) < 0)
+			return -1;
+		for (ch = first; ch < last; ch++)
+			memset(&conf->split[ch][lo], val, hi - lo + 1);
+	} else if (!strcmp(argv[0], "transpose") && argc == 3) {
+		if (parse_number(argv[2], -(NUM_KEYS - 1), NUM_KEYS - 1, &val) < 0)
+			return -1;
+		for (ch = first; ch < last; ch++)
+			conf->transpose[ch] = val;
+	} else if (!strcmp(argv[0], "velocity")) {
+		if (parse_velocity(curve, argc - 2, argv + 2) < 0)
+			return -1;
+		for (ch = first; ch < last; ch++)
+			memcpy(conf->vel[ch], curve, sizeof(curve));
+	} else if (!strcmp(argv[0], "control") && argc == 4) {
+		if (parse_number(argv[2], 0, NUM_CTRLS - 1, &i) < 0 ||
+		    parse_target(argv[3], NUM_CTRLS, &val) < 0)
+			return -1;
+		for (ch = first; ch < last; ch++)
+			conf->ctrl[ch][i] = val;
+	} else
+		return -1;
+	return 0;
+}
+
+/*
+ * parse a velocity curve: the points in the rising order of the
+ * input velocity, joined by straight lines from 0:0 up to 127:127
+ */
+static int parse_velocity(unsigned char *curve, int num, char **points)
+{
+	int i, v, in, out, pin = 0, pout = 0;
+	char c;
+
+	for (i = 0; i <= num; i++) {
+		if (i < num) {
+			if (sscanf(points[i], "%d:%d%c", &in, &out, &c) != 2 ||
+			    in < pin || in >= MAX_MIDI_VALS ||
+			    out < 0 || out >= MAX_MIDI_VALS)
+				return -1;
+		} else if (pin == MAX_MIDI_VALS - 1)
+			break;
+		else
+			in = out = MAX_MIDI_VALS - 1;
+		for (v = pin; v <= in; v++)
+			curve[v] = (in == pin) ? out :
+				pout + (out - pout) * (v - pin) / (in - pin);
+		pin = in, pout = out;
+	}
+	return num > 0 ? 0 : -1;
+}
+
+static int parse_number(const char *arg, int min, int max, int *val)
+{
+	char *end;
+	long v;
+
+	v = strtol(arg, &end, 10);
+	if (end == arg || *end || v < min || v > max)
+		return -1;
+	*val = v;
+	return 0;
+}
+
+/* a channel or a controller number, or "drop" */
+static int parse_target(const char *arg, int num, int *val)
+{
+	if (!strcmp(arg, "drop")) {
+		*val = XFORM_DROP;
+		return 0;
+	}
+	return parse_number(arg, 0, num - 1, val);
+}
+
+/*
+ * print out engine statistics
+ */
+static void print_stats(midi_status_t *st)
+{
+	port_client_stats_t cst, sst;
+	port_backlog_stats_t bst, pst;
+	unsigned long thin_saved = 0, route_switches = 0, rejected = 0;
+	unsigned long sysex_partial = 0, sysex_oversized = 0;
+	unsigned long pace_delayed = 0, pace_overflows = 0, pace_dropped = 0;
+	int i;
+
+	memset(&cst, 0, sizeof(cst));
+	memset(&bst, 0, sizeof(bst));
+	for (i = 0; i < st->num_ports; i++) {
+		port_get_backlog_stats(st->ports[i].port, &pst);
+		bst.queued += pst.queued;
+		bst.retried += pst.retried;
+		bst.dropped += pst.dropped;
+		bst.coalesced += pst.coalesced;
+		if (pst.max_depth > bst.max_depth)
+			bst.max_depth = pst.max_depth;
+		thin_saved += st->ports[i].thin_saved;
+		route_switches += st->ports[i].route_switches;
+		rejected += port_get_rejected(st->ports[i].port);
+		sysex_partial += st->ports[i].sysex_partial;
+		sysex_oversized += st->ports[i].sysex_oversized;
+		pace_delayed += st->ports[i].pace_delayed;
+		pace_overflows += st->ports[i].pace_overflows;
+		pace_dropped += st->ports[i].pace_dropped;
+	}
+	for (i = 0; i < st->num_shards; i++) {
+		port_client_get_stats(st->shards[i].client, &sst);
+		if (st->num_shards > 1)
+			fprintf(stderr, "shard %d: %lu events in %lu batches\n",
+				i, sst.events, sst.batches);
+		cst.events += sst.events;
+		cst.batches += sst.batches;
+		if (sst.max_batch > cst.max_batch)
+			cst.max_batch = sst.max_batch;
+		cst.flushes += sst.flushes;
+		if (sst.max_latency > cst.max_latency)
+			cst.max_latency = sst.max_latency;
+		cst.total_latency += sst.total_latency;
+		cst.queued += sst.queued;
+		cst.queue_depth += sst.queue_depth;
+		if (sst.queue_max > cst.queue_max)
+			cst.queue_max = sst.queue_max;
+		cst.queue_full += sst.queue_full;
+		cst.queue_lost += sst.queue_lost;
+		cst.overruns += sst.overruns;
+		if (use_thread)
+			print_ringbuf_stats(&st->shards[i]);
+	}
+	fprintf(stderr, "events: %lu in %lu batches (max batch %u)\n",
+		cst.events, cst.batches, cst.max_batch);
+	fprintf(stderr, "output flushes: %lu, hold avg %lu usec, max %lu usec\n",
+		cst.flushes,
+		cst.flushes ? (unsigned long)(cst.total_latency / cst.flushes) : 0,
+		cst.max_latency);
+	fprintf(stderr, "queued sends: %lu (max depth %u, left %u, "
+		"refused %lu, lost %lu)\n",
+		cst.queued, cst.queue_max, cst.queue_depth,
+		cst.queue_full, cst.queue_lost);
+	fprintf(stderr, "input overruns: %lu\n", cst.overruns);
+	fprintf(stderr, "filtered events: %lu\n", rejected);
+	fprintf(stderr, "output backlog: %lu queued, %lu retried, %lu dropped, "
+		"%lu coalesced (max depth %u)\n",
+		bst.queued, bst.retried, bst.dropped, bst.coalesced,
+		bst.max_depth);
+	if (thin_period > 0)
+		fprintf(stderr, "controller thinning saved %lu events\n",
+			thin_saved);
+	if (direct_route)
+		fprintf(stderr, "direct route switches: %lu\n", route_switches);
+	if (pace_output)
+		fprintf(stderr, "paced sysex: %lu delayed, %lu overflows, "
+			"%lu held events dropped\n",
+			pace_delayed, pace_overflows, pace_dropped);
+	fprintf(stderr, "sysex: %lu partial, %lu oversized\n",
+		sysex_partial, sysex_oversized);
+}
+
+/*
+ * print the accounting of the GUI update buffer of a shard
+ */
+static void print_ringbuf_stats(midi_shard_t *shard)
+{
+	static const char *names[NUM_UPDATES] = {
+		"mute", "snapshot", "mode", "keysig", "tt-button", "overrun",
+		"wire", "master"
+	};
+	av_ringbuf_t *rb = &shard->ringbuf;
+	int i;
+
+	fprintf(stderr, "shard %d: GUI updates max depth %u of %u, "
+		"%lu overflows\n",
+		shard->index, rb->max_depth, rb->size, rb->overflows);
+	for (i = 0; i < NUM_UPDATES; i++)
+		if (rb->drops[i])
+			fprintf(stderr, "  dropped %s: %lu\n",
+				names[i], rb->drops[i]);
 }
 
 /*
  * create midi_status_t instance;
  * sequencer is initialized here 
  */
-static midi_status_t *midi_status_new(int num_ports)
+static midi_status_t *midi_status_new(int num_ports, int num_shards)
 {
 	midi_status_t *st = g_malloc0(sizeof(*st));
 	int mode, p, i;
 	unsigned int caps;
 	port_status_t *port;
+	midi_shard_t *shard;
 	char name[32];
 	channel_status_t *chst;
 	
@@ -500,7 +1459,24 @@ static midi_status_t *midi_status_new(int num_ports)
 #else
 	mode = (do_output) ? SND_SEQ_OPEN : SND_SEQ_OPEN_IN;
 #endif
-	st->client = port_client_new("MIDI Viewer", mode, use_thread);
+	reset_master(st);
+	st->pitch_adj = 0;
+	st->vel_scale = 100;
+	st->xconf = g_new(av_xform_conf_t, num_ports);
+	for (p = 0; p < num_ports; p++)
+		xform_conf_init(&st->xconf[p]);
+	st->num_shards = num_shards;
+	st->shards = g_malloc0(sizeof(midi_shard_t) * num_shards);
+	for (i = 0; i < num_shards; i++) {
+		shard = &st->shards[i];
+		shard->main = st;
+		shard->index = i;
+		if (i)
+			sprintf(name, "MIDI Viewer %d", i);
+		else
+			strcpy(name, "MIDI Viewer");
+		shard->client = port_client_new(name, mode, use_thread);
+	}
 	caps = SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE;
 	if (do_output)
 		caps |= SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ;
@@ -510,9 +1486,14 @@ static midi_status_t *midi_status_new(int num_ports)
 		port = &st->ports[p];
 		port->main = st;
 		port->index = p;
+		port->shard = &st->shards[p % num_shards];
 		sprintf(name, "Viewer Port %d", p);
-		port->port = port_attach(st->client, name, caps,
+		port->port = port_attach(port->shard->client, name, caps,
 				SND_SEQ_PORT_TYPE_MIDI_GENERIC);
+		if (pace_output) {
+			port->pace_buf = g_malloc(PACE_ARENA);
+			port->hold_buf = g_malloc(PACE_HOLD);
+		}
 		/* initialize channels */
 		for (i = 0; i < MIDI_CHANNELS; i++) {
 			chst = &port->ch[i];
@@ -525,6 +1506,7 @@ static midi_status_t *midi_status_new(int num_ports)
 			chst->ctrl[MIDI_CTL_MSB_PAN] = 64;
 			chst->ctrl[MIDI_CTL_MSB_EXPRESSION] = 127;
 		}
+		atomic_init(&port->xform, xform_compile(port));
 	}
 	/* use tuning-control port */
 	if (use_tuning_port) {
@@ -533,7 +1515,8 @@ static midi_status_t *midi_status_new(int num_ports)
 		port = st->tport;
 		port->main = st;
 		port->index = -1;
-		port->port = port_attach(st->client, "Tuning-control Port", caps,
+		port->shard = &st->shards[0];
+		port->port = port_attach(port->shard->client, "Tuning-control Port", caps,
 				SND_SEQ_PORT_TYPE_MIDI_GENERIC);
 		memset(port->ch, 0, sizeof(port->ch));
 	}
@@ -544,9 +1527,25 @@ static midi_status_t *midi_status_new(int num_ports)
  */
 static void midi_status_free(midi_status_t *st)
 {
+	av_xform_t *xf;
+	int i;
+
+	for (i = 0; i < st->num_ports; i++) {
+		g_free(st->ports[i].pace_buf);
+		g_free(st->ports[i].hold_buf);
+		g_free(atomic_load(&st->ports[i].xform));
+	}
+	while ((xf = st->xform_retired) != NULL) {
+		st->xform_retired = xf->next;
+		g_free(xf);
+	}
+	if (st->xform_reclaim)
+		g_source_remove(st->xform_reclaim);
+	g_free(st->xconf);
 	g_free(st->ports);
 	if (use_tuning_port)
 		g_free(st->tport);
+	g_free(st->shards);
 	g_free(st);
 }
 
@@ -565,17 +1564,22 @@ static void create_port_window(port_status_t *port)
 {
 	GtkWidget *toplevel, *vbox, *vbox2, *hbox, *w;
 	char name[64];
-	int client = port_client_get_id(port->main->client);
+	int i;
+	int client = port_client_get_id(port->shard->client);
+	int port_id = port_get_port(port->port);
 	
 #ifdef USE_GTK4
 	toplevel = gtk_window_new();
 #else
 	toplevel = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 #endif
-	sprintf(name, "ASeqView %d:%d", client, port->index);
+	sprintf(name, "ASeqView %d:%d", client, port_id);
 	gtk_widget_set_name(toplevel, name);
-	sprintf(name, "ALSA Sequencer Viewer %d:%d", client, port->index);
+	sprintf(name, "ALSA Sequencer Viewer %d:%d", client, port_id);
 	gtk_window_set_title(GTK_WINDOW(toplevel), name);
+	g_object_set_data_full(G_OBJECT(toplevel), "title", g_strdup(name),
+			       g_free);
+	port->w_window = toplevel;
 #ifndef USE_GTK4
 	gtk_window_set_wmclass(GTK_WINDOW(toplevel), "aseqview", "ASeqView");
 #endif
@@ -589,9 +1593,12 @@ static void create_port_window(port_status_t *port)
 			G_CALLBACK(quit), NULL);
 #endif
 	vbox = gtk_vbox_new(FALSE, 0);
-	w = create_viewer(port);
+	w = compact_view ? create_strip(port) : create_viewer(port);
 	gtk_box_pack_start(GTK_BOX(vbox), w, TRUE, TRUE, 0);
 	gtk_widget_show(w);
+	w = create_filter_buttons(port);
+	gtk_box_pack_start(GTK_BOX(vbox), w, FALSE, FALSE, 0);
+	gtk_widget_show(w);
 	if (port->index == 0) {
 		/* control part */
 		w = gtk_hseparator_new(); 
@@ -621,6 +1628,13 @@ static void create_port_window(port_status_t *port)
 		w = create_velocity_changer(port->main);
 		gtk_box_pack_start(GTK_BOX(vbox2), w, TRUE, TRUE, 0);
 		gtk_widget_show(w);
+		if (transform_file) {
+			w = gtk_button_new_with_label("Reload Transform");
+			g_signal_connect(G_OBJECT(w), "clicked",
+					G_CALLBACK(reload_transform), port->main);
+			gtk_box_pack_start(GTK_BOX(vbox2), w, FALSE, FALSE, 0);
+			gtk_widget_show(w);
+		}
 		gtk_box_pack_start(GTK_BOX(hbox), vbox2, TRUE, TRUE, 0);
 		gtk_widget_show(vbox2);
 		gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 0);
@@ -633,6 +1647,14 @@ static void create_port_window(port_status_t *port)
 	gtk_container_add(GTK_CONTAINER(toplevel), vbox);
 #endif
 	gtk_widget_show(toplevel);
+	/* the icons are loaded with the first window */
+	if (compact_view)
+		for (i = 0; i < MIDI_CHANNELS; i++)
+			show_temper(&port->ch[i]);
+	if (use_thread) {
+		snap_fill(port);
+		av_snapshot_schedule(port);
+	}
 }
 
 /*
@@ -652,37 +1674,113 @@ static int quit(GtkWidget *w)
 #endif
 
 /*
- * create viewer widget
+ * benchmark: the startup is timed until every port window has been
+ * painted once, then the velocity meters of all ports are changed on
+ * each frame and the CPU time per frame is printed.
  */
-static GtkWidget *create_viewer(port_status_t *port)
+static int bench_painted, bench_frame;
+static double bench_cpu;
+
+static double bench_cpu_msec(void)
 {
-	GtkWidget *table;
-	int i;
-	
-	table = gtk_table_new(aseqview_cols, MIDI_CHANNELS + 1, FALSE);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static gboolean bench_tick(GtkWidget *w, GdkFrameClock *clock, gpointer data)
+{
+	midi_status_t *st = (midi_status_t *) data;
+	int p, ch;
+
+	if (bench_frame++ == bench_frames) {
+		printf("bench: %d redraws of %d meters, %.3f msec CPU per frame\n",
+		       bench_frames, st->num_ports * MIDI_CHANNELS,
+		       (bench_cpu_msec() - bench_cpu) / bench_frames);
 #ifdef USE_GTK4
-	gtk_grid_set_column_spacing(GTK_GRID(table), 4);
+		quit(NULL, NULL);
 #else
-	for (i = 0; i < aseqview_cols - 1; i++)
-		gtk_table_set_col_spacing(GTK_TABLE(table), i, 4);
+		quit(NULL);
 #endif
-	create_viewer_titles(table);
-	for (i = 0; i < MIDI_CHANNELS; i++)
-		create_channel_viewer(table, port, i);
-	return table;
+		return G_SOURCE_REMOVE;
+	}
+	for (p = 0; p < st->num_ports; p++)
+		for (ch = 0; ch < MIDI_CHANNELS; ch++)
+			show_value(&st->ports[p].ch[ch], V_VEL,
+				   (bench_frame * 7 + ch * 8 + p * 3) % 128);
+	return G_SOURCE_CONTINUE;
 }
 
-/*
- * create viewer title row
- */
-static void create_viewer_titles(GtkWidget *table)
+static void bench_after_paint(GdkFrameClock *clock, gpointer data)
 {
-	GtkWidget *w;
-	GtkTable *tbl = GTK_TABLE(table); /* GtkTable == GtkGrid under GTK4 via typedef */
-	
-	w = gtk_label_new("Ch");
-	gtk_table_attach_defaults(tbl, w, V_CHNUM, V_CHNUM + 1, 0, 1);
-	gtk_widget_show(w);
+	port_status_t *port = (port_status_t *) data;
+	midi_status_t *st = port->main;
+
+	g_signal_handlers_disconnect_by_func(clock, bench_after_paint, data);
+	if (++bench_painted < st->num_ports)
+		return;
+	printf("bench: %d ports%s painted in %.1f msec\n", st->num_ports,
+	       compact_view ? " (compact)" : "",
+	       (g_get_monotonic_time() - bench_start) / 1000.0);
+	bench_cpu = bench_cpu_msec();
+	gtk_widget_add_tick_callback(st->ports[0].w_window, bench_tick, st, NULL);
+}
+
+static void bench_map(GtkWidget *w, gpointer data)
+{
+	g_signal_handlers_disconnect_by_func(w, bench_map, data);
+	g_signal_connect(gtk_widget_get_frame_clock(w), "after-paint",
+			 G_CALLBACK(bench_after_paint), data);
+}
+
+/* GTK3 maps a toplevel already when it is shown */
+static void bench_watch(midi_status_t *st)
+{
+	GtkWidget *w;
+	int p;
+
+	for (p = 0; p < st->num_ports; p++) {
+		w = st->ports[p].w_window;
+		g_signal_connect(w, "map", G_CALLBACK(bench_map),
+				 &st->ports[p]);
+		if (gtk_widget_get_mapped(w))
+			bench_map(w, &st->ports[p]);
+	}
+}
+
+/*
+ * create viewer widget
+ */
+static GtkWidget *create_viewer(port_status_t *port)
+{
+	GtkWidget *table;
+	int i;
+	
+	table = gtk_table_new(aseqview_cols, MIDI_CHANNELS + 1, FALSE);
+#ifdef USE_GTK4
+	gtk_grid_set_column_spacing(GTK_GRID(table), 4);
+#else
+	for (i = 0; i < aseqview_cols - 1; i++)
+		gtk_table_set_col_spacing(GTK_TABLE(table), i, 4);
+#endif
+	create_viewer_titles(table);
+	for (i = 0; i < MIDI_CHANNELS; i++)
+		create_channel_viewer(table, port, i);
+	return table;
+}
+
+/*
+ * create viewer title row
+ */
+static void create_viewer_titles(GtkWidget *table)
+{
+	GtkWidget *w;
+	GtkTable *tbl = GTK_TABLE(table); /* GtkTable == GtkGrid under GTK4 via typedef */
+	
+	w = gtk_label_new("Ch");
+	gtk_table_attach_defaults(tbl, w, V_CHNUM, V_CHNUM + 1, 0, 1);
+	gtk_widget_show(w);
 	w = gtk_label_new("Prog");
 	gtk_table_attach_defaults(tbl, w, V_PROG, V_PROG + 1, 0, 1);
 	gtk_widget_show(w);
@@ -701,6 +1799,9 @@ static void create_viewer_titles(GtkWidget *table)
 	w = gtk_label_new("Pitch");
 	gtk_table_attach_defaults(tbl, w, V_PITCH, V_PITCH + 1, 0, 1);
 	gtk_widget_show(w);
+	w = gtk_label_new("Poly");
+	gtk_table_attach_defaults(tbl, w, V_POLY, V_POLY + 1, 0, 1);
+	gtk_widget_show(w);
 	w = gtk_label_new("");
 	gtk_table_attach_defaults(tbl, w, V_TEMPER, V_TEMPER + 1, 0, 1);
 	gtk_widget_show(w);
@@ -736,7 +1837,7 @@ static void create_channel_viewer(GtkWidget *table, port_status_t *st, int ch)
 	gtk_widget_show(w);
 	/* velocity */
 	w = chst->w_vel = level_bar_new(64, 16, 0, 127, 0);
-	set_vel_bar_color(w, chst->is_drum, 0);
+	show_vel_color(chst, chst->is_drum);
 	level_bar_set_level_color_rgb(w, 0xffff, 0xffff, 0x4000);
 	gtk_table_attach_defaults(tbl, w, V_VEL, V_VEL + 1, top, bottom);
 	gtk_widget_show(w);
@@ -760,6 +1861,10 @@ static void create_channel_viewer(GtkWidget *table, port_status_t *st, int ch)
 	channel_status_bar_set_color_rgb(w, 0x6000, 0xc000, 0xc000);
 	gtk_table_attach_defaults(tbl, w, V_PITCH, V_PITCH + 1, top, bottom);
 	gtk_widget_show(w);
+	/* polyphony */
+	w = chst->w_poly = gtk_label_new("0");
+	gtk_table_attach_defaults(tbl, w, V_POLY, V_POLY + 1, top, bottom);
+	gtk_widget_show(w);
 	/* temper type */
 	w = chst->w_temper_type = gtk_drawing_area_new();
 	gtk_widget_set_size_request(w, tt_width, tt_height);
@@ -776,26 +1881,174 @@ static void create_channel_viewer(GtkWidget *table, port_status_t *st, int ch)
 	gtk_widget_show(w);
 	/* piano */
 	if (show_piano) {
-		w = chst->w_piano = piano_new(NULL);
+		w = chst->w_piano = piano_new();
 		gtk_table_attach_defaults(tbl, w, V_PIANO, V_PIANO + 1, top, bottom);
 		gtk_widget_show(w);
 	}
 }
 
+/*
+ * create the compact viewer: one widget for all channels
+ */
+static GtkWidget *create_strip(port_status_t *port)
+{
+	GtkWidget *w;
+	int i;
+
+	w = port->w_strip = channel_strip_new(show_piano, tt_width, tt_height);
+	for (i = 0; i < MIDI_CHANNELS; i++) {
+		channel_strip_set_drum(w, i, port->ch[i].is_drum);
+		channel_strip_set_program(w, i, port->ch[i].progname);
+	}
+	g_signal_connect(G_OBJECT(w), "mute-toggled",
+			G_CALLBACK(strip_mute_toggled), port);
+	return w;
+}
+
 /*
  * mute/unmute a channel
  */
 static void mute_channel(GtkToggleButton *w, channel_status_t *chst)
 {
-	if (gtk_toggle_button_get_active(w)) {
-		chst->mute = 1;
-		if (is_redirect(chst->port))
-			send_notes_off(chst);
+	set_channel_mute(chst, gtk_toggle_button_get_active(w));
+}
+
+static void strip_mute_toggled(GtkWidget *w, guint ch, port_status_t *port)
+{
+	set_channel_mute(&port->ch[ch], channel_strip_get_mute(w, ch));
+}
+
+static void set_channel_mute(channel_status_t *chst, int mute)
+{
+	port_status_t *port = chst->port;
+
+	chst->mute = mute ? 1 : 0;
+	xform_update(port, FALSE);
+	if (mute) {
+		if (is_redirect(port))
+			restart_channel(chst, notes_off_mask(chst, xform_get(port)),
+					FALSE);
 	} else {
-		chst->mute = 0;
-		if (is_redirect(chst->port))
-			resume_notes_on(chst);
+		if (is_redirect(port) && route_is_user(port))
+			restart_channel(chst, 0, TRUE);
+	}
+	if (direct_route)
+		update_routes(chst->port->main);
+}
+
+/*
+ * create the filter toggles of a port
+ */
+static GtkWidget *create_filter_buttons(port_status_t *port)
+{
+	GtkWidget *hbox, *w;
+	int i;
+
+	hbox = gtk_hbox_new(FALSE, 0);
+	w = gtk_label_new("Filter:");
+	gtk_box_pack_start(GTK_BOX(hbox), w, FALSE, FALSE, 4);
+	gtk_widget_show(w);
+	for (i = 0; i < NUM_FILTERS; i++) {
+		w = gtk_toggle_button_new_with_label(filter_names[i]);
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(w),
+					     (port->filter >> i) & 1);
+		g_object_set_data(G_OBJECT(w), "filter", GINT_TO_POINTER(i));
+		g_signal_connect(G_OBJECT(w), "toggled",
+				G_CALLBACK(toggle_filter), port);
+		gtk_box_pack_start(GTK_BOX(hbox), w, FALSE, FALSE, 0);
+		gtk_widget_show(w);
+	}
+	if (pace_output) {
+		w = gtk_label_new("Wire:");
+		gtk_box_pack_start(GTK_BOX(hbox), w, FALSE, FALSE, 4);
+		gtk_widget_show(w);
+		w = port->w_wire = solid_bar_new(100, 16, 0, 100, 0, FALSE);
+		channel_status_bar_set_color_rgb(w, 0xffff, 0xc000, 0x4000);
+		gtk_box_pack_start(GTK_BOX(hbox), w, FALSE, FALSE, 0);
+		gtk_widget_show(w);
+	}
+	return hbox;
+}
+
+/*
+ * show how long the modelled wire of the port is busy; the meter
+ * runs only until the wire is idle, and the MIDI thread starts it
+ * again when the wire gets busy
+ */
+static gboolean update_wire(gpointer data)
+{
+	port_status_t *port = (port_status_t *) data;
+	long long busy, now = g_get_monotonic_time();
+
+	busy = atomic_load(&port->wire_until) - now;
+	if (busy <= 0) {
+		atomic_store(&port->wire_shown, 0);
+		/* unless the wire got busy meanwhile, unnoticed */
+		busy = atomic_load(&port->wire_until) - now;
+		if (busy <= 0 || atomic_exchange(&port->wire_shown, 1)) {
+			channel_status_bar_update(port->w_wire, 0);
+			port->wire_timer = 0;
+			return FALSE;
+		}
+	}
+	if (busy > WIRE_FULL_USEC)
+		busy = WIRE_FULL_USEC;
+	channel_status_bar_update(port->w_wire, busy * 100 / WIRE_FULL_USEC);
+	return TRUE;
+}
+
+/*
+ * start the wire meter
+ */
+static void av_wire_update(port_status_t *port, int in_buf)
+{
+	if (in_buf)
+		av_ringbuf_write(UPDATE_WIRE, NULL, port->index);
+	else if (port->w_wire && !port->wire_timer)
+		port->wire_timer = g_timeout_add(100, update_wire, port);
+}
+
+/*
+ * filter/unfilter an event category
+ */
+static void toggle_filter(GtkToggleButton *w, port_status_t *port)
+{
+	int bit = 1 << GPOINTER_TO_INT(g_object_get_data(G_OBJECT(w), "filter"));
+
+	if (gtk_toggle_button_get_active(w))
+		set_port_filter(port, port->filter | bit);
+	else
+		set_port_filter(port, port->filter & ~bit);
+}
+
+/*
+ * set the filtered categories of a viewer port; filtered events
+ * are neither shown nor redirected.  in read-only mode, the types
+ * without a viewer are always rejected.
+ */
+static void set_port_filter(port_status_t *port, int mask)
+{
+	int type, cat;
+
+	port->filter = mask;
+	for (type = 0; type < 256; type++) {
+		cat = filter_category(type);
+		port_set_event_filter(port->port, type,
+				(cat >= 0 && ((mask >> cat) & 1)) ||
+				(!do_output && !is_viewed(type)));
 	}
+	if (direct_route)
+		route_changed(port);
+}
+
+static int filter_category(int type)
+{
+	int i;
+
+	for (i = 0; i < G_N_ELEMENTS(filter_types); i++)
+		if (filter_types[i].type == type)
+			return filter_types[i].filter;
+	return -1;
 }
 
 /*
@@ -875,13 +2128,21 @@ static GtkWidget *display_midi_init(GtkWidget *window, midi_status_t *st)
 	g_timeout_add(1000, update_time, w);
 	gtk_box_pack_start(GTK_BOX(hbox), w, TRUE, TRUE, 0);
 	gtk_widget_show(w);
+	w = st->w_voices = gtk_label_new("Voices: 0");
+	gtk_box_pack_start(GTK_BOX(hbox), w, TRUE, TRUE, 0);
+	gtk_widget_show(w);
+	w = st->w_master = gtk_label_new(NULL);
+	g_object_set_data(G_OBJECT(w), "midi_st", st);
+	gtk_box_pack_start(GTK_BOX(hbox), w, TRUE, TRUE, 0);
+	gtk_widget_show(w);
+	display_master(w, FALSE);
 	table = gtk_table_new(4, 2, FALSE);
 	for (i = 0; i < 8; i++) {
 		w = st->w_tt_button[i] = gtk_toggle_button_new_with_label(tmp[i]);
 		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(w), FALSE);
 		gtk_toggle_button_set_mode(GTK_TOGGLE_BUTTON(w), TRUE);
 		g_signal_connect(G_OBJECT(w), "clicked",
-				G_CALLBACK(suppress_temper_type), st);
+				G_CALLBACK(toggle_temper_type), st);
 		gtk_table_attach_defaults(GTK_TABLE(table),
 				w, i % 4, i % 4 + 1, i / 4, i / 4 + 1);
 		gtk_widget_show(w);
@@ -1028,18 +2289,10 @@ static gboolean draw_temper_keysig(GtkWidget *w, cairo_t *cr, gpointer data)
 static void draw_temper_type_impl(GObject *obj, cairo_t *cr, int width, int height)
 {
 	channel_status_t *chst = g_object_get_data(obj, "chst_data");
-	midi_status_t *st = chst->port->main;
-	int tk = st->temper_keysig, tt = chst->temper_type, i;
-	cairo_surface_t *p;
 	int x_ofs = (width - tt_width) / 2;
 	int y_ofs = (height - tt_height - 6) / 2;
 
-	if ((tt >= 0 && tt < 4) || (tt >= 64 && tt < 68))
-		i = (tk == TEMPER_UNKNOWN) ? 0 : tt - ((tt >= 0x40) ? 0x3c : 0) + 1;
-	else
-		i = 0;
-	p = st->w_tt_xpm[i];
-	cairo_set_source_surface(cr, p, x_ofs, y_ofs);
+	cairo_set_source_surface(cr, temper_icon(chst), x_ofs, y_ofs);
 	cairo_paint(cr);
 }
 
@@ -1076,7 +2329,8 @@ static gboolean update_time(gpointer data)
 		qst = alloca(sizeof(snd_seq_queue_status_t));
 #endif
 		st->timer_update = FALSE;
-		if (!snd_seq_get_queue_status(port_client_get_seq(st->client),
+		if (!snd_seq_get_queue_status(
+				port_client_get_seq(st->shards[0].client),
 				st->queue, qst)) {
 #ifdef ALSA_API_ENCAP
 			rt = snd_seq_queue_status_get_real_time(qst);
@@ -1092,24 +2346,36 @@ static gboolean update_time(gpointer data)
 }
 
 /*
+ * a temperament type button is clicked
+ */
+static void toggle_temper_type(GtkToggleButton *w, midi_status_t *st)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		if (w == GTK_TOGGLE_BUTTON(st->w_tt_button[i]))
+			suppress_temper_type(st, i, FALSE);
+}
+
+/*
+ * toggle the mute of a temperament type; from the MIDI threads
+ * (in_buf), the mutes are passed to the GUI through the ring buffer
  */
-static void suppress_temper_type(GtkToggleButton *w, midi_status_t *st)
+static void suppress_temper_type(midi_status_t *st, int type, int in_buf)
 {
 	int i, p, tt;
 	port_status_t *port;
 	channel_status_t *chst;
 	
-	for (i = 0; i < 8; i++)
-		if (w == GTK_TOGGLE_BUTTON(st->w_tt_button[i]))
-			st->temper_type_mute ^= 1 << i;
+	st->temper_type_mute ^= 1 << type;
 	for (p = 0; p < st->num_ports; p++) {
 		if ((port = &st->ports[p])->index < 0)
 			continue;
 		for (i = 0; i < MIDI_CHANNELS; i++) {
 			chst = &port->ch[i], tt = chst->temper_type;
 			if ((tt >= 0 && tt < 4) || (tt >= 64 && tt < 68))
-				av_mute_update(chst->w_chnum, st->temper_type_mute
-					       & (1 << (tt - (tt >= 0x40) ? 0x3c : 0)), use_thread);
+				av_mute_update(chst, st->temper_type_mute
+					       & (1 << (tt - (tt >= 0x40) ? 0x3c : 0)), in_buf);
 		}
 	}
 }
@@ -1142,6 +2408,8 @@ static void adjust_pitch(GtkAdjustment *adj, midi_status_t *st)
 	if (v != st->pitch_adj) {
 		st->pitch_adj = v;
 		restart_notes(st);
+		if (direct_route)
+			update_routes(st);
 	}
 }
 
@@ -1173,38 +2441,73 @@ static void adjust_velocity(GtkAdjustment *adj, midi_status_t *st)
 	if (v != st->vel_scale) {
 		st->vel_scale = v;
 		restart_notes(st);
+		if (direct_route)
+			update_routes(st);
 	}
 }
 
 /*
- * restart notes with new adjustment
+ * compile the transforms with new adjustment and restart notes;
+ * ports on a kernel route are restarted when they are back
  */
 static void restart_notes(midi_status_t *st)
 {
-	int p, i;
-	port_status_t *port;
-	
+	int p;
+
 	for (p = 0; p < st->num_ports; p++)
-		if (is_redirect(port = &st->ports[p]))
-			for (i = 0; i < MIDI_CHANNELS; i++) {
-				send_notes_off(&port->ch[i]);
-				resume_notes_on(&port->ch[i]);
-			}
+		xform_update(&st->ports[p], TRUE);
 }
 
 /*
- * stop all sounds on the given channel:
- * send ALL_NOTES_OFF control to the subscriber port
+ * reload the transform file from the button
+ */
+static void reload_transform(GtkButton *w, midi_status_t *st)
+{
+	if (load_transform(st, transform_file) < 0)
+		return;
+	restart_notes(st);
+	if (direct_route)
+		update_routes(st);
+}
+
+/*
+ * the output channels the notes of the channel are sent to by the
+ * transform, or the channel itself without a transform
+ */
+static unsigned int notes_off_mask(channel_status_t *chst, av_xform_t *xf)
+{
+	unsigned int mask;
+	int i;
+
+	if (!xf)
+		return 1 << chst->ch;
+	mask = 0;
+	if (xf->chan[chst->ch] != XFORM_DROP)
+		mask |= 1 << xf->chan[chst->ch];
+	for (i = 0; i < NUM_KEYS; i++)
+		if (xf->note_ch[chst->ch][i] != XFORM_DROP)
+			mask |= 1 << xf->note_ch[chst->ch][i];
+	return mask;
+}
+
+/*
+ * stop all sounds on the given output channels:
+ * send ALL_SOUNDS_OFF control to the subscriber port
  */
-static void send_notes_off(channel_status_t *chst)
+static void send_notes_off(port_status_t *port, unsigned int mask)
 {
 	snd_seq_event_t tmpev;
+	int i;
 	
 	snd_seq_ev_clear(&tmpev);
 	snd_seq_ev_set_direct(&tmpev);
 	snd_seq_ev_set_subs(&tmpev);
-	snd_seq_ev_set_controller(&tmpev, chst->ch, MIDI_CTL_ALL_SOUNDS_OFF, 0);
-	port_write_event(chst->port->port, &tmpev, 1);
+	for (i = 0; i < MIDI_CHANNELS; i++) {
+		if (!(mask & (1 << i)))
+			continue;
+		snd_seq_ev_set_controller(&tmpev, i, MIDI_CTL_ALL_SOUNDS_OFF, 0);
+		port_write_event(port->port, &tmpev, 1);
+	}
 }
 
 /*
@@ -1213,32 +2516,69 @@ static void send_notes_off(channel_status_t *chst)
  */
 static void resume_notes_on(channel_status_t *chst)
 {
-	snd_seq_event_t tmpev;
-	int i, key, vel;
+	snd_seq_event_t tmpev, out;
+	int n;
 	port_status_t *port = chst->port;
-	int pitch_adj = port->main->pitch_adj;
-	int vel_scale = port->main->vel_scale;
+	av_note_index_t *idx = &chst->notes;
+	av_xform_t *xf = xform_get(port);
 	
 	snd_seq_ev_clear(&tmpev);
-	snd_seq_ev_set_direct(&tmpev);
-	snd_seq_ev_set_subs(&tmpev);
-	for (i = 0; i < NUM_KEYS; i++) {
-		if (chst->vel[i]) {
-			key = i;
-			if (!chst->is_drum)
-				key += pitch_adj;
-			if (key >= 128)
-				key = 127;
-			vel = ((int) chst->vel[i] * vel_scale) / 100;
-			if (vel >= 128)
-				vel = 127;
-			snd_seq_ev_set_noteon(&tmpev, chst->ch, key, vel);
-			port_write_event(port->port, &tmpev, 0);
-		}
+	for (n = idx->next[0]; n; n = idx->next[n]) {
+		snd_seq_ev_set_noteon(&tmpev, chst->ch, n - 1, idx->vel[n - 1]);
+		if (xform_event(port, xf, &tmpev, &out))
+			port_write_event(port->port, &out, 0);
 	}
 	port_flush_event(port->port);
 }
 
+/*
+ * stop the notes of the channel on the given output channels, and
+ * start them again through the current transform with resume; the
+ * note index belongs to the loop of the shard, so other threads
+ * pass the work there in the same order
+ */
+static void restart_channel(channel_status_t *chst, unsigned int off,
+			    int resume)
+{
+	port_status_t *port = chst->port;
+	midi_shard_t *shard = port->shard;
+
+	if (on_shard(shard)) {
+		send_notes_off(port, off);
+		if (resume)
+			resume_notes_on(chst);
+		return;
+	}
+	atomic_fetch_or(&port->notes_off[chst->ch], off);
+	if (resume)
+		atomic_fetch_or(&port->notes_resume, 1U << chst->ch);
+	atomic_fetch_or(&shard->requests, REQ_RESTART);
+	port_client_wakeup(shard->client);
+}
+
+/*
+ * do the restarts passed to the loop of the shard
+ */
+static void restart_ports(midi_shard_t *shard)
+{
+	midi_status_t *st = shard->main;
+	port_status_t *port;
+	unsigned int resume;
+	int p, i;
+
+	for (p = 0; p < st->num_ports; p++) {
+		port = &st->ports[p];
+		if (port->shard != shard)
+			continue;
+		resume = atomic_exchange(&port->notes_resume, 0);
+		for (i = 0; i < MIDI_CHANNELS; i++) {
+			send_notes_off(port, atomic_exchange(&port->notes_off[i], 0));
+			if (resume & (1U << i))
+				resume_notes_on(&port->ch[i]);
+		}
+	}
+}
+
 /*
  * read-subscription callback from portlib:
  * if the first client appears, reset MIDI
@@ -1248,6 +2588,8 @@ static int port_subscribed(port_t *p,
 {
 	if (port_num_subscription(p, SND_SEQ_QUERY_SUBS_READ) == 1)
 		reset_all(port->main, MIDI_MODE_GM, TRUE, use_thread);
+	if (direct_route)
+		route_changed(port);
 	return 0;
 }
 
@@ -1260,65 +2602,244 @@ static int port_unused(port_t *p,
 {
 	if (port_num_subscription(p, SND_SEQ_QUERY_SUBS_WRITE) == 0)
 		reset_all(port->main, MIDI_MODE_GM, TRUE, use_thread);
+	if (direct_route)
+		route_changed(port);
 	return 0;
 }
 
 /*
- * callback from portlib - process a received MIDI event
+ * other subscription changes: the kernel routes follow them
  */
-static int process_event(port_t *p,
+static int port_route_changed(port_t *p,
 		int type, snd_seq_event_t *ev, port_status_t *port)
 {
-	if (port->index == -1) {
-		replace_event(p, type, ev, port);
-		return 0;
+	route_changed(port);
+	return 0;
+}
+
+/*
+ * input overrun: events were lost in the kernel
+ */
+static int port_overrun(port_t *p,
+		int type, snd_seq_event_t *ev, port_status_t *port)
+{
+	av_overrun_update(port->w_window, port_get_overruns(p), use_thread);
+	return 0;
+}
+
+/*
+ * register the event handlers of a viewer port;
+ * in read-only mode, event types without a viewer handler
+ * are dropped by portlib before reaching here
+ */
+static const struct {
+	int type;
+	port_callback_t func;
+} viewer_handlers[] = {
+	{ SND_SEQ_EVENT_NOTEON, (port_callback_t) ev_note },
+	{ SND_SEQ_EVENT_KEYPRESS, (port_callback_t) ev_note },
+	{ SND_SEQ_EVENT_NOTEOFF, (port_callback_t) ev_note_off },
+	{ SND_SEQ_EVENT_PGMCHANGE, (port_callback_t) ev_program },
+	{ SND_SEQ_EVENT_CONTROLLER, (port_callback_t) ev_controller },
+	{ SND_SEQ_EVENT_PITCHBEND, (port_callback_t) ev_pitch },
+	{ SND_SEQ_EVENT_SYSEX, (port_callback_t) ev_sysex },
+};
+
+static void add_viewer_handlers(port_status_t *port)
+{
+	int i;
+
+	/* redirection comes first */
+	if (do_output)
+		for (i = 0; i < 256; i++)
+			port_add_event_callback(port->port, i,
+					(port_callback_t) ev_redirect, port);
+	if (direct_route)
+		port_add_event_callback(port->port, SND_SEQ_EVENT_ECHO,
+				(port_callback_t) ev_echo, port);
+	for (i = 0; i < G_N_ELEMENTS(viewer_handlers); i++)
+		port_add_event_callback(port->port, viewer_handlers[i].type,
+				viewer_handlers[i].func, port);
+}
+
+/*
+ * the event type is shown by the viewer
+ */
+static int is_viewed(int type)
+{
+	int i;
+
+	for (i = 0; i < G_N_ELEMENTS(viewer_handlers); i++)
+		if (viewer_handlers[i].type == type)
+			return TRUE;
+	return FALSE;
+}
+
+/*
+ * register the event handlers of the tuning-control port
+ */
+static void add_tuning_handlers(port_status_t *port)
+{
+	static const int types[] = {
+		SND_SEQ_EVENT_NOTE, SND_SEQ_EVENT_NOTEON,
+		SND_SEQ_EVENT_NOTEOFF, SND_SEQ_EVENT_KEYPRESS,
+		SND_SEQ_EVENT_PGMCHANGE, SND_SEQ_EVENT_CONTROLLER,
+	};
+	int i, type;
+
+	for (i = 0; i < G_N_ELEMENTS(types); i++)
+		port_add_event_callback(port->port, types[i],
+				(port_callback_t) ev_tuning, port);
+	/* reject the rest, so that it doesn't keep the kernel
+	 * filter of the shard from taking effect
+	 */
+	for (type = 0; type < 256; type++) {
+		for (i = 0; i < G_N_ELEMENTS(types); i++)
+			if (types[i] == type)
+				break;
+		port_set_event_filter(port->port, type, i >= G_N_ELEMENTS(types));
 	}
-	if (port->index < 0)
-		return 0;
+}
+
+/*
+ * remember the queue of the last event for the time display
+ */
+static inline void mark_queue(port_status_t *port, snd_seq_event_t *ev)
+{
 	port->main->timer_update = TRUE;
 	port->main->queue = ev->queue;
-	if (is_redirect(port))
-		redirect_event(port, ev);
-	switch (ev->type) {
-	case SND_SEQ_EVENT_NOTEON:
-	case SND_SEQ_EVENT_KEYPRESS:
-		change_note(port, ev->data.note.channel,
-				ev->data.note.note, ev->data.note.velocity, use_thread);
-		break;
-	case SND_SEQ_EVENT_NOTEOFF:
-		change_note(port, ev->data.note.channel,
-				ev->data.note.note, 0, use_thread);
-		break;
-	case SND_SEQ_EVENT_PGMCHANGE:
-		change_program(port, ev->data.control.channel,
-				ev->data.control.value, use_thread);
-		break;
-	case SND_SEQ_EVENT_CONTROLLER:
-		change_controller(port, ev->data.control.channel,
-				ev->data.control.param, ev->data.control.value, use_thread);
-		break;
-	case SND_SEQ_EVENT_PITCHBEND:
-		change_pitch(port, ev->data.control.channel,
-				ev->data.control.value, use_thread);
-		break;
-	case SND_SEQ_EVENT_SYSEX:
-		parse_sysex(port, ev->data.ext.len,
-				ev->data.ext.ptr, use_thread);
-		break;
-	}
-	return 0;
 }
 
 /*
+ * event handlers from portlib
  */
-static void replace_event(port_t *pp,
-		int type, snd_seq_event_t *ev, port_status_t *tport)
+static int ev_redirect(port_t *p,
+		int type, snd_seq_event_t *ev, port_status_t *port)
 {
-	static unsigned char tk_macro[] = {
-		0xf0, 0x7f, 0x10, 0x08, 0x0a, 0x40, 0x00, 0xf7
-	};
-	static unsigned char tt_macro[] = {
-		0xf0, 0x7f, 0x10, 0x08, 0x0b, 0x03, 0x7b, 0x7f, 0x00, 0xf7
+	mark_queue(port, ev);
+	if (is_redirect(port) && route_pass(port, ev))
+		redirect_event(port, ev);
+	return 0;
+}
+
+static int ev_note(port_t *p,
+		int type, snd_seq_event_t *ev, port_status_t *port)
+{
+	mark_queue(port, ev);
+	change_note(port, ev->data.note.channel,
+			ev->data.note.note, ev->data.note.velocity, use_thread);
+	return 0;
+}
+
+static int ev_note_off(port_t *p,
+		int type, snd_seq_event_t *ev, port_status_t *port)
+{
+	mark_queue(port, ev);
+	change_note(port, ev->data.note.channel,
+			ev->data.note.note, 0, use_thread);
+	return 0;
+}
+
+static int ev_program(port_t *p,
+		int type, snd_seq_event_t *ev, port_status_t *port)
+{
+	mark_queue(port, ev);
+	change_program(port, ev->data.control.channel,
+			ev->data.control.value, use_thread);
+	return 0;
+}
+
+static int ev_controller(port_t *p,
+		int type, snd_seq_event_t *ev, port_status_t *port)
+{
+	mark_queue(port, ev);
+	change_controller(port, ev->data.control.channel,
+			ev->data.control.param, ev->data.control.value, use_thread);
+	return 0;
+}
+
+static int ev_pitch(port_t *p,
+		int type, snd_seq_event_t *ev, port_status_t *port)
+{
+	mark_queue(port, ev);
+	change_pitch(port, ev->data.control.channel,
+			ev->data.control.value, use_thread);
+	return 0;
+}
+
+static int ev_sysex(port_t *p,
+		int type, snd_seq_event_t *ev, port_status_t *port)
+{
+	mark_queue(port, ev);
+	sysex_chunk(port, ev, use_thread);
+	return 0;
+}
+
+static int ev_tuning(port_t *p,
+		int type, snd_seq_event_t *ev, port_status_t *port)
+{
+	replace_event(ev, port);
+	return 0;
+}
+
+/*
+ * echo to ourselves: the subscriptions of a route switch are
+ * settled up to this point
+ */
+static int ev_echo(port_t *p,
+		int type, snd_seq_event_t *ev, port_status_t *port)
+{
+	int i;
+
+	if (ev->source.client != port_client_get_id(port->shard->client))
+		return 0;
+	switch (port->route_state) {
+	case ROUTE_ARMING:
+		g_atomic_int_set(&port->route_state, ROUTE_ENTERING);
+		return 0;
+	case ROUTE_RELEASING:
+		g_atomic_int_set(&port->route_state, ROUTE_LEAVING);
+		return 0;
+	case ROUTE_ENTERING:
+		if (port->num_route_src) {
+			g_atomic_int_set(&port->route_state, ROUTE_DIRECT);
+			break;
+		}
+		/* no route was made; fall through */
+	case ROUTE_LEAVING:
+		port->num_route_src = port->num_route_dst = 0;
+		g_atomic_int_set(&port->route_state, ROUTE_USER);
+		/* held notes were played unchanged; restart them as
+		 * the GUI skipped it meanwhile
+		 */
+		if (direct_wanted(port))
+			break;
+		for (i = 0; i < MIDI_CHANNELS; i++) {
+			if (!note_index_poly(&port->ch[i].notes) &&
+			    !port->ch[i].mute)
+				continue;
+			send_notes_off(port, notes_off_mask(&port->ch[i], NULL));
+			if (!port->ch[i].mute)
+				resume_notes_on(&port->ch[i]);
+		}
+		break;
+	default:
+		return 0;
+	}
+	/* the settings may have changed during the switch */
+	route_changed(port);
+	return 0;
+}
+
+/*
+ */
+static void replace_event(snd_seq_event_t *ev, port_status_t *tport)
+{
+	static unsigned char tk_macro[] = {
+		0xf0, 0x7f, 0x10, 0x08, 0x0a, 0x40, 0x00, 0xf7
+	};
+	static unsigned char tt_macro[] = {
+		0xf0, 0x7f, 0x10, 0x08, 0x0b, 0x03, 0x7b, 0x7f, 0x00, 0xf7
 	};
 	static unsigned char key2sf[] = {
 		0x40, 0x3b, 0x42, 0x3d, 0x44, 0x3f,
@@ -1339,13 +2860,13 @@ static void replace_event(port_t *pp,
 			snd_seq_ev_clear(ev);
 			snd_seq_ev_set_sysex(ev, sizeof(tk_macro), tk_macro);
 			ev->queue = st->queue;
-			process_event(pp, type, ev, &st->ports[0]);
+			port_dispatch_event(st->ports[0].port, ev);
 		} else if ((tk + 8) & 0x20) {
 			tk_macro[6] = (mi) ? 1 : 0;
 			snd_seq_ev_clear(ev);
 			snd_seq_ev_set_sysex(ev, sizeof(tk_macro), tk_macro);
 			ev->queue = st->queue;
-			process_event(pp, type, ev, &st->ports[0]);
+			port_dispatch_event(st->ports[0].port, ev);
 		}
 	} else if (ev->type == SND_SEQ_EVENT_PGMCHANGE) {
 		tt_macro[8] = ev->data.control.value;
@@ -1360,14 +2881,14 @@ static void replace_event(port_t *pp,
 			tt_macro[7] = ttch & 0x7f;
 			snd_seq_ev_set_sysex(ev, sizeof(tt_macro), tt_macro);
 			ev->queue = st->queue;
-			process_event(pp, type, ev, port);
+			port_dispatch_event(port->port, ev);
 		}
 		if (tk == TEMPER_UNKNOWN && mi) {
 			tk_macro[5] = key2sf[0], tk_macro[6] = 1;
 			snd_seq_ev_clear(ev);
 			snd_seq_ev_set_sysex(ev, sizeof(tk_macro), tk_macro);
 			ev->queue = st->queue;
-			process_event(pp, type, ev, &st->ports[0]);
+			port_dispatch_event(st->ports[0].port, ev);
 		}
 	} else if (ev->type == SND_SEQ_EVENT_CONTROLLER
 			&& ev->data.control.param == MIDI_CTL_SUSTAIN
@@ -1380,49 +2901,916 @@ static void replace_event(port_t *pp,
 			snd_seq_ev_clear(ev);
 			snd_seq_ev_set_sysex(ev, sizeof(tk_macro), tk_macro);
 			ev->queue = st->queue;
-			process_event(pp, type, ev, &st->ports[0]);
+			port_dispatch_event(st->ports[0].port, ev);
+		}
+	}
+}
+
+/*
+ * redirect an event to subscribers port
+ */
+static void redirect_event(port_status_t *port, snd_seq_event_t *ev)
+{
+	/* normal MIDI events - check channel */
+	if (snd_seq_ev_is_channel_type(ev)
+			&& ev->data.note.channel >= MIDI_CHANNELS)
+		return;
+	if (thin_period > 0 && thin_event(port, ev))
+		return;
+	send_event(port, ev);
+}
+
+/*
+ * send an event to the subscribers through the transform of the port
+ */
+static void send_event(port_status_t *port, snd_seq_event_t *ev)
+{
+	snd_seq_event_t out;
+
+	if (!xform_event(port, xform_get(port), ev, &out))
+		return;
+	if (pace_output)
+		pace_event(port, &out);
+	else
+		port_write_event(port->port, &out, 0);
+}
+
+/*
+ * the transform of the redirected events: a lookup per event,
+ * whatever stages are set.  returns FALSE if the event is dropped.
+ */
+static int xform_event(port_status_t *port, av_xform_t *xf,
+		       snd_seq_event_t *ev, snd_seq_event_t *out)
+{
+	int ch, key;
+
+	if (xf->drop[ev->type])
+		return FALSE;
+	*out = *ev;
+	snd_seq_ev_set_direct(out);
+	snd_seq_ev_set_subs(out);
+	if (!snd_seq_ev_is_channel_type(ev))
+		return TRUE;
+	ch = ev->data.note.channel;
+	if (snd_seq_ev_is_note_type(ev)) {
+		/* muted and dropped keys have no key to go */
+		key = ev->data.note.note & 0x7f;
+		out->data.note.note = xf->key[port->ch[ch].is_drum != 0][ch][key];
+		if (out->data.note.note == XFORM_DROP)
+			return FALSE;
+		out->data.note.channel = xf->note_ch[ch][key];
+		if (ev->type != SND_SEQ_EVENT_KEYPRESS)
+			out->data.note.velocity =
+				xf->vel[out->data.note.channel][ev->data.note.velocity & 0x7f];
+		return TRUE;
+	}
+	out->data.control.channel = xf->chan[ch];
+	if (out->data.control.channel == XFORM_DROP)
+		return FALSE;
+	if (ev->type == SND_SEQ_EVENT_CONTROLLER &&
+	    ev->data.control.param < NUM_CTRLS) {
+		out->data.control.param = xf->ctrl[ch][ev->data.control.param];
+		if (out->data.control.param == XFORM_DROP)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * the transform of the port; a replaced table is freed once the
+ * loop of the shard passes its hook, so only that loop and the GUI,
+ * which frees it, may look at it
+ */
+static av_xform_t *xform_get(port_status_t *port)
+{
+	g_assert(!cur_ringbuf || cur_ringbuf == &port->shard->ringbuf);
+	return atomic_load(&port->xform);
+}
+
+static void xform_conf_init(av_xform_conf_t *conf)
+{
+	int ch, i;
+
+	memset(conf->drop, 0, sizeof(conf->drop));
+	memset(conf->split, XFORM_KEEP, sizeof(conf->split));
+	memset(conf->transpose, 0, sizeof(conf->transpose));
+	for (ch = 0; ch < MIDI_CHANNELS; ch++) {
+		conf->chan[ch] = ch;
+		for (i = 0; i < MAX_MIDI_VALS; i++)
+			conf->vel[ch][i] = i;
+		for (i = 0; i < NUM_CTRLS; i++)
+			conf->ctrl[ch][i] = i;
+	}
+}
+
+/*
+ * compile the stages of the port with the transpose, velocity scale
+ * and mutes of the GUI: the channel remap, key split and transpose
+ * end up in the key tables, the velocity curve and scale in one
+ * velocity table
+ */
+static av_xform_t *xform_compile(port_status_t *port)
+{
+	midi_status_t *st = port->main;
+	av_xform_conf_t *conf = &st->xconf[port->index];
+	av_xform_t *xf = g_new0(av_xform_t, 1);
+	int ch, i, och, key, vel, same = TRUE;
+
+	for (i = 0; i < 256; i++)
+		if ((xf->drop[i] = conf->drop[i]) != 0)
+			same = FALSE;
+	for (ch = 0; ch < MIDI_CHANNELS; ch++) {
+		if ((xf->chan[ch] = conf->chan[ch]) != ch)
+			same = FALSE;
+		for (i = 0; i < NUM_KEYS; i++) {
+			och = conf->split[ch][i];
+			if (och == XFORM_KEEP)
+				och = conf->chan[ch];
+			xf->note_ch[ch][i] = och;
+			if (och == XFORM_DROP || port->ch[ch].mute) {
+				xf->key[0][ch][i] = xf->key[1][ch][i] = XFORM_DROP;
+				same = FALSE;
+				continue;
+			}
+			/* drums are not transposed by the GUI */
+			key = i + conf->transpose[och];
+			xf->key[0][ch][i] = CLAMP(key + st->pitch_adj, 0, 127);
+			xf->key[1][ch][i] = CLAMP(key, 0, 127);
+			if (och != ch || xf->key[0][ch][i] != i ||
+			    xf->key[1][ch][i] != i)
+				same = FALSE;
+		}
+		for (i = 0; i < NUM_CTRLS; i++)
+			if ((xf->ctrl[ch][i] = conf->ctrl[ch][i]) != i)
+				same = FALSE;
+		for (i = 0; i < MAX_MIDI_VALS; i++) {
+			vel = i ? (int) conf->vel[ch][i] * st->vel_scale / 100 : 0;
+			if ((xf->vel[ch][i] = MIN(vel, 127)) != i)
+				same = FALSE;
+		}
+	}
+	xf->identity = same;
+	return xf;
+}
+
+/*
+ * compile the transform of the port again and swap it in; with
+ * restart, the held notes are stopped through the old transform
+ * and started again through the new one
+ */
+static void xform_update(port_status_t *port, int restart)
+{
+	av_xform_t *old;
+	int i;
+
+	old = atomic_exchange(&port->xform, xform_compile(port));
+	if (restart && is_redirect(port) && route_is_user(port))
+		for (i = 0; i < MIDI_CHANNELS; i++)
+			restart_channel(&port->ch[i],
+					notes_off_mask(&port->ch[i], old), TRUE);
+	xform_retire(port, old);
+}
+
+/*
+ * free a replaced transform once the loop of the shard has passed
+ * its hook; before the loops run, no one else sees it
+ */
+static void xform_retire(port_status_t *port, av_xform_t *xf)
+{
+	midi_status_t *st = port->main;
+
+	/* the GUI thread owns the retired list */
+	g_assert(!cur_ringbuf);
+	if (!st->loops_running) {
+		g_free(xf);
+		return;
+	}
+	xf->shard = port->shard;
+	xf->epoch = atomic_load(&port->shard->xform_epoch);
+	xf->next = st->xform_retired;
+	st->xform_retired = xf;
+	port_client_wakeup(port->shard->client);
+	if (!st->xform_reclaim)
+		st->xform_reclaim = g_timeout_add(XFORM_RECLAIM_MSEC,
+						  xform_reclaim, st);
+}
+
+static gboolean xform_reclaim(gpointer data)
+{
+	midi_status_t *st = (midi_status_t *) data;
+	av_xform_t *xf, **prev;
+
+	for (prev = &st->xform_retired; (xf = *prev) != NULL; ) {
+		if (atomic_load(&xf->shard->xform_epoch) == xf->epoch) {
+			prev = &xf->next;
+			continue;
+		}
+		*prev = xf->next;
+		g_free(xf);
+	}
+	if (st->xform_retired)
+		return TRUE;
+	st->xform_reclaim = 0;
+	return FALSE;
+}
+
+/*
+ * paced sysex output: each port models a MIDI wire to its
+ * destinations.  the other events go out at once and only take
+ * their time on the wire, so they get ahead of the waiting sysex.
+ * the sysex goes in pieces whenever the wire is close to idle.
+ * once it is started, any other status byte would cut it on the
+ * wire, so the other events are held until its end.  while a sysex
+ * is collected, the sysex of other sources is held back, too.
+ */
+
+/* bytes of an event on the wire, without running status */
+static int wire_bytes(snd_seq_event_t *ev)
+{
+	switch (ev->type) {
+	case SND_SEQ_EVENT_SYSEX:
+		return ev->data.ext.len;
+	case SND_SEQ_EVENT_NOTE:
+		return 6;
+	case SND_SEQ_EVENT_PGMCHANGE:
+	case SND_SEQ_EVENT_CHANPRESS:
+	case SND_SEQ_EVENT_QFRAME:
+	case SND_SEQ_EVENT_SONGSEL:
+		return 2;
+	case SND_SEQ_EVENT_CONTROL14:
+		return 6;
+	case SND_SEQ_EVENT_NONREGPARAM:
+	case SND_SEQ_EVENT_REGPARAM:
+		return 12;
+	case SND_SEQ_EVENT_CLOCK:
+	case SND_SEQ_EVENT_START:
+	case SND_SEQ_EVENT_CONTINUE:
+	case SND_SEQ_EVENT_STOP:
+	case SND_SEQ_EVENT_SENSING:
+	case SND_SEQ_EVENT_TUNE_REQUEST:
+	case SND_SEQ_EVENT_RESET:
+		return 1;
+	}
+	return 3;
+}
+
+/*
+ * put the bytes on the modelled wire
+ */
+static void wire_add(port_status_t *port, int bytes, long long now)
+{
+	if (port->wire_free < now)
+		port->wire_free = now;
+	port->wire_free += (long long) bytes * WIRE_BYTE_USEC;
+	atomic_store(&port->wire_until, port->wire_free +
+		     (long long) (port->pace_len - port->pace_sent) *
+		     WIRE_BYTE_USEC);
+	/* the GUI thread, before the loops run, has no ring buffer */
+	if (!atomic_exchange(&port->wire_shown, 1))
+		av_wire_update(port, cur_ringbuf != NULL);
+}
+
+/*
+ * pace a redirected event
+ */
+static void pace_event(port_status_t *port, snd_seq_event_t *ev)
+{
+	long long now = g_get_monotonic_time();
+
+	/* behind the held ones, only the collected sysex goes */
+	if (port->hold_len ? !pace_continues(port, ev) : pace_held(port, ev)) {
+		if (!pace_hold(port, ev)) {
+			/* no room: it would cut the sysex on the wire */
+			port->pace_dropped++;
+			return;
+		}
+	} else
+		pace_pass(port, ev, now);
+	pace_run(port, now, FALSE);
+}
+
+/*
+ * whether the event has to wait for the end of a sysex
+ */
+static int pace_held(port_status_t *port, snd_seq_event_t *ev)
+{
+	if (pace_continues(port, ev))
+		return FALSE;
+	if (ev->type == SND_SEQ_EVENT_SYSEX)
+		return port->pace_collect;
+	return port->pace_open;
+}
+
+/*
+ * whether the event is the next chunk of the collected sysex
+ */
+static int pace_continues(port_status_t *port, snd_seq_event_t *ev)
+{
+	return port->pace_collect && ev->type == SND_SEQ_EVENT_SYSEX &&
+		ev->source.client == port->pace_src.client &&
+		ev->source.port == port->pace_src.port;
+}
+
+/*
+ * keep a copy of the event with its data; returns FALSE if no room
+ */
+static int pace_hold(port_status_t *port, snd_seq_event_t *ev)
+{
+	int ext = snd_seq_ev_is_variable(ev) ? ev->data.ext.len : 0;
+	unsigned int size = PACE_ALIGN(sizeof(*ev) + ext);
+	snd_seq_event_t *rec;
+
+	if (port->hold_len + size > PACE_HOLD)
+		return FALSE;
+	rec = (snd_seq_event_t *) (port->hold_buf + port->hold_len);
+	*rec = *ev;
+	if (ext) {
+		memcpy(rec + 1, ev->data.ext.ptr, ext);
+		rec->data.ext.ptr = rec + 1;
+	}
+	port->hold_len += size;
+	return TRUE;
+}
+
+/*
+ * pass the held events in order which needn't wait any longer;
+ * a sysex passed may start a new one, and what is behind it stays
+ * until that is complete, too.  returns TRUE if any passed.
+ */
+static int pace_release(port_status_t *port, long long now)
+{
+	snd_seq_event_t *ev;
+	unsigned int rd, wr, size;
+	int passed = FALSE;
+
+	for (rd = wr = 0; rd < port->hold_len; rd += size) {
+		ev = (snd_seq_event_t *) (port->hold_buf + rd);
+		size = PACE_ALIGN(sizeof(*ev) + (snd_seq_ev_is_variable(ev) ?
+						 ev->data.ext.len : 0));
+		if (wr ? pace_continues(port, ev) : !pace_held(port, ev)) {
+			pace_pass(port, ev, now);
+			passed = TRUE;
+			continue;
+		}
+		if (wr != rd) {
+			memmove(port->hold_buf + wr, ev, size);
+			ev = (snd_seq_event_t *) (port->hold_buf + wr);
+			if (snd_seq_ev_is_variable(ev))
+				ev->data.ext.ptr = ev + 1;
+		}
+		wr += size;
+	}
+	port->hold_len = wr;
+	return passed;
+}
+
+/*
+ * send an event not held back: queue a sysex, or write the others
+ */
+static void pace_pass(port_status_t *port, snd_seq_event_t *ev, long long now)
+{
+	if (ev->type == SND_SEQ_EVENT_SYSEX)
+		pace_sysex(port, ev, now);
+	else
+		wire_write(port, ev, now);
+}
+
+static void wire_write(port_status_t *port, snd_seq_event_t *ev, long long now)
+{
+	port_write_event(port->port, ev, 0);
+	wire_add(port, wire_bytes(ev), now);
+}
+
+/*
+ * queue a redirected sysex chunk; the arena allocated at start keeps
+ * the data, as the event is gone after the callback
+ */
+static void pace_sysex(port_status_t *port, snd_seq_event_t *ev, long long now)
+{
+	unsigned char *data = ev->data.ext.ptr;
+	int len = ev->data.ext.len;
+
+	if (len <= 0)
+		return;
+	port->pace_collect = (data[len - 1] != 0xf7);
+	port->pace_src = ev->source;
+	if (port->pace_len + sizeof(int) + len > PACE_ARENA) {
+		/* no room: send all waiting, losing the pace */
+		port->pace_overflows++;
+		pace_send(port, now, TRUE);
+		pace_write(port, data, len, now);
+		return;
+	}
+	memcpy(port->pace_buf + port->pace_len, &len, sizeof(int));
+	memcpy(port->pace_buf + port->pace_len + sizeof(int), data, len);
+	port->pace_len += sizeof(int) + len;
+}
+
+/*
+ * output a sysex piece to the subscribers
+ */
+static void pace_write(port_status_t *port, unsigned char *data, int len,
+		       long long now)
+{
+	snd_seq_event_t tmpev;
+
+	snd_seq_ev_clear(&tmpev);
+	snd_seq_ev_set_direct(&tmpev);
+	snd_seq_ev_set_subs(&tmpev);
+	snd_seq_ev_set_sysex(&tmpev, len, data);
+	port_write_event(port->port, &tmpev, 0);
+	port->pace_open = (data[len - 1] != 0xf7);
+	wire_add(port, len, now);
+}
+
+/*
+ * send the waiting sysex whose turn has come, and pass the held
+ * events once the wire is free of it; returns the usec to wait for
+ * the next piece, or -1 if none
+ */
+static long long pace_run(port_status_t *port, long long now, int all)
+{
+	long long wait;
+
+	do {
+		wait = pace_send(port, now, all);
+	} while (port->hold_len && !port->pace_open &&
+		 pace_release(port, now));
+	if (wait >= 0)
+		port_client_schedule(port_get_client(port->port), wait);
+	return wait;
+}
+
+/*
+ * send the pieces of the waiting sysex while the wire is close to
+ * idle, or all of them; returns the usec to wait, or -1 if none
+ */
+static long long pace_send(port_status_t *port, long long now, int all)
+{
+	long long wait = -1;
+	int len, n;
+
+	while (port->pace_sent < port->pace_len) {
+		if (port->wire_free - now > PACE_SLICE_USEC && !all) {
+			wait = port->wire_free - now - PACE_SLICE_USEC;
+			if (!port->pace_open)
+				port->pace_delayed++;
+			break;
+		}
+		memcpy(&len, port->pace_buf + port->pace_sent, sizeof(int));
+		n = len - port->pace_part;
+		if (n > PACE_PIECE && !all)
+			n = PACE_PIECE;
+		pace_write(port, port->pace_buf + port->pace_sent + sizeof(int) +
+			   port->pace_part, n, now);
+		port->pace_part += n;
+		if (port->pace_part == len) {
+			port->pace_sent += sizeof(int) + len;
+			port->pace_part = 0;
+		}
+	}
+	if (port->pace_sent == port->pace_len) {
+		port->pace_len = port->pace_sent = 0;
+	} else if (port->pace_sent >= PACE_ARENA / 2) {
+		/* make room at the end */
+		memmove(port->pace_buf, port->pace_buf + port->pace_sent,
+			port->pace_len - port->pace_sent);
+		port->pace_len -= port->pace_sent;
+		port->pace_sent = 0;
+	}
+	return wait;
+}
+
+/*
+ * send the sysex of the ports of the shard which are due
+ */
+static void pace_timer(midi_shard_t *shard)
+{
+	midi_status_t *st = shard->main;
+	port_status_t *port;
+	long long now = g_get_monotonic_time();
+	int p;
+
+	for (p = 0; p < st->num_ports; p++) {
+		port = &st->ports[p];
+		if (port->shard == shard && port->pace_sent < port->pace_len)
+			pace_run(port, now, FALSE);
+	}
+}
+
+/*
+ * controllers which are thinned out: continuous ones only;
+ * bank select and RPN/NRPN data are order sensitive
+ */
+static int is_continuous_ctrl(int param)
+{
+	if (param >= 1 && param < 32)
+		return param != MIDI_CTL_MSB_DATA_ENTRY;
+	if (param >= 33 && param < 64)
+		return param != MIDI_CTL_LSB_DATA_ENTRY;
+	return param >= 70 && param < 96;
+}
+
+/*
+ * controllers whose repeated value can be dropped
+ */
+static int is_state_ctrl(int param)
+{
+	if (param >= 96 && param <= 101)	/* data inc/dec, RPN/NRPN */
+		return FALSE;
+	return param != MIDI_CTL_MSB_DATA_ENTRY &&
+		param != MIDI_CTL_LSB_DATA_ENTRY && param < 120;
+}
+
+#define ctrl_bit(bits, n)	((bits)[(n) >> 3] & (1 << ((n) & 7)))
+#define ctrl_set(bits, n)	((bits)[(n) >> 3] |= (1 << ((n) & 7)))
+#define ctrl_clear(bits, n)	((bits)[(n) >> 3] &= ~(1 << ((n) & 7)))
+
+/*
+ * thin out controllers and pitch bends on the redirect path;
+ * chst->ctrl[] and chst->pitch hold the last value received, which is
+ * the value sent downstream unless it is held.  returns TRUE when the
+ * event is dropped or held.
+ */
+static int thin_event(port_status_t *port, snd_seq_event_t *ev)
+{
+	channel_status_t *chst;
+	unsigned int now;
+	int param;
+
+	if (!snd_seq_ev_is_channel_type(ev))
+		return FALSE;
+	chst = &port->ch[ev->data.control.channel];
+	now = g_get_monotonic_time() / 1000;
+	switch (ev->type) {
+	case SND_SEQ_EVENT_CONTROLLER:
+		param = ev->data.control.param;
+		if (param >= NUM_CTRLS || !is_state_ctrl(param))
+			break;
+		if (ctrl_bit(chst->ctrl_seen, param) &&
+		    chst->ctrl[param] == ev->data.control.value) {
+			port->thin_saved++;
+			return TRUE;
+		}
+		ctrl_set(chst->ctrl_seen, param);
+		if (!is_continuous_ctrl(param))
+			break;
+		if (now - chst->ctrl_time[param] < thin_period) {
+			/* keep the final value; ctrl[] gets it */
+			if (ctrl_bit(chst->ctrl_held, param))
+				port->thin_saved++;
+			else {
+				ctrl_set(chst->ctrl_held, param);
+				chst->num_held++;
+				port->num_held++;
+			}
+			port_client_schedule(port_get_client(port->port),
+				(thin_period - (now - chst->ctrl_time[param])) * 1000);
+			return TRUE;
+		}
+		if (ctrl_bit(chst->ctrl_held, param)) {
+			ctrl_clear(chst->ctrl_held, param);
+			chst->num_held--;
+			port->num_held--;
+		}
+		chst->ctrl_time[param] = now;
+		return FALSE;
+	case SND_SEQ_EVENT_PITCHBEND:
+		if (chst->pitch_seen && chst->pitch == ev->data.control.value) {
+			port->thin_saved++;
+			return TRUE;
 		}
+		chst->pitch_seen = TRUE;
+		if (now - chst->pitch_time < thin_period) {
+			if (chst->pitch_held)
+				port->thin_saved++;
+			else {
+				chst->pitch_held = TRUE;
+				chst->num_held++;
+				port->num_held++;
+			}
+			port_client_schedule(port_get_client(port->port),
+				(thin_period - (now - chst->pitch_time)) * 1000);
+			return TRUE;
+		}
+		if (chst->pitch_held) {
+			chst->pitch_held = FALSE;
+			chst->num_held--;
+			port->num_held--;
+		}
+		chst->pitch_time = now;
+		return FALSE;
 	}
+	/* other channel events go after the held values */
+	if (chst->num_held)
+		send_held(port, chst, now, TRUE);
+	if (ev->type == SND_SEQ_EVENT_CONTROLLER &&
+	    ev->data.control.param == MIDI_CTL_RESET_CONTROLLERS) {
+		memset(chst->ctrl_seen, 0, sizeof(chst->ctrl_seen));
+		chst->pitch_seen = FALSE;
+	}
+	return FALSE;
+}
+
+/*
+ * send the held final values of the channel; unless all is set,
+ * only those whose period is over.  returns the msecs until the
+ * next one is due, or -1 if none is held.
+ */
+static int send_held(port_status_t *port, channel_status_t *chst,
+		     unsigned int now, int all)
+{
+	snd_seq_event_t tmpev;
+	int param, wait, next = -1;
+
+	snd_seq_ev_clear(&tmpev);
+	for (param = 0; param < NUM_CTRLS && chst->num_held; param++) {
+		if (!ctrl_bit(chst->ctrl_held, param))
+			continue;
+		wait = thin_period - (int)(now - chst->ctrl_time[param]);
+		if (!all && wait > 0) {
+			if (next < 0 || wait < next)
+				next = wait;
+			continue;
+		}
+		snd_seq_ev_set_controller(&tmpev, chst->ch, param,
+					  chst->ctrl[param]);
+		send_event(port, &tmpev);
+		ctrl_clear(chst->ctrl_held, param);
+		chst->ctrl_time[param] = now;
+		chst->num_held--;
+		port->num_held--;
+	}
+	if (chst->pitch_held) {
+		wait = thin_period - (int)(now - chst->pitch_time);
+		if (!all && wait > 0) {
+			if (next < 0 || wait < next)
+				next = wait;
+		} else {
+			snd_seq_ev_set_pitchbend(&tmpev, chst->ch, chst->pitch);
+			send_event(port, &tmpev);
+			chst->pitch_held = FALSE;
+			chst->pitch_time = now;
+			chst->num_held--;
+			port->num_held--;
+		}
+	}
+	return next;
+}
+
+/*
+ * timer of the shard
+ */
+static void shard_timer(port_client_t *client, midi_shard_t *shard)
+{
+	if (thin_period > 0)
+		thin_timer(client, shard);
+	if (pace_output)
+		pace_timer(shard);
+}
+
+/*
+ * send the held values which are due
+ */
+static void thin_timer(port_client_t *client, midi_shard_t *shard)
+{
+	midi_status_t *st = shard->main;
+	port_status_t *port;
+	unsigned int now = g_get_monotonic_time() / 1000;
+	int p, i, wait, next = -1;
+
+	for (p = 0; p < st->num_ports; p++) {
+		port = &st->ports[p];
+		if (port->shard != shard || !port->num_held)
+			continue;
+		for (i = 0; i < MIDI_CHANNELS; i++) {
+			if (!port->ch[i].num_held)
+				continue;
+			wait = send_held(port, &port->ch[i], now, FALSE);
+			if (wait >= 0 && (next < 0 || wait < next))
+				next = wait;
+		}
+	}
+	if (next >= 0)
+		port_client_schedule(client, next * 1000);
+}
+
+/*
+ * ask the loops to check the kernel routes again
+ */
+static void update_routes(midi_status_t *st)
+{
+	int i;
+
+	for (i = 0; i < st->num_shards; i++) {
+		g_atomic_int_set(&st->shards[i].route_dirty, 1);
+		port_client_wakeup(st->shards[i].client);
+	}
+}
+
+static void route_changed(port_status_t *port)
+{
+	g_atomic_int_set(&port->shard->route_dirty, 1);
+	port_client_wakeup(port->shard->client);
+}
+
+/*
+ * loop hook of the shard: no event is in flight here, so the
+ * transforms replaced before are no longer in use
+ */
+static void shard_hook(port_client_t *client, midi_shard_t *shard)
+{
+	int req;
+
+	atomic_fetch_add(&shard->xform_epoch, 1);
+	req = atomic_exchange(&shard->requests, 0);
+	if (req & (REQ_RESET | REQ_RESET_OUT))
+		reset_ports(shard, req & REQ_RESET_OUT, use_thread);
+	if (req & REQ_RESTART)
+		restart_ports(shard);
+	if (direct_route)
+		route_hook(client, shard);
 }
 
 /*
- * redirect an event to subscribers port
+ * check the routes when asked to
  */
-static void redirect_event(port_status_t *port, snd_seq_event_t *ev)
+static void route_hook(port_client_t *client, midi_shard_t *shard)
 {
-	int key, vel, key_saved, vel_saved;
-	
-	/* normal MIDI events - check channel */
-	if (snd_seq_ev_is_channel_type(ev)
-			&& ev->data.note.channel >= MIDI_CHANNELS)
+	midi_status_t *st = shard->main;
+	int p;
+
+	if (!g_atomic_int_compare_and_exchange(&shard->route_dirty, 1, 0))
 		return;
-	if (snd_seq_ev_is_note_type(ev)) {
-		/* abandoned if muted */
-		if (port->ch[ev->data.note.channel].mute)
+	for (p = 0; p < st->num_ports; p++)
+		if (st->ports[p].shard == shard)
+			route_update(&st->ports[p]);
+}
+
+/*
+ * set up or tear down the kernel route of the port;
+ * while a switch is in progress, the port is checked again
+ * when it is done
+ */
+static void route_update(port_status_t *port)
+{
+	snd_seq_addr_t src[MAX_ROUTE_ADDRS], dst[MAX_ROUTE_ADDRS];
+	int nsrc = 0, ndst = 0;
+
+	if (port->route_state != ROUTE_USER && port->route_state != ROUTE_DIRECT)
+		return;
+	if (direct_wanted(port)) {
+		nsrc = get_route_addrs(port, SND_SEQ_QUERY_SUBS_WRITE, src);
+		ndst = get_route_addrs(port, SND_SEQ_QUERY_SUBS_READ, dst);
+	}
+	if (nsrc <= 0 || ndst <= 0)
+		nsrc = ndst = 0;
+	if (port->route_state == ROUTE_DIRECT) {
+		if (nsrc == port->num_route_src && ndst == port->num_route_dst &&
+		    !memcmp(src, port->route_src, sizeof(*src) * nsrc) &&
+		    !memcmp(dst, port->route_dst, sizeof(*dst) * ndst))
 			return;
-		/* modify key / velocity for note events */
-		key_saved = ev->data.note.note;
-		vel_saved = ev->data.note.velocity;
-		key = ev->data.note.note;
-		if (!port->ch[ev->data.note.channel].is_drum)
-			key += port->main->pitch_adj;
-		if (key >= 128)
-			key = 127;
-		vel = ((int) ev->data.note.velocity * port->main->vel_scale) / 100;
-		if (vel >= 128)
-			vel = 127;
-		ev->data.note.note = key;
-		ev->data.note.velocity = vel;
-		snd_seq_ev_set_direct(ev);
-		snd_seq_ev_set_subs(ev);
-		port_write_event(port->port, ev, 0);
-		ev->data.note.note = key_saved;
-		ev->data.note.velocity = vel_saved;
-	} else {
-		snd_seq_ev_set_direct(ev);
-		snd_seq_ev_set_subs(ev);
-		port_write_event(port->port, ev, 0);
+		/* a new route is set up after this one is gone */
+		route_switch(port, ROUTE_RELEASING);
+	} else if (nsrc) {
+		memcpy(port->route_src, src, sizeof(*src) * nsrc);
+		memcpy(port->route_dst, dst, sizeof(*dst) * ndst);
+		port->num_route_src = nsrc;
+		port->num_route_dst = ndst;
+		route_switch(port, ROUTE_ARMING);
+	}
+}
+
+/*
+ * events pass unchanged: no filter, transform or pacing;
+ * the mutes, transpose and velocity change are in the transform
+ */
+static int direct_wanted(port_status_t *port)
+{
+	return !port->filter && !pace_output &&
+		xform_get(port)->identity;
+}
+
+/*
+ * get the sources or the destinations of the port;
+ * chains through our own ports, and too many subscribers,
+ * are left to the redirection
+ */
+static int get_route_addrs(port_status_t *port, int type, snd_seq_addr_t *addrs)
+{
+	midi_status_t *st = port->main;
+	int i, j, n;
+
+	/* a full list may be cut short */
+	n = port_get_subscribers(port->port, type, addrs, MAX_ROUTE_ADDRS);
+	if (n < 0 || n >= MAX_ROUTE_ADDRS)
+		return -1;
+	for (i = 0; i < n; i++)
+		for (j = 0; j < st->num_shards; j++)
+			if (addrs[i].client == port_client_get_id(st->shards[j].client))
+				return -1;
+	return n;
+}
+
+/*
+ * start a route switch: the subscriptions are changed between
+ * two echoes
+ */
+static void route_switch(port_status_t *port, int state)
+{
+	port_client_t *client = port->shard->client;
+	int k, n = port->num_route_src * port->num_route_dst;
+
+	g_atomic_int_set(&port->route_state, state);
+	port->route_switches++;
+	send_route_echo(port);
+	if (state == ROUTE_ARMING) {
+		for (k = 0; k < n; k++)
+			if (port_client_subscribe(client,
+					&port->route_src[k / port->num_route_dst],
+					&port->route_dst[k % port->num_route_dst]) < 0)
+				break;
+		if (k < n) {
+			while (k-- > 0)
+				port_client_unsubscribe(client,
+					&port->route_src[k / port->num_route_dst],
+					&port->route_dst[k % port->num_route_dst]);
+			port->num_route_src = port->num_route_dst = 0;
+		}
+	} else
+		route_unsubscribe(port);
+	send_route_echo(port);
+}
+
+/*
+ * remove the kernel route of the port
+ */
+static void route_unsubscribe(port_status_t *port)
+{
+	int i, j;
+
+	for (i = 0; i < port->num_route_src; i++)
+		for (j = 0; j < port->num_route_dst; j++)
+			port_client_unsubscribe(port->shard->client,
+					&port->route_src[i], &port->route_dst[j]);
+}
+
+/*
+ * send an echo to ourselves; if it can't be sent, it is taken
+ * as received right now
+ */
+static void send_route_echo(port_status_t *port)
+{
+	snd_seq_event_t ev;
+	int client = port_client_get_id(port->shard->client);
+
+	snd_seq_ev_clear(&ev);
+	ev.type = SND_SEQ_EVENT_ECHO;
+	snd_seq_ev_set_direct(&ev);
+	snd_seq_ev_set_dest(&ev, client, port_get_port(port->port));
+	if (port_write_event(port->port, &ev, 1) < 0) {
+		ev.source.client = client;
+		ev_echo(port->port, ev.type, &ev, port);
+	}
+}
+
+/*
+ * whether an event is redirected by ourselves: not if the kernel
+ * route has delivered it, and only note-offs if it may have done
+ */
+static int route_pass(port_status_t *port, snd_seq_event_t *ev)
+{
+	int i;
+
+	if (!direct_route)
+		return TRUE;
+	if (ev->type == SND_SEQ_EVENT_ECHO &&
+	    ev->source.client == port_client_get_id(port->shard->client))
+		return FALSE;
+	for (i = 0; i < port->num_route_src; i++)
+		if (port->route_src[i].client == ev->source.client &&
+		    port->route_src[i].port == ev->source.port)
+			break;
+	if (i >= port->num_route_src)
+		return TRUE;
+	switch (port->route_state) {
+	case ROUTE_USER:
+	case ROUTE_ARMING:
+		return TRUE;
+	case ROUTE_ENTERING:
+	case ROUTE_LEAVING:
+		switch (ev->type) {
+		case SND_SEQ_EVENT_NOTEOFF:
+			return TRUE;
+		case SND_SEQ_EVENT_NOTEON:
+			return ev->data.note.velocity == 0;
+		case SND_SEQ_EVENT_CONTROLLER:
+			return ev->data.control.param == MIDI_CTL_ALL_SOUNDS_OFF ||
+				ev->data.control.param == MIDI_CTL_ALL_NOTES_OFF;
+		}
+		break;
 	}
+	return FALSE;
 }
 
 /*
@@ -1432,31 +3820,83 @@ static void change_note(port_status_t *port,
 		int ch, int key, int vel, int in_buf)
 {
 	channel_status_t *chst;
-	int i;
+	int max_vel, diff;
 	
 	if (key < 0 || key >= NUM_KEYS)
 		return;
 	if (vel < 0 || vel >= MAX_MIDI_VALS)
 		return;
 	chst = &port->ch[ch];
-	chst->vel[key] = vel;
+	max_vel = note_index_max_vel(&chst->notes);
+	diff = note_index_set(&chst->notes, key, vel);
 	/* update maximum velocity */
-	if (vel >= chst->max_vel) {
-		chst->max_vel_key = key, chst->max_vel = vel;
-		av_channel_update(chst->w_vel, chst->max_vel, in_buf);
-	} else {
-		if (chst->max_vel_key == key) {
-			chst->max_vel = vel;
-			for (i = 0; i < NUM_KEYS; i++)
-				if (chst->vel[i] > chst->max_vel) {
-					chst->max_vel = chst->vel[i];
-					chst->max_vel_key = i;
-				}
-			av_channel_update(chst->w_vel, chst->max_vel, in_buf);
-		}
+	if (vel >= max_vel || note_index_max_vel(&chst->notes) != max_vel)
+		av_channel_update(chst, V_VEL,
+				  note_index_max_vel(&chst->notes));
+	if (diff) {
+		atomic_fetch_add_explicit(&port->main->voices, diff,
+					  memory_order_relaxed);
+		av_channel_update(chst, V_POLY, note_index_poly(&chst->notes));
 	}
 	if (show_piano)
-		av_note_update(chst->w_piano, key, (chst->vel[key] > 0), in_buf);
+		av_note_update(chst, key, vel > 0);
+}
+
+/*
+ * set the velocity of a key, 0 for note-off;
+ * returns the change of the polyphony
+ */
+static int note_index_set(av_note_index_t *idx, int key, int vel)
+{
+	int old = idx->vel[key], n = key + 1;
+
+	if (old == vel)
+		return 0;
+	idx->vel[key] = vel;
+	if (old && !--idx->count[old])
+		idx->vels[old / 32] &= ~(1U << (old % 32));
+	if (vel && !idx->count[vel]++)
+		idx->vels[vel / 32] |= 1U << (vel % 32);
+	if (old && vel)
+		return 0;	/* key pressure */
+	if (vel) {
+		/* append to the list */
+		idx->keys[key / 32] |= 1U << (key % 32);
+		idx->prev[n] = idx->prev[0];
+		idx->next[n] = 0;
+		idx->next[idx->prev[0]] = n;
+		idx->prev[0] = n;
+		return 1;
+	}
+	idx->keys[key / 32] &= ~(1U << (key % 32));
+	idx->next[idx->prev[n]] = idx->next[n];
+	idx->prev[idx->next[n]] = idx->prev[n];
+	return -1;
+}
+
+/*
+ * the highest velocity of the notes on
+ */
+static int note_index_max_vel(av_note_index_t *idx)
+{
+	int i;
+
+	for (i = MAX_MIDI_VALS / 32 - 1; i >= 0; i--)
+		if (idx->vels[i])
+			return i * 32 + 31 - __builtin_clz(idx->vels[i]);
+	return 0;
+}
+
+/*
+ * the number of notes on
+ */
+static int note_index_poly(av_note_index_t *idx)
+{
+	int i, n = 0;
+
+	for (i = 0; i < NUM_KEYS / 32; i++)
+		n += __builtin_popcount(idx->keys[i]);
+	return n;
 }
 
 /*
@@ -1470,7 +3910,7 @@ static void change_program(port_status_t *port, int ch, int prog, int in_buf)
 		return;
 	chst = &port->ch[ch];
 	sprintf(chst->progname, "%3d", prog);
-	av_program_update(chst->w_prog, chst->progname, in_buf);
+	av_program_update(chst);
 }
 
 /*
@@ -1490,17 +3930,17 @@ static void change_controller(port_status_t *port,
 		if (port->main->midi_mode == MIDI_MODE_XG) {
 			/* change drum flag and color */
 			chst->is_drum = (value == 127) ? 1 : 0;
-			set_vel_bar_color(chst->w_vel, chst->is_drum, in_buf);
+			set_vel_bar_color(chst);
 		}
 		break;
 	case MIDI_CTL_MSB_MAIN_VOLUME:
-		av_channel_update(chst->w_main, value, in_buf);
+		av_channel_update(chst, V_MAIN, value);
 		break;
 	case MIDI_CTL_MSB_PAN:
-		av_channel_update(chst->w_pan, value, in_buf);
+		av_channel_update(chst, V_PAN, value);
 		break;
 	case MIDI_CTL_MSB_EXPRESSION:
-		av_channel_update(chst->w_exp, value, in_buf);
+		av_channel_update(chst, V_EXP, value);
 		break;
 	case MIDI_CTL_ALL_SOUNDS_OFF:
 		all_sounds_off(chst, in_buf);
@@ -1519,9 +3959,15 @@ static void change_controller(port_status_t *port,
  */
 static void all_sounds_off(channel_status_t *chst, int in_buf)
 {
-	memset(chst->vel, 0, sizeof(chst->vel));
-	chst->max_vel_key = chst->max_vel = 0;
-	av_channel_update(chst->w_vel, 0, in_buf);
+	int poly = note_index_poly(&chst->notes);
+
+	memset(&chst->notes, 0, sizeof(chst->notes));
+	av_channel_update(chst, V_VEL, 0);
+	if (poly) {
+		atomic_fetch_sub_explicit(&chst->port->main->voices, poly,
+					  memory_order_relaxed);
+		av_channel_update(chst, V_POLY, 0);
+	}
 }
 
 /*
@@ -1531,11 +3977,11 @@ static void reset_controllers(channel_status_t *chst, int in_buf)
 {
 	memset(chst->ctrl, 0, sizeof(chst->ctrl));
 	chst->ctrl[MIDI_CTL_MSB_MAIN_VOLUME] = 100;
-	av_channel_update(chst->w_main, 100, in_buf);
+	av_channel_update(chst, V_MAIN, 100);
 	chst->ctrl[MIDI_CTL_MSB_PAN] = 64;
-	av_channel_update(chst->w_pan, 64, in_buf);
+	av_channel_update(chst, V_PAN, 64);
 	chst->ctrl[MIDI_CTL_MSB_EXPRESSION] = 127;
-	av_channel_update(chst->w_exp, 127, in_buf);
+	av_channel_update(chst, V_EXP, 127);
 }
 
 /*
@@ -1556,108 +4002,390 @@ static void change_pitch(port_status_t *port, int ch, int value, int in_buf)
 	if (ch < 0 || ch >= MIDI_CHANNELS)
 		return;
 	chst = &port->ch[ch];
-	av_channel_update(chst->w_pitch, value, in_buf);
+	chst->pitch = value;
+	av_channel_update(chst, V_PITCH, value);
 }
 
 /*
- * parse sysex message
+ * sysex decoder: the vendor of a message is looked up by its
+ * manufacturer ID, and the vendor format makes a key from the
+ * model and the address (or the sub-IDs) with the part number
+ * taken out.  the key is searched in the sorted message table of
+ * the vendor, so a new message is only a new table entry.
  */
-static void parse_sysex(port_status_t *port,
-		int len, unsigned char *buf, int in_buf)
+typedef struct sysex_msg_t {
+	unsigned int key;
+	int len;		/* data bytes needed */
+	void (*decode)(port_status_t *port, int ch, int arg,
+		       unsigned char *data, int in_buf);
+	int arg;
+	int part;		/* needs a part */
+} sysex_msg_t;
+
+#define SYSEX_KEY(a, b, c, d)	((a) << 24 | (b) << 16 | (c) << 8 | (d))
+
+static void sx_reset(port_status_t *port, int ch, int arg,
+		     unsigned char *data, int in_buf)
+{
+	reset_all(port->main, arg, FALSE, in_buf);
+}
+
+static void sx_drum(port_status_t *port, int ch, int arg,
+		    unsigned char *data, int in_buf)
+{
+	port->ch[ch].is_drum = (data[0]) ? 1 : 0;
+	set_vel_bar_color(&port->ch[ch]);
+}
+
+static void sx_program(port_status_t *port, int ch, int arg,
+		       unsigned char *data, int in_buf)
+{
+	if (!port->ch[ch].is_drum)
+		change_program(port, ch, data[0], in_buf);
+}
+
+/* GS tone number: bank select and program */
+static void sx_tone(port_status_t *port, int ch, int arg,
+		    unsigned char *data, int in_buf)
+{
+	change_controller(port, ch, MIDI_CTL_MSB_BANK, data[0], in_buf);
+	sx_program(port, ch, arg, data + 1, in_buf);
+}
+
+static void sx_control(port_status_t *port, int ch, int arg,
+		       unsigned char *data, int in_buf)
+{
+	change_controller(port, ch, arg, data[0], in_buf);
+}
+
+/* part pan: 0 is random, shown as center */
+static void sx_pan(port_status_t *port, int ch, int arg,
+		   unsigned char *data, int in_buf)
+{
+	change_controller(port, ch, MIDI_CTL_MSB_PAN,
+			  data[0] ? data[0] : 64, in_buf);
+}
+
+/* GS and XG master volume, 7 bits */
+static void sx_master_volume(port_status_t *port, int ch, int arg,
+			     unsigned char *data, int in_buf)
+{
+	port->main->master[MASTER_VOLUME] = data[0] << 7;
+	display_master(port->main->w_master, in_buf);
+}
+
+/* GM2 device control, 14 bits in LSB and MSB */
+static void sx_master(port_status_t *port, int ch, int arg,
+		      unsigned char *data, int in_buf)
+{
+	port->main->master[arg] = data[1] << 7 | data[0];
+	display_master(port->main->w_master, in_buf);
+}
+
+/* GS macros have one byte, XG types two */
+static void sx_effect(port_status_t *port, int ch, int arg,
+		      unsigned char *data, int in_buf)
+{
+	port->main->effect_type[arg & 0xff] =
+		(arg >> 8) ? (data[0] << 7 | data[1]) : data[0];
+	display_master(port->main->w_master, in_buf);
+}
+
+#define GS_EFFECT(type)	(type)
+#define XG_EFFECT(type)	(1 << 8 | (type))
+
+/* MIDI Tuning Standard: key signature */
+static void sx_temper_keysig(port_status_t *port, int ch, int arg,
+			     unsigned char *data, int in_buf)
+{
+	midi_status_t *st = port->main;
+	int need_visualize = FALSE;
+
+	if (st->temper_keysig == TEMPER_UNKNOWN)
+		need_visualize = TRUE;
+	st->temper_keysig = data[0] - 0x40 + data[1] * 16;
+	display_temper_keysig(st->w_temper_keysig, in_buf);
+	if (need_visualize)
+		visualize_temper_type(st, in_buf);
+}
+
+/* MIDI Tuning Standard: temperament type of the channels */
+static void sx_temper_type(port_status_t *port, int ch, int arg,
+			   unsigned char *data, int in_buf)
 {
-	/* GM on */
-	static unsigned char gm_on_macro[] = {
-		0x7e, 0x7f, 0x09, 0x01
-	};
-	/* GM2 on */
-	static unsigned char gm2_on_macro[] = {
-		0x7e, 0x7f, 0x09, 0x03
-	};
-	/* GS prefix
-	 * master vol:   XX=0x00, YY=0x04, ZZ=0-127
-	 * reverb mode:  XX=0x01, YY=0x30, ZZ=0-7
-	 * chorus mode:  XX=0x01, YY=0x38, ZZ=0-7
-	 * drum channel: XX=0x1?, YY=0x15, ZZ=on/off (?=channel)
-	 */
-	static unsigned char gs_pfx_macro[] = {
-		0x41, 0x10, 0x42, 0x12, 0x40 /* XX, YY, ZZ */
-	};
-	/* XG on */
-	static unsigned char xg_on_macro[] = {
-		0x43, 0x10, 0x4c, 0x00, 0x00, 0x7e, 0x00
-	};
 	midi_status_t *st = port->main;
-	int p, need_visualize = FALSE, ttch, i, tt;
 	channel_status_t *chst;
-	
-	if (len <= 0 || buf[0] != 0xf0)
+	int ttch, i, tt;
+
+	if (st->temper_keysig == TEMPER_UNKNOWN) {
+		st->temper_keysig = 0;
+		display_temper_keysig(st->w_temper_keysig, in_buf);
+		visualize_temper_type(st, in_buf);
+	}
+	ttch = (data[0] & 0x03) << 14 | data[1] << 7 | data[2];
+	port = &st->ports[port->index | data[0] >> 2];
+	if (port->index < 0 || port->index >= st->num_ports)
 		return;
-	/* skip first byte */
-	buf++, len--;
+	for (i = 0; i < MIDI_CHANNELS; i++)
+		if (ttch & 1 << i) {
+			chst = &port->ch[i];
+			tt = chst->temper_type = data[3];
+			display_temper_type(chst);
+			if (st->temper_type_mute
+					&& ((tt >= 0 && tt < 4) || (tt >= 64 && tt < 68)))
+				av_mute_update(chst,
+					       st->temper_type_mute &
+					       (1 << (tt - ((tt >= 0x40) ? 0x3c : 0))), in_buf);
+		}
+}
+
+/*
+ * universal: ID, sub-ID 1, sub-ID 2
+ */
+static sysex_msg_t universal_msgs[] = {
 	/* GM on */
-	if (len >= sizeof(gm_on_macro)
-			&& memcmp(buf, gm_on_macro, sizeof(gm_on_macro)) == 0)
-		reset_all(st, MIDI_MODE_GM, FALSE, in_buf);
+	{ SYSEX_KEY(0, 0x7e, 0x09, 0x01), 0, sx_reset, MIDI_MODE_GM },
 	/* GM2 on */
-	else if (len >= sizeof(gm2_on_macro)
-			&& memcmp(buf, gm2_on_macro, sizeof(gm2_on_macro)) == 0)
-		reset_all(st, MIDI_MODE_GM2, FALSE, in_buf);
-	/* GS macros */
-	else if (len >= 8
-			&& memcmp(buf, gs_pfx_macro, sizeof(gs_pfx_macro)) == 0) {
-		/* GS reset */
-		if (buf[5] == 0x00 && buf[6] == 0x7f && buf[7] == 0x00)
-			reset_all(st, MIDI_MODE_GS, FALSE, in_buf);
-		/* drum pattern */
-		else if ((buf[5] & 0xf0) == 0x10 && buf[6] == 0x15) {
-			if ((p = get_channel(buf[5])) < MIDI_CHANNELS) {
-				port->ch[p].is_drum = (buf[7]) ? 1 : 0;
-				set_vel_bar_color(port->ch[p].w_vel,
-						port->ch[p].is_drum, in_buf);
-			}
-		/* program */
-		} else if ((buf[5] & 0xf0) == 0x10 && buf[6] == 0x21) {
-			if ((p = get_channel(buf[5])) < MIDI_CHANNELS
-					&& !port->ch[p].is_drum)
-				change_program(port, p, buf[7], in_buf);
-		}
-	/* XG on */
-	} else if (len >= sizeof(xg_on_macro)
-			&& memcmp(buf, xg_on_macro, sizeof(xg_on_macro)) == 0)
-		reset_all(st, MIDI_MODE_XG, FALSE, in_buf);
+	{ SYSEX_KEY(0, 0x7e, 0x09, 0x03), 0, sx_reset, MIDI_MODE_GM2 },
 	/* MIDI Tuning Standard */
-	else if (len >= 7 && buf[0] >= 0x7e && buf[2] == 0x08)
-		switch (buf[3]) {
-		case 0x0a:
-			if (st->temper_keysig == TEMPER_UNKNOWN)
-				need_visualize = TRUE;
-			st->temper_keysig = buf[4] - 0x40 + buf[5] * 16;
-			display_temper_keysig(st->w_temper_keysig, in_buf);
-			if (need_visualize)
-				visualize_temper_type(st, in_buf);
-			break;
-		case 0x0b:
-			if (st->temper_keysig == TEMPER_UNKNOWN) {
-				st->temper_keysig = 0;
-				display_temper_keysig(st->w_temper_keysig, in_buf);
-				visualize_temper_type(st, in_buf);
+	{ SYSEX_KEY(0, 0x7e, 0x08, 0x0a), 2, sx_temper_keysig },
+	{ SYSEX_KEY(0, 0x7e, 0x08, 0x0b), 4, sx_temper_type },
+	{ SYSEX_KEY(0, 0x7f, 0x08, 0x0a), 2, sx_temper_keysig },
+	{ SYSEX_KEY(0, 0x7f, 0x08, 0x0b), 4, sx_temper_type },
+	/* GM2 device control */
+	{ SYSEX_KEY(0, 0x7f, 0x04, 0x01), 2, sx_master, MASTER_VOLUME },
+	{ SYSEX_KEY(0, 0x7f, 0x04, 0x02), 2, sx_master, MASTER_BALANCE },
+	{ SYSEX_KEY(0, 0x7f, 0x04, 0x03), 2, sx_master, MASTER_FINE_TUNING },
+	{ SYSEX_KEY(0, 0x7f, 0x04, 0x04), 2, sx_master, MASTER_COARSE_TUNING },
+};
+
+/*
+ * Roland GS: model, address; the part blocks 40 1x are keyed as 40 10
+ */
+static sysex_msg_t roland_msgs[] = {
+	{ SYSEX_KEY(0x42, 0x40, 0x00, 0x7f), 1, sx_reset, MIDI_MODE_GS },
+	{ SYSEX_KEY(0x42, 0x40, 0x00, 0x04), 1, sx_master_volume },
+	{ SYSEX_KEY(0x42, 0x40, 0x01, 0x30), 1, sx_effect, GS_EFFECT(EFFECT_REVERB) },
+	{ SYSEX_KEY(0x42, 0x40, 0x01, 0x38), 1, sx_effect, GS_EFFECT(EFFECT_CHORUS) },
+	{ SYSEX_KEY(0x42, 0x40, 0x10, 0x00), 2, sx_tone, 0, TRUE },
+	{ SYSEX_KEY(0x42, 0x40, 0x10, 0x15), 1, sx_drum, 0, TRUE },
+	{ SYSEX_KEY(0x42, 0x40, 0x10, 0x19), 1, sx_control, MIDI_CTL_MSB_MAIN_VOLUME, TRUE },
+	{ SYSEX_KEY(0x42, 0x40, 0x10, 0x1c), 1, sx_pan, 0, TRUE },
+	{ SYSEX_KEY(0x42, 0x40, 0x10, 0x21), 1, sx_control, MIDI_CTL_E3_CHORUS_DEPTH, TRUE },
+	{ SYSEX_KEY(0x42, 0x40, 0x10, 0x22), 1, sx_control, MIDI_CTL_E1_REVERB_DEPTH, TRUE },
+};
+
+/*
+ * Yamaha XG: model, address; the multi part blocks 08 nn are keyed as 08 00
+ */
+static sysex_msg_t yamaha_msgs[] = {
+	{ SYSEX_KEY(0x4c, 0x00, 0x00, 0x7e), 1, sx_reset, MIDI_MODE_XG },
+	{ SYSEX_KEY(0x4c, 0x00, 0x00, 0x7f), 1, sx_reset, MIDI_MODE_XG },
+	{ SYSEX_KEY(0x4c, 0x00, 0x00, 0x04), 1, sx_master_volume },
+	{ SYSEX_KEY(0x4c, 0x02, 0x01, 0x00), 2, sx_effect, XG_EFFECT(EFFECT_REVERB) },
+	{ SYSEX_KEY(0x4c, 0x02, 0x01, 0x20), 2, sx_effect, XG_EFFECT(EFFECT_CHORUS) },
+	{ SYSEX_KEY(0x4c, 0x02, 0x01, 0x40), 2, sx_effect, XG_EFFECT(EFFECT_VARIATION) },
+	{ SYSEX_KEY(0x4c, 0x08, 0x00, 0x01), 1, sx_control, MIDI_CTL_MSB_BANK, TRUE },
+	{ SYSEX_KEY(0x4c, 0x08, 0x00, 0x02), 1, sx_control, MIDI_CTL_LSB_BANK, TRUE },
+	{ SYSEX_KEY(0x4c, 0x08, 0x00, 0x03), 1, sx_program, 0, TRUE },
+	{ SYSEX_KEY(0x4c, 0x08, 0x00, 0x07), 1, sx_drum, 0, TRUE },
+	{ SYSEX_KEY(0x4c, 0x08, 0x00, 0x0b), 1, sx_control, MIDI_CTL_MSB_MAIN_VOLUME, TRUE },
+	{ SYSEX_KEY(0x4c, 0x08, 0x00, 0x0e), 1, sx_pan, 0, TRUE },
+	{ SYSEX_KEY(0x4c, 0x08, 0x00, 0x12), 1, sx_control, MIDI_CTL_E3_CHORUS_DEPTH, TRUE },
+	{ SYSEX_KEY(0x4c, 0x08, 0x00, 0x13), 1, sx_control, MIDI_CTL_E1_REVERB_DEPTH, TRUE },
+	{ SYSEX_KEY(0x4c, 0x08, 0x00, 0x14), 1, sx_control, MIDI_CTL_E4_DETUNE_DEPTH, TRUE },
+};
+
+/*
+ * make the key of a message of the vendor; returns the header length,
+ * or zero if the message is not decoded
+ */
+static int universal_key(unsigned char *buf, int len,
+			 unsigned int *key, int *part)
+{
+	/* ID, device, sub-ID 1, sub-ID 2 */
+	if (len < 4)
+		return 0;
+	*key = SYSEX_KEY(0, buf[0], buf[2], buf[3]);
+	return 4;
+}
+
+static int roland_key(unsigned char *buf, int len,
+		      unsigned int *key, int *part)
+{
+	/* ID, device, model, DT1 command, address */
+	if (len < 7 || buf[3] != 0x12)
+		return 0;
+	if (buf[4] == 0x40 && (buf[5] & 0xf0) == 0x10) {
+		*part = get_channel(buf[5]);
+		*key = SYSEX_KEY(buf[2], buf[4], 0x10, buf[6]);
+	} else
+		*key = SYSEX_KEY(buf[2], buf[4], buf[5], buf[6]);
+	return 7;
+}
+
+static int yamaha_key(unsigned char *buf, int len,
+		      unsigned int *key, int *part)
+{
+	/* ID, parameter change with device, model, address */
+	if (len < 6 || (buf[1] & 0xf0) != 0x10)
+		return 0;
+	if (buf[3] == 0x08) {
+		*part = buf[4];
+		*key = SYSEX_KEY(buf[2], buf[3], 0x00, buf[5]);
+	} else
+		*key = SYSEX_KEY(buf[2], buf[3], buf[4], buf[5]);
+	return 6;
+}
+
+static struct sysex_vendor {
+	int id;
+	int (*make_key)(unsigned char *buf, int len,
+			unsigned int *key, int *part);
+	sysex_msg_t *msgs;
+	int num_msgs;
+} sysex_vendors[] = {
+	{ 0x41, roland_key, roland_msgs, G_N_ELEMENTS(roland_msgs) },
+	{ 0x43, yamaha_key, yamaha_msgs, G_N_ELEMENTS(yamaha_msgs) },
+	{ 0x7e, universal_key, universal_msgs, G_N_ELEMENTS(universal_msgs) },
+	{ 0x7f, universal_key, universal_msgs, G_N_ELEMENTS(universal_msgs) },
+};
+
+static int sysex_vendor_index[128];	/* manufacturer ID -> vendor + 1 */
+
+static int compare_sysex_msg(const void *a, const void *b)
+{
+	unsigned int ka = ((const sysex_msg_t *) a)->key;
+	unsigned int kb = ((const sysex_msg_t *) b)->key;
+
+	return (ka > kb) - (ka < kb);
+}
+
+/*
+ * sort the message tables; called before the MIDI threads run
+ */
+static void sysex_init(void)
+{
+	int i;
+
+	for (i = 0; i < G_N_ELEMENTS(sysex_vendors); i++) {
+		qsort(sysex_vendors[i].msgs, sysex_vendors[i].num_msgs,
+		      sizeof(sysex_msg_t), compare_sysex_msg);
+		sysex_vendor_index[sysex_vendors[i].id] = i + 1;
+	}
+}
+
+/*
+ * take a sysex event: a whole message is parsed in place, and a
+ * split one is collected in the arena of the port until the F7.
+ * the event itself is passed on untouched.
+ */
+static void sysex_chunk(port_status_t *port, snd_seq_event_t *ev, int in_buf)
+{
+	unsigned char *data = ev->data.ext.ptr;
+	int len = ev->data.ext.len, start, end;
+	av_sysex_slot_t *slot;
+
+	if (len <= 0)
+		return;
+	start = (data[0] == 0xf0);
+	end = (data[len - 1] == 0xf7);
+	slot = sysex_slot(port, &ev->source, FALSE);
+	if (start) {
+		if (slot) {
+			/* the previous one was cut off */
+			port->sysex_partial++;
+			slot->active = FALSE;
+		}
+		if (end) {
+			parse_sysex(port, len, data, in_buf);
+			return;
+		}
+		slot = sysex_slot(port, &ev->source, TRUE);
+	} else if (!slot) {
+		/* the start was lost */
+		port->sysex_partial++;
+		return;
+	}
+	if (!slot->oversized) {
+		if (slot->len + len > SYSEX_ARENA)
+			slot->oversized = TRUE;
+		else {
+			memcpy(slot->buf + slot->len, data, len);
+			slot->len += len;
+		}
+	}
+	if (!end)
+		return;
+	slot->active = FALSE;
+	if (slot->oversized)
+		port->sysex_oversized++;
+	else
+		parse_sysex(port, slot->len, slot->buf, in_buf);
+}
+
+/*
+ * find the slot collecting a sysex from the source; a new slot takes
+ * an idle one, or the least recently used one which is cut off
+ */
+static av_sysex_slot_t *sysex_slot(port_status_t *port,
+				   snd_seq_addr_t *source, int create)
+{
+	av_sysex_slot_t *slot, *victim = NULL;
+	int i;
+
+	for (i = 0; i < SYSEX_SOURCES; i++) {
+		slot = &port->sysex[i];
+		if (slot->active) {
+			if (slot->source.client == source->client &&
+			    slot->source.port == source->port) {
+				slot->stamp = ++port->sysex_stamp;
+				return slot;
 			}
-			ttch = (buf[4] & 0x03) << 14 | buf[5] << 7 | buf[6];
-			port = &st->ports[port->index | buf[4] >> 2];
-			if (port->index >= 0 && port->index < st->num_ports)
-				for (i = 0; i < MIDI_CHANNELS; i++)
-					if (ttch & 1 << i) {
-						chst = &port->ch[i];
-						tt = chst->temper_type = buf[7];
-						display_temper_type(chst->w_temper_type, in_buf);
-						if (st->temper_type_mute
-								&& ((tt >= 0 && tt < 4) || (tt >= 64 && tt < 68)))
-							av_mute_update(chst->w_chnum,
-								       st->temper_type_mute &
-								       (1 << (tt - ((tt >= 0x40) ? 0x3c : 0))), in_buf);
-					}
-			break;
 		}
+		if (!victim ||
+		    (victim->active &&
+		     (!slot->active || (int) (slot->stamp - victim->stamp) < 0)))
+			victim = slot;
+	}
+	if (!create)
+		return NULL;
+	if (victim->active)
+		port->sysex_partial++;
+	victim->source = *source;
+	victim->active = TRUE;
+	victim->len = victim->oversized = 0;
+	victim->stamp = ++port->sysex_stamp;
+	return victim;
+}
+
+/*
+ * parse sysex message
+ */
+static void parse_sysex(port_status_t *port,
+		int len, unsigned char *buf, int in_buf)
+{
+	struct sysex_vendor *vendor;
+	sysex_msg_t *msg, key_msg;
+	int hlen, part = -1;
+
+	if (len <= 0 || buf[0] != 0xf0)
+		return;
+	/* skip first byte */
+	buf++, len--;
+	if (!len || buf[0] >= 0x80 || !sysex_vendor_index[buf[0]])
+		return;
+	vendor = &sysex_vendors[sysex_vendor_index[buf[0]] - 1];
+	hlen = vendor->make_key(buf, len, &key_msg.key, &part);
+	if (!hlen)
+		return;
+	msg = bsearch(&key_msg, vendor->msgs, vendor->num_msgs,
+		      sizeof(sysex_msg_t), compare_sysex_msg);
+	if (!msg || len - hlen < msg->len)
+		return;
+	if (msg->part && (part < 0 || part >= MIDI_CHANNELS))
+		return;
+	msg->decode(port, part, msg->arg, buf + hlen, in_buf);
 }
 
 /*
@@ -1683,59 +4411,104 @@ static void visualize_temper_type(midi_status_t *st, int in_buf)
 			continue;
 		for (i = 0; i < MIDI_CHANNELS; i++) {
 			chst = &port->ch[i];
-			display_temper_type(chst->w_temper_type, in_buf);
+			display_temper_type(chst);
+		}
+	}
+	for (i = 0; i < 8; i++) {
+		if (st->tt_mute_save & 1 << i)
+			suppress_temper_type(st, i, in_buf);
+		av_hide_tt_button(st->w_tt_button[i], FALSE, in_buf);
+	}
+}
+
+/*
+ * reset all stuff; the ports of other shards are reset by their
+ * own loops
+ */
+static void reset_all(midi_status_t *st,
+		int midi_mode, int do_out, int in_buf)
+{
+	midi_shard_t *shard;
+	int i;
+	
+	for (i = 0; i < st->num_shards; i++) {
+		shard = &st->shards[i];
+		if (on_shard(shard))
+			reset_ports(shard, do_out, in_buf);
+		else {
+			atomic_fetch_or(&shard->requests,
+					do_out ? REQ_RESET_OUT : REQ_RESET);
+			port_client_wakeup(shard->client);
 		}
 	}
+	st->midi_mode = midi_mode;
+	display_midi_mode(st->w_midi_mode, in_buf);
+	reset_master(st);
+	display_master(st->w_master, in_buf);
+	st->temper_keysig = TEMPER_UNKNOWN;
+	display_temper_keysig(st->w_temper_keysig, in_buf);
+	st->timer_update = TRUE;
+	if (st->temper_type_mute)
+		st->tt_mute_save = st->temper_type_mute;
 	for (i = 0; i < 8; i++) {
-		if (st->tt_mute_save & 1 << i)
-			suppress_temper_type(GTK_TOGGLE_BUTTON(st->w_tt_button[i]), st);
-		av_hide_tt_button(st->w_tt_button[i], FALSE, in_buf);
+		av_hide_tt_button(st->w_tt_button[i], TRUE, in_buf);
+		if (st->temper_type_mute & 1 << i)
+			suppress_temper_type(st, i, in_buf);
 	}
 }
 
 /*
- * reset all stuff
+ * reset the channels of the ports of a shard; in its loop, or
+ * before the loops run
  */
-static void reset_all(midi_status_t *st,
-		int midi_mode, int do_out, int in_buf)
+static void reset_ports(midi_shard_t *shard, int do_out, int in_buf)
 {
+	midi_status_t *st = shard->main;
 	int p, i;
 	port_status_t *port;
 	channel_status_t *chst;
-	
+
 	for (p = 0; p < st->num_ports; p++) {
-		if ((port = &st->ports[p])->index < 0)
+		if ((port = &st->ports[p])->shard != shard)
 			continue;
 		for (i = 0; i < MIDI_CHANNELS; i++) {
 			chst = &port->ch[i];
 			all_sounds_off(chst, 0);
 			chst->is_drum = (i == 9) ? 1 : 0;
-			set_vel_bar_color(chst->w_vel, chst->is_drum, in_buf);
+			set_vel_bar_color(chst);
 			change_program(port, i, 0, in_buf);
 			reset_controllers(chst, in_buf);
 			change_pitch(port, i, 0, in_buf);
 			chst->temper_type = 0;
-			display_temper_type(chst->w_temper_type, in_buf);
+			display_temper_type(chst);
 			if (show_piano)
-				av_piano_reset(chst->w_piano, in_buf);
+				av_piano_reset(chst);
 			if (do_out && is_redirect(port))
 				send_resets(chst);
 		}
 		if (do_out && is_redirect(port))
 			port_flush_event(port->port);
 	}
-	st->midi_mode = midi_mode;
-	display_midi_mode(st->w_midi_mode, in_buf);
-	st->temper_keysig = TEMPER_UNKNOWN;
-	display_temper_keysig(st->w_temper_keysig, in_buf);
-	st->timer_update = TRUE;
-	if (st->temper_type_mute)
-		st->tt_mute_save = st->temper_type_mute;
-	for (i = 0; i < 8; i++) {
-		av_hide_tt_button(st->w_tt_button[i], TRUE, in_buf);
-		if (st->temper_type_mute & 1 << i)
-			suppress_temper_type(GTK_TOGGLE_BUTTON(st->w_tt_button[i]), st);
-	}
+}
+
+/*
+ * whether the ports of the shard can be touched from this thread
+ */
+static int on_shard(midi_shard_t *shard)
+{
+	return !shard->main->loops_running || cur_ringbuf == &shard->ringbuf;
+}
+
+/*
+ * reset the device state set by sysex
+ */
+static void reset_master(midi_status_t *st)
+{
+	st->master[MASTER_VOLUME] = 0x3fff;
+	st->master[MASTER_BALANCE] = 0x2000;
+	st->master[MASTER_FINE_TUNING] = 0x2000;
+	st->master[MASTER_COARSE_TUNING] = 0x2000;
+	memset(st->effect_type, 0, sizeof(st->effect_type));
 }
 
 /*
@@ -1747,18 +4520,16 @@ static void send_resets(channel_status_t *chst)
 	snd_seq_event_t tmpev;
 	
 	snd_seq_ev_clear(&tmpev);
-	snd_seq_ev_set_direct(&tmpev);
-	snd_seq_ev_set_subs(&tmpev);
 	snd_seq_ev_set_controller(&tmpev, chst->ch,
 			MIDI_CTL_RESET_CONTROLLERS, 0);
-	port_write_event(chst->port->port, &tmpev, 0);
+	send_event(chst->port, &tmpev);
 	snd_seq_ev_set_controller(&tmpev, chst->ch,
 			MIDI_CTL_ALL_SOUNDS_OFF, 0);
-	port_write_event(chst->port->port, &tmpev, 0);
+	send_event(chst->port, &tmpev);
 	tmpev.type = SND_SEQ_EVENT_REGPARAM;
 	tmpev.data.control.param = 0;
 	tmpev.data.control.value = 256;
-	port_write_event(chst->port->port, &tmpev, 0);
+	send_event(chst->port, &tmpev);
 }
 
 /*
@@ -1772,74 +4543,406 @@ static int is_redirect(port_status_t *port)
 
 /*
  */
-static void av_mute_update(GtkWidget *w, int is_mute, int in_buf)
+static void av_mute_update(channel_status_t *chst, int is_mute, int in_buf)
 {
 	if (in_buf)
-		av_ringbuf_write(UPDATE_MUTE, w, is_mute);
+		av_ringbuf_write(UPDATE_MUTE, NULL,
+				 (chst->port->index * MIDI_CHANNELS + chst->ch) << 1 |
+				 (is_mute != 0));
+	else if (compact_view)
+		channel_strip_set_mute(chst->port->w_strip, chst->ch, is_mute);
 	else
-		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(w), is_mute);
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chst->w_chnum), is_mute);
 }
 
 /*
- * set color of velocity bar
+ * the channel status shown by the GUI is kept in a snapshot per port
+ * in threaded mode; the MIDI threads update it under a seqlock and
+ * mark the changed cells in dirty bitmaps.  only the first dirty
+ * channel posts an UPDATE_SNAPSHOT, and the GUI takes the bits once
+ * per frame on the frame clock and redraws only those cells.
+ * sysex and resets may touch the ports of other shards, so the
+ * writers are serialized by the odd sequence count.
  */
-static void set_vel_bar_color(GtkWidget *w, int is_drum, int in_buf)
+static unsigned int snap_begin(port_status_t *port)
 {
-	if (in_buf)
-		av_ringbuf_write(VEL_COLOR, w, is_drum);
+	unsigned int seq;
+
+	seq = atomic_load_explicit(&port->snap_seq, memory_order_relaxed);
+	do {
+		while (seq & 1) {
+			sched_yield();
+			seq = atomic_load_explicit(&port->snap_seq,
+						   memory_order_relaxed);
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&port->snap_seq,
+			&seq, seq + 1, memory_order_acquire,
+			memory_order_relaxed));
+	atomic_thread_fence(memory_order_release);
+	return seq + 1;
+}
+
+/*
+ * finish the update and mark the changed cells of the channel; the
+ * first dirty channel posts the notice to the GUI, so repeated
+ * changes of the same cell collapse until the next frame
+ */
+static void snap_end(port_status_t *port, unsigned int seq,
+		     int ch, unsigned int dirty)
+{
+	unsigned int bit = 1U << ch;
+
+	atomic_store_explicit(&port->snap_seq, seq + 1, memory_order_release);
+	if ((atomic_load_explicit(&port->dirty_col[ch], memory_order_relaxed)
+	     & dirty) != dirty)
+		atomic_fetch_or_explicit(&port->dirty_col[ch], dirty,
+					 memory_order_release);
+	if (atomic_load_explicit(&port->dirty_chan, memory_order_relaxed) & bit)
+		return;
+	if (atomic_fetch_or_explicit(&port->dirty_chan, bit,
+				     memory_order_release))
+		return;
+	if (cur_ringbuf)
+		av_ringbuf_write(UPDATE_SNAPSHOT, NULL, port->index);
+	else
+		av_snapshot_schedule(port);
+}
+
+/*
+ * copy a consistent snapshot of all channels of the port
+ */
+static void snap_read(port_status_t *port, av_channel_snap_t *snap)
+{
+	unsigned int seq;
+
+	for (;;) {
+		seq = atomic_load_explicit(&port->snap_seq, memory_order_acquire);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(snap, port->snap, sizeof(port->snap));
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&port->snap_seq,
+					 memory_order_relaxed) == seq)
+			break;
+	}
+}
+
+/*
+ * fill the snapshot from the channel status; called before the
+ * MIDI threads run
+ */
+static void snap_fill(port_status_t *port)
+{
+	channel_status_t *chst;
+	av_channel_snap_t *snap;
+	int i;
+
+	for (i = 0; i < MIDI_CHANNELS; i++) {
+		chst = &port->ch[i];
+		snap = &port->snap[i];
+		memset(snap, 0, sizeof(*snap));
+		snap->val[V_VEL] = note_index_max_vel(&chst->notes);
+		snap->val[V_MAIN] = chst->ctrl[MIDI_CTL_MSB_MAIN_VOLUME];
+		snap->val[V_EXP] = chst->ctrl[MIDI_CTL_MSB_EXPRESSION];
+		snap->val[V_PAN] = chst->ctrl[MIDI_CTL_MSB_PAN];
+		snap->val[V_PITCH] = chst->pitch;
+		snap->val[V_POLY] = note_index_poly(&chst->notes);
+		memcpy(snap->keys, chst->notes.keys, sizeof(snap->keys));
+		strcpy(snap->progname, chst->progname);
+		snap->is_drum = chst->is_drum;
+		snap->temper_type = chst->temper_type;
+	}
+	port->shown_valid = FALSE;
+}
+
+/*
+ * frame clock callback: apply the snapshot while it changes
+ */
+static gboolean snap_tick(GtkWidget *w, GdkFrameClock *clock, gpointer data)
+{
+	port_status_t *port = (port_status_t *) data;
+	unsigned int chans;
+
+	chans = atomic_exchange_explicit(&port->dirty_chan, 0,
+					 memory_order_acquire);
+	if (!chans && port->shown_valid) {
+		port->snap_tick = 0;
+		return G_SOURCE_REMOVE;
+	}
+	av_snapshot_apply(port, chans);
+	return G_SOURCE_CONTINUE;
+}
+
+static void av_snapshot_schedule(port_status_t *port)
+{
+	if (!port->snap_tick && port->w_window)
+		port->snap_tick = gtk_widget_add_tick_callback(port->w_window,
+				snap_tick, port, NULL);
+}
+
+/*
+ * update the dirty cells of the given channels; the bits are taken
+ * before the snapshot is read, so the values are at least as new.
+ * the whole port is redrawn after a resync.
+ */
+static void av_snapshot_apply(port_status_t *port, unsigned int chans)
+{
+	av_channel_snap_t snap[MIDI_CHANNELS], *cur;
+	channel_status_t *chst;
+	unsigned int cols[MIDI_CHANNELS], keys[MIDI_CHANNELS][NUM_KEYS / 32];
+	unsigned int bits;
+	int i, col, n, key, valid = port->shown_valid;
+
+	if (!valid)
+		chans = (1U << MIDI_CHANNELS) - 1;
+	for (i = 0; i < MIDI_CHANNELS; i++) {
+		if (!(chans & 1U << i))
+			continue;
+		cols[i] = atomic_exchange_explicit(&port->dirty_col[i], 0,
+						   memory_order_acquire);
+		if (!valid)
+			cols[i] = SNAP_DIRTY_ALL;
+		if (!(cols[i] & 1U << V_PIANO))
+			continue;
+		for (n = 0; n < NUM_KEYS / 32; n++) {
+			keys[i][n] = atomic_exchange_explicit(&port->dirty_keys[i][n],
+						0, memory_order_acquire);
+			if (!valid)
+				keys[i][n] = ~0U;
+		}
+	}
+	snap_read(port, snap);
+	port->shown_valid = TRUE;
+	for (i = 0; i < MIDI_CHANNELS; i++) {
+		if (!(chans & 1U << i) || !cols[i])
+			continue;
+		cur = &snap[i];
+		chst = &port->ch[i];
+		if (cols[i] & SNAP_DIRTY_DRUM)
+			show_vel_color(chst, cur->is_drum);
+		for (col = V_VEL; col <= V_POLY; col++)
+			if (cols[i] & 1U << col)
+				show_value(chst, col, cur->val[col]);
+		if (cols[i] & 1U << V_PROG)
+			show_program(chst, cur->progname);
+		if (cols[i] & 1U << V_TEMPER)
+			show_temper(chst);
+		if (!show_piano || !(cols[i] & 1U << V_PIANO))
+			continue;
+		for (n = 0; n < NUM_KEYS / 32; n++) {
+			bits = keys[i][n];
+			while (bits) {
+				key = __builtin_ctz(bits);
+				bits &= bits - 1;
+				show_key(chst, n * 32 + key,
+					 cur->keys[n] & 1U << key);
+			}
+		}
+	}
+}
+
+/*
+ * the status bar widget of a snapshot column
+ */
+static GtkWidget *channel_widget(channel_status_t *chst, int col)
+{
+	switch (col) {
+	case V_VEL:
+		return chst->w_vel;
+	case V_MAIN:
+		return chst->w_main;
+	case V_EXP:
+		return chst->w_exp;
+	case V_PAN:
+		return chst->w_pan;
+	case V_PITCH:
+		return chst->w_pitch;
+	}
+	return NULL;
+}
+
+/*
+ * the widgets of a channel, either in the table or in the strip
+ */
+static void show_vel_color(channel_status_t *chst, int is_drum)
+{
+	if (compact_view)
+		channel_strip_set_drum(chst->port->w_strip, chst->ch, is_drum);
+	else if (is_drum)
+		channel_status_bar_set_color_rgb(chst->w_vel, 0xffff, 0x4000, 0x4000);
+	else
+		channel_status_bar_set_color_rgb(chst->w_vel, 0x2000, 0xb000, 0x2000);
+}
+
+static void show_value(channel_status_t *chst, int col, int val)
+{
+	if (col == V_POLY)
+		show_poly(chst, val);
+	else if (compact_view)
+		channel_strip_set_value(chst->port->w_strip, chst->ch,
+					col - V_VEL + STRIP_VEL, val);
+	else
+		channel_status_bar_update(channel_widget(chst, col), val);
+}
+
+static void show_poly(channel_status_t *chst, int poly)
+{
+	char tmp[8];
+
+	if (compact_view)
+		channel_strip_set_poly(chst->port->w_strip, chst->ch, poly);
 	else {
-		if (is_drum)
-			channel_status_bar_set_color_rgb(w, 0xffff, 0x4000, 0x4000);
-		else
-			channel_status_bar_set_color_rgb(w, 0x2000, 0xb000, 0x2000);
+		sprintf(tmp, "%d", poly);
+		gtk_label_set_text(GTK_LABEL(chst->w_poly), tmp);
 	}
+	show_voices(chst->port->main);
 }
 
 /*
+ * the total of the notes on, shown in the window of port 0
  */
-static void av_channel_update(GtkWidget *w, int val, int in_buf)
+static void show_voices(midi_status_t *st)
 {
-	if (in_buf)
-		av_ringbuf_write(UPDATE_STATUS, w, val);
+	char tmp[16];
+	int voices;
+
+	voices = atomic_load_explicit(&st->voices, memory_order_relaxed);
+	if (!st->w_voices || voices == st->voices_shown)
+		return;
+	st->voices_shown = voices;
+	sprintf(tmp, "Voices: %d", voices);
+	gtk_label_set_text(GTK_LABEL(st->w_voices), tmp);
+}
+
+static void show_program(channel_status_t *chst, const char *name)
+{
+	if (compact_view)
+		channel_strip_set_program(chst->port->w_strip, chst->ch, name);
+	else
+		gtk_label_set_text(GTK_LABEL(chst->w_prog), name);
+}
+
+static void show_temper(channel_status_t *chst)
+{
+	if (compact_view)
+		channel_strip_set_icon(chst->port->w_strip, chst->ch,
+				       temper_icon(chst));
+	else
+		gtk_widget_queue_draw(chst->w_temper_type);
+}
+
+static void show_key(channel_status_t *chst, int key, int on)
+{
+	if (compact_view)
+		channel_strip_set_key(chst->port->w_strip, chst->ch, key, on);
+	else if (on)
+		piano_note_on(PIANO(chst->w_piano), key);
 	else
-		channel_status_bar_update(w, val);
+		piano_note_off(PIANO(chst->w_piano), key);
 }
 
 /*
+ * the icon of the temperament type of a channel
  */
-static void av_note_update(GtkWidget *w, int key, int note_on, int in_buf)
+static cairo_surface_t *temper_icon(channel_status_t *chst)
 {
-	if (in_buf)
-		av_ringbuf_write((note_on) ? NOTE_ON : NOTE_OFF, w, key);
-	else {
+	midi_status_t *st = chst->port->main;
+	int tk = st->temper_keysig, tt = chst->temper_type, i;
+
+	if ((tt >= 0 && tt < 4) || (tt >= 64 && tt < 68))
+		i = (tk == TEMPER_UNKNOWN) ? 0 : tt - ((tt >= 0x40) ? 0x3c : 0) + 1;
+	else
+		i = 0;
+	return st->w_tt_xpm[i];
+}
+
+static void set_vel_bar_color(channel_status_t *chst)
+{
+	port_status_t *port = chst->port;
+	unsigned int seq;
+
+	if (use_thread) {
+		seq = snap_begin(port);
+		port->snap[chst->ch].is_drum = chst->is_drum;
+		snap_end(port, seq, chst->ch, SNAP_DIRTY_DRUM);
+	} else
+		show_vel_color(chst, chst->is_drum);
+}
+
+/*
+ */
+static void av_channel_update(channel_status_t *chst, int col, int val)
+{
+	port_status_t *port = chst->port;
+	unsigned int seq;
+
+	if (use_thread) {
+		seq = snap_begin(port);
+		port->snap[chst->ch].val[col] = val;
+		snap_end(port, seq, chst->ch, 1U << col);
+	} else
+		show_value(chst, col, val);
+}
+
+/*
+ */
+static void av_note_update(channel_status_t *chst, int key, int note_on)
+{
+	port_status_t *port = chst->port;
+	unsigned int seq, *keys, bit = 1U << (key % 32);
+
+	if (use_thread) {
+		seq = snap_begin(port);
+		keys = &port->snap[chst->ch].keys[key / 32];
 		if (note_on)
-			piano_note_on(PIANO(w), key);
+			*keys |= bit;
 		else
-			piano_note_off(PIANO(w), key);
-	}
+			*keys &= ~bit;
+		atomic_fetch_or_explicit(&port->dirty_keys[chst->ch][key / 32],
+					 bit, memory_order_release);
+		snap_end(port, seq, chst->ch, 1U << V_PIANO);
+	} else
+		show_key(chst, key, note_on);
 }
 
 /*
  */
-static void av_piano_reset(GtkWidget *w, int in_buf)
+static void av_piano_reset(channel_status_t *chst)
 {
+	port_status_t *port = chst->port;
+	unsigned int seq, *keys;
 	int i;
 	
-	if (in_buf)
-		av_ringbuf_write(PIANO_RESET, w, 0);
-	else
+	if (use_thread) {
+		seq = snap_begin(port);
+		keys = port->snap[chst->ch].keys;
+		for (i = 0; i < NUM_KEYS / 32; i++) {
+			if (keys[i])
+				atomic_fetch_or_explicit(&port->dirty_keys[chst->ch][i],
+						keys[i], memory_order_release);
+			keys[i] = 0;
+		}
+		snap_end(port, seq, chst->ch, 1U << V_PIANO);
+	} else
 		for (i = 0; i < NUM_KEYS; i++)
-			av_note_update(w, i, FALSE, 0);
+			av_note_update(chst, i, FALSE);
 }
 
 /*
  */
-static void av_program_update(GtkWidget *w, char *progname, int in_buf)
+static void av_program_update(channel_status_t *chst)
 {
-	if (in_buf)
-		av_ringbuf_write(UPDATE_PGM, w, (unsigned long) progname);
-	else
-		gtk_label_set_text(GTK_LABEL(w), progname);
+	port_status_t *port = chst->port;
+	unsigned int seq;
+
+	if (use_thread) {
+		seq = snap_begin(port);
+		strcpy(port->snap[chst->ch].progname, chst->progname);
+		snap_end(port, seq, chst->ch, 1U << V_PROG);
+	} else
+		show_program(chst, chst->progname);
 }
 
 /*
@@ -1856,20 +4959,66 @@ static void display_midi_mode(GtkWidget *w, int in_buf)
  */
 static void display_temper_keysig(GtkWidget *w, int in_buf)
 {
-	if (in_buf)
+	midi_status_t *st;
+	int p, i;
+
+	if (in_buf) {
 		av_ringbuf_write(UPDATE_TEMPER_KEYSIG, w, 0);
-	else
-		gtk_widget_queue_draw(w);
+		return;
+	}
+	gtk_widget_queue_draw(w);
+	/* the icons of the strips depend on the keysig, too */
+	if (!compact_view)
+		return;
+	st = g_object_get_data(G_OBJECT(w), "midi_st");
+	for (p = 0; p < st->num_ports; p++)
+		if (st->ports[p].index >= 0)
+			for (i = 0; i < MIDI_CHANNELS; i++)
+				show_temper(&st->ports[p].ch[i]);
 }
 
 /*
+ * the device state set by sysex: master volume in percent, balance,
+ * fine tuning in cents, coarse tuning in semitones, and the effect
+ * types as the GS macros or XG type numbers
  */
-static void display_temper_type(GtkWidget *w, int in_buf)
+static void display_master(GtkWidget *w, int in_buf)
 {
-	if (in_buf)
-		av_ringbuf_write(UPDATE_TEMPER_TYPE, w, 0);
-	else
-		gtk_widget_queue_draw(w);
+	midi_status_t *st;
+	char tmp[80];
+
+	if (in_buf) {
+		av_ringbuf_write(UPDATE_MASTER, w, 0);
+		return;
+	}
+	if (!w)
+		return;
+	st = g_object_get_data(G_OBJECT(w), "midi_st");
+	snprintf(tmp, sizeof(tmp),
+		 "Master: %d%%  Bal: %+d  Tune: %+d/%+d  Rev: %d  Cho: %d  Var: %d",
+		 st->master[MASTER_VOLUME] * 100 / 0x3fff,
+		 (st->master[MASTER_BALANCE] >> 7) - 64,
+		 (st->master[MASTER_FINE_TUNING] - 0x2000) * 100 / 0x2000,
+		 (st->master[MASTER_COARSE_TUNING] >> 7) - 64,
+		 st->effect_type[EFFECT_REVERB],
+		 st->effect_type[EFFECT_CHORUS],
+		 st->effect_type[EFFECT_VARIATION]);
+	gtk_label_set_text(GTK_LABEL(w), tmp);
+}
+
+/*
+ */
+static void display_temper_type(channel_status_t *chst)
+{
+	port_status_t *port = chst->port;
+	unsigned int seq;
+
+	if (use_thread) {
+		seq = snap_begin(port);
+		port->snap[chst->ch].temper_type = chst->temper_type;
+		snap_end(port, seq, chst->ch, 1U << V_TEMPER);
+	} else
+		show_temper(chst);
 }
 
 /*
@@ -1882,6 +5031,23 @@ static void av_hide_tt_button(GtkWidget *w, int is_hide, int in_buf)
 		gtk_toggle_button_set_mode(GTK_TOGGLE_BUTTON(w), is_hide);
 }
 
+/*
+ * show the number of input overruns in the window title
+ */
+static void av_overrun_update(GtkWidget *w, int overruns, int in_buf)
+{
+	char name[96];
+
+	if (in_buf)
+		av_ringbuf_write(UPDATE_OVERRUN, w, overruns);
+	else {
+		sprintf(name, "%s (%d overruns)",
+			(char *) g_object_get_data(G_OBJECT(w), "title"),
+			overruns);
+		gtk_window_set_title(GTK_WINDOW(w), name);
+	}
+}
+
 /*
  */
 struct av_ringbuf {
@@ -1890,104 +5056,132 @@ struct av_ringbuf {
 	long data;
 };
 
-#define RINGBUF_SIZE 512
-
-static struct av_ringbuf *ringbuf;
-static int ringbuf_rdptr, ringbuf_wrptr;
-
 /*
  */
-static void av_ringbuf_init(void)
+static void av_ringbuf_init(av_ringbuf_t *rb, int size, int wake_fd)
 {
-	ringbuf = (struct av_ringbuf *) g_malloc0(sizeof(struct av_ringbuf)
-			* RINGBUF_SIZE);
-	ringbuf_rdptr = ringbuf_wrptr = 0;
+	rb->size = 16;
+	while (rb->size < size)
+		rb->size <<= 1;
+	rb->buf = (struct av_ringbuf *) g_malloc0(sizeof(struct av_ringbuf)
+			* rb->size);
+	atomic_init(&rb->rdptr, 0);
+	atomic_init(&rb->wrptr, 0);
+	atomic_init(&rb->resync, 0);
+	atomic_init(&rb->waiting, 1);
+	rb->wake_fd = wake_fd;
 }
 
 /*
  */
-static void av_ringbuf_free(void)
+static void av_ringbuf_free(av_ringbuf_t *rb)
 {
-	g_free(ringbuf);
+	g_free(rb->buf);
 }
 
 /*
  */
-static int av_ringbuf_read(int *type, GtkWidget **w, long *data)
+static int av_ringbuf_read(av_ringbuf_t *rb, int *type, GtkWidget **w,
+			   long *data)
 {
-	int rp;
+	unsigned int rp;
+	struct av_ringbuf *slot;
 	
-	if (ringbuf_rdptr == ringbuf_wrptr)
+	rp = atomic_load_explicit(&rb->rdptr, memory_order_relaxed);
+	if (rp == atomic_load_explicit(&rb->wrptr, memory_order_acquire))
 		return 0;
-	rp = ringbuf_rdptr;
-	*type = ringbuf[rp].type;
-	*w = ringbuf[rp].w;
-	*data = ringbuf[rp].data;
-	rp = (rp + 1) & (RINGBUF_SIZE - 1);
-	ringbuf_rdptr = rp;
+	slot = &rb->buf[rp & (rb->size - 1)];
+	*type = slot->type;
+	*w = slot->w;
+	*data = slot->data;
+	atomic_store_explicit(&rb->rdptr, rp + 1, memory_order_release);
 	return 1;
 }
 
 /*
+ * each MIDI thread writes only to its own shard's buffer,
+ * so every buffer keeps a single writer.  when the buffer is
+ * full, the update is dropped and the GUI is told to rebuild
+ * the whole state.
  */
 static int av_ringbuf_write(int type, GtkWidget *w, long data)
 {
-	int wp, nwp;
+	av_ringbuf_t *rb = cur_ringbuf;
+	unsigned int wp, depth;
+	struct av_ringbuf *slot;
 	
-	wp = ringbuf_wrptr;
-	nwp = (wp + 1) & (RINGBUF_SIZE - 1);
-	if (ringbuf_rdptr == nwp)
+	if (!rb)
 		return 0;
-	ringbuf_wrptr = nwp;
-	ringbuf[wp].type = type;
-	ringbuf[wp].w = w;
-	ringbuf[wp].data = data;
+	wp = atomic_load_explicit(&rb->wrptr, memory_order_relaxed);
+	depth = wp - atomic_load_explicit(&rb->rdptr, memory_order_acquire);
+	if (depth >= rb->size) {
+		rb->drops[type]++;
+		if (!atomic_exchange_explicit(&rb->resync, 1, memory_order_release))
+			rb->overflows++;
+		return 0;
+	}
+	slot = &rb->buf[wp & (rb->size - 1)];
+	slot->type = type;
+	slot->w = w;
+	slot->data = data;
+	atomic_store_explicit(&rb->wrptr, wp + 1, memory_order_release);
+	if (depth + 1 > rb->max_depth)
+		rb->max_depth = depth + 1;
+	/* wake up the GUI if it went idle */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&rb->waiting, memory_order_relaxed) &&
+	    atomic_exchange_explicit(&rb->waiting, 0, memory_order_relaxed))
+		eventfd_write(rb->wake_fd, 1);
 	return 1;
 }
 
+/*
+ * the reader goes idle: the next write wakes it up.
+ * returns FALSE if updates arrived meanwhile.
+ */
+static int av_ringbuf_park(av_ringbuf_t *rb)
+{
+	atomic_store_explicit(&rb->waiting, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	return atomic_load_explicit(&rb->wrptr, memory_order_relaxed) ==
+		atomic_load_explicit(&rb->rdptr, memory_order_relaxed);
+}
+
 /*
  */
 static void *midi_loop(void *arg)
 {
-	midi_status_t *st = (midi_status_t *) arg;
+	midi_shard_t *shard = (midi_shard_t *) arg;
 	
+	cur_ringbuf = &shard->ringbuf;
 	if (rt_prio)
 		set_realtime_priority(SCHED_FIFO);
-	port_client_do_loop(st->client, 50);
+	port_client_do_loop(shard->client, -1);
 	pthread_exit(NULL);
 	return 0;
 }
 
 /*
+ * apply the updates of a shard; after an overflow, the state of
+ * the shard is rebuilt once the buffer is drained
  */
-static gboolean idle_cb(gpointer data)
+static void av_ringbuf_process(midi_shard_t *shard)
 {
+	av_ringbuf_t *rb = &shard->ringbuf;
+	port_status_t *port;
 	int type;
 	GtkWidget *w;
 	long val;
 	
-	while (av_ringbuf_read(&type, &w, &val)) {
+	while (av_ringbuf_read(rb, &type, &w, &val)) {
 		switch (type) {
 		case UPDATE_MUTE:
-			av_mute_update(w, val, 0);
-			break;
-		case VEL_COLOR:
-			set_vel_bar_color(w, val, 0);
-			break;
-		case UPDATE_STATUS:
-			av_channel_update(w, val, 0);
+			port = &shard->main->ports[(val >> 1) / MIDI_CHANNELS];
+			av_mute_update(&port->ch[(val >> 1) % MIDI_CHANNELS],
+				       val & 1, 0);
 			break;
-		case NOTE_ON:
-			av_note_update(w, val, TRUE, 0);
-			break;
-		case NOTE_OFF:
-			av_note_update(w, val, FALSE, 0);
-			break;
-		case PIANO_RESET:
-			av_piano_reset(w, 0);
-			break;
-		case UPDATE_PGM:
-			av_program_update(w, (char *) val, 0);
+		case UPDATE_SNAPSHOT:
+			av_snapshot_schedule(&shard->main->ports[val]);
 			break;
 		case UPDATE_MODE:
 			display_midi_mode(w, 0);
@@ -1995,42 +5189,103 @@ static gboolean idle_cb(gpointer data)
 		case UPDATE_TEMPER_KEYSIG:
 			display_temper_keysig(w, 0);
 			break;
-		case UPDATE_TEMPER_TYPE:
-			display_temper_type(w, 0);
-			break;
 		case HIDE_TT_BUTTON:
 			av_hide_tt_button(w, val, 0);
 			break;
+		case UPDATE_OVERRUN:
+			av_overrun_update(w, val, 0);
+			break;
+		case UPDATE_WIRE:
+			av_wire_update(&shard->main->ports[val], 0);
+			break;
+		case UPDATE_MASTER:
+			display_master(w, 0);
+			break;
 		}
 	}
-	usleep(1000);
-	return TRUE;
+	if (atomic_exchange_explicit(&rb->resync, 0, memory_order_acquire))
+		resync_shard(shard);
 }
 
 /*
+ * rebuild the widgets of a shard from the channel status
  */
-static int get_file_desc(midi_status_t *st)
+static void resync_shard(midi_shard_t *shard)
 {
-#if SND_LIB_MAJOR > 0 || SND_LIB_MINOR > 5
-	int npfds = snd_seq_poll_descriptors_count(
-			port_client_get_seq(st->client), POLLIN);
-	struct pollfd pfd;
-#endif
-	int fd = -1;
-	
-#if SND_LIB_MAJOR > 0 || SND_LIB_MINOR > 5
-	if (npfds == 1 && snd_seq_poll_descriptors(
-			port_client_get_seq(st->client), &pfd, npfds, POLLIN) >= 0)
-		fd = pfd.fd;
-#else
-	fd = snd_seq_file_descriptor(port_client_get_seq(st->client));
-#endif
-	if (fd < 0) {
-		fprintf(stderr, "cannot get file descriptor "
-				"for ALSA sequencer inputs\n");
-		exit(1);
+	midi_status_t *st = shard->main;
+	port_status_t *port;
+	int p, i;
+
+	for (p = 0; p < st->num_ports; p++) {
+		port = &st->ports[p];
+		if (port->index < 0)
+			continue;
+		/* the snapshots never drop, but a dropped notice of
+		 * any port may have been posted by this shard
+		 */
+		port->shown_valid = FALSE;
+		av_snapshot_schedule(port);
+		if (port->shard != shard)
+			continue;
+		if (port_get_overruns(port->port))
+			av_overrun_update(port->w_window,
+					  port_get_overruns(port->port), 0);
+		if (atomic_load(&port->wire_shown))
+			av_wire_update(port, 0);
+	}
+	/* sysex of any shard may change the common part */
+	display_midi_mode(st->w_midi_mode, 0);
+	display_temper_keysig(st->w_temper_keysig, 0);
+	display_master(st->w_master, 0);
+	for (i = 0; i < 8; i++)
+		av_hide_tt_button(st->w_tt_button[i],
+				  st->temper_keysig == TEMPER_UNKNOWN, 0);
+}
+
+/*
+ * GUI source of threaded mode: dispatched when a MIDI thread
+ * writes to an idle ring buffer, so the GUI sleeps without MIDI.
+ * it runs at idle priority like the redraws, which it must not
+ * starve when the updates keep coming.
+ */
+typedef struct {
+	GSource source;
+	midi_status_t *st;
+} av_source_t;
+
+static GSourceFuncs av_source_funcs = {
+	NULL, NULL, av_source_dispatch, NULL
+};
+
+static GSource *av_source_new(midi_status_t *st)
+{
+	GSource *source = g_source_new(&av_source_funcs, sizeof(av_source_t));
+
+	((av_source_t *) source)->st = st;
+	g_source_add_unix_fd(source, st->wake_fd, G_IO_IN);
+	g_source_set_priority(source, G_PRIORITY_DEFAULT_IDLE);
+	g_source_set_name(source, "aseqview updates");
+	g_source_attach(source, NULL);
+	return source;
+}
+
+static gboolean av_source_dispatch(GSource *source, GSourceFunc func,
+				   gpointer data)
+{
+	midi_status_t *st = ((av_source_t *) source)->st;
+	eventfd_t val;
+	int i, busy = FALSE;
+
+	eventfd_read(st->wake_fd, &val);
+	for (i = 0; i < st->num_shards; i++) {
+		av_ringbuf_process(&st->shards[i]);
+		if (!av_ringbuf_park(&st->shards[i].ringbuf))
+			busy = TRUE;
 	}
-	return fd;
+	/* more to do; come back after the others had their turn */
+	if (busy)
+		eventfd_write(st->wake_fd, 1);
+	return TRUE;
 }
 
 /*
@@ -2038,9 +5293,9 @@ static int get_file_desc(midi_status_t *st)
  */
 static gboolean handle_input(gint source, GIOCondition condition, gpointer data)
 {
-	midi_status_t *st = (midi_status_t *) data;
+	midi_shard_t *shard = (midi_shard_t *) data;
 
-	port_client_do_event(st->client);
+	port_client_dispatch(shard->client, 0);
 	return TRUE;
 }
 
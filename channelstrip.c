@@ -0,0 +1,646 @@
+/*
+ * channelstrip.c
+ *
+ * compact viewer: all channels of a port drawn by a single widget
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+#include "channelstrip.h"
+#include "levelbar.h"
+#include "piano.h"
+
+/*
+ * layout
+ */
+#define ROW_HEIGHT	20
+#define BAR_HEIGHT	16
+#define SPACING		4
+#define CHNUM_WIDTH	24
+#define PROG_WIDTH	64
+#define POLY_WIDTH	32
+#define PROG_NAME_LEN	8
+#define NUM_KEYS	128
+
+enum {
+	COL_CHNUM,
+	COL_PROG,
+	COL_VEL,
+	COL_MAIN,
+	COL_EXP,
+	COL_PAN,
+	COL_PITCH,
+	COL_POLY,
+	COL_TEMPER,
+	COL_PIANO,
+	NUM_COLS
+};
+
+static const char *col_titles[NUM_COLS] = {
+	"Ch", "Prog", "Vel", "Main", "Exp", "Pan", "Pitch", "Poly", "", "Piano"
+};
+
+/*
+ * bar columns: range, width and color
+ */
+static const struct bar_info {
+	int minval, maxval, defval;
+	int width;
+	int arrow;
+	double r, g, b;
+} bar_info[STRIP_VALUES] = {
+	{ 0, 127, 0, 64, FALSE, 0x2000 / 65535.0, 0xb000 / 65535.0, 0x2000 / 65535.0 },
+	{ 0, 127, 0, 48, FALSE, 0x8000 / 65535.0, 0x8000 / 65535.0, 1.0 },
+	{ 0, 127, 0, 48, FALSE, 1.0, 0x6000 / 65535.0, 0xb000 / 65535.0 },
+	{ 0, 127, 64, 36, TRUE, 1.0, 0x8000 / 65535.0, 0.0 },
+	{ -8192, 8191, 0, 36, TRUE, 0x6000 / 65535.0, 0xc000 / 65535.0, 0xc000 / 65535.0 },
+};
+
+/*
+ * keyboard: the white key left to each key, and black keys
+ */
+static const unsigned char white_index[12] = {
+	0, 1, 1, 2, 2, 3, 4, 4, 5, 5, 6, 6
+};
+static const unsigned char black_key[12] = {
+	0, 1, 0, 1, 0, 0, 1, 0, 1, 0, 1, 0
+};
+
+/*
+ * channel row record
+ */
+typedef struct strip_row_t {
+	int val[STRIP_VALUES];
+	unsigned short drawn[STRIP_VALUES];
+	char progname[PROG_NAME_LEN + 1];
+	char is_drum, mute;
+	int poly;
+	cairo_surface_t *icon;
+	unsigned int keys[NUM_KEYS / 32];
+	level_peak_t peak;		/* peak of velocity */
+} strip_row_t;
+
+struct _ChannelStrip {
+	GtkDrawingArea area;
+	int show_piano;
+	int icon_width, icon_height;
+	int col_x[NUM_COLS + 1];	/* left edges, and the total width */
+	strip_row_t rows[STRIP_CHANNELS];
+	PangoLayout *layout;
+	cairo_surface_t *keyboard;	/* empty keyboard of one row */
+	cairo_pattern_t *segments[2];	/* velocity segments, drum */
+	guint tick;			/* peak animation */
+};
+
+struct _ChannelStripClass {
+	GtkDrawingAreaClass parent_class;
+};
+
+enum {
+	MUTE_TOGGLED,
+	LAST_SIGNAL
+};
+
+static guint strip_signals[LAST_SIGNAL];
+
+/*
+ * prototypes
+ */
+static void channel_strip_finalize(GObject *obj);
+static void strip_draw(ChannelStrip *strip, cairo_t *cr);
+static void draw_row(ChannelStrip *strip, cairo_t *cr, int ch);
+static void draw_keyboard(ChannelStrip *strip);
+static void queue_row(ChannelStrip *strip, int ch);
+static void toggle_mute(ChannelStrip *strip, double x, double y);
+static gboolean peak_tick(GtkWidget *w, GdkFrameClock *clock, gpointer data);
+#ifdef USE_GTK4
+static void strip_draw_func(GtkDrawingArea *da, cairo_t *cr,
+			    int width, int height, gpointer data);
+static void strip_pressed(GtkGestureClick *gesture, int n_press,
+			  double x, double y, gpointer data);
+#else
+static gboolean channel_strip_draw(GtkWidget *w, cairo_t *cr);
+static gboolean channel_strip_button_press(GtkWidget *w, GdkEventButton *ev);
+#endif
+
+G_DEFINE_TYPE(ChannelStrip, channel_strip, GTK_TYPE_DRAWING_AREA)
+
+static void
+channel_strip_class_init(ChannelStripClass *klass)
+{
+	GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(klass);
+
+	G_OBJECT_CLASS(klass)->finalize = channel_strip_finalize;
+#ifndef USE_GTK4
+	widget_class->draw = channel_strip_draw;
+	widget_class->button_press_event = channel_strip_button_press;
+#else
+	(void) widget_class;
+#endif
+	strip_signals[MUTE_TOGGLED] = g_signal_new("mute-toggled",
+		G_TYPE_FROM_CLASS(klass),
+		G_SIGNAL_RUN_FIRST,
+		0, NULL, NULL,
+		g_cclosure_marshal_VOID__UINT,
+		G_TYPE_NONE, 1, G_TYPE_UINT);
+}
+
+static void
+channel_strip_init(ChannelStrip *strip)
+{
+#ifdef USE_GTK4
+	GtkGesture *gesture;
+
+	gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(strip),
+				       strip_draw_func, NULL, NULL);
+	gesture = gtk_gesture_click_new();
+	gtk_gesture_single_set_button(GTK_GESTURE_SINGLE(gesture), 1);
+	g_signal_connect(gesture, "pressed", G_CALLBACK(strip_pressed), strip);
+	gtk_widget_add_controller(GTK_WIDGET(strip),
+				  GTK_EVENT_CONTROLLER(gesture));
+#else
+	gtk_widget_add_events(GTK_WIDGET(strip), GDK_BUTTON_PRESS_MASK);
+#endif
+}
+
+static void
+channel_strip_finalize(GObject *obj)
+{
+	ChannelStrip *strip = CHANNEL_STRIP(obj);
+	int i;
+
+	if (strip->layout)
+		g_object_unref(strip->layout);
+	if (strip->keyboard)
+		cairo_surface_destroy(strip->keyboard);
+	for (i = 0; i < 2; i++)
+		if (strip->segments[i])
+			cairo_pattern_destroy(strip->segments[i]);
+	G_OBJECT_CLASS(channel_strip_parent_class)->finalize(obj);
+}
+
+/*
+ * convert to pixel
+ */
+static int
+convert_drawn(int col, int val)
+{
+	const struct bar_info *info = &bar_info[col];
+
+	val = (val - info->minval) * (info->width - 1);
+	val /= (info->maxval - info->minval);
+	if (col == STRIP_VEL)
+		val = (val / LEVEL_STEP) * LEVEL_STEP;
+	return val;
+}
+
+/*
+ * create a strip of all channels
+ */
+GtkWidget *
+channel_strip_new(int show_piano, int icon_width, int icon_height)
+{
+	ChannelStrip *strip;
+	strip_row_t *row;
+	int i, col, x, width;
+
+	strip = g_object_new(channel_strip_get_type(), NULL);
+	strip->show_piano = show_piano;
+	strip->icon_width = icon_width;
+	strip->icon_height = icon_height;
+	for (col = x = 0; col < NUM_COLS; col++) {
+		strip->col_x[col] = x;
+		if (col == COL_CHNUM)
+			width = CHNUM_WIDTH;
+		else if (col == COL_PROG)
+			width = PROG_WIDTH;
+		else if (col == COL_POLY)
+			width = POLY_WIDTH;
+		else if (col == COL_TEMPER)
+			width = icon_width;
+		else if (col == COL_PIANO)
+			width = show_piano ? PIANO_DEFAULT_SIZEX : 0;
+		else
+			width = bar_info[col - COL_VEL].width;
+		x += width + SPACING;
+	}
+	strip->col_x[NUM_COLS] = x;
+	for (i = 0; i < STRIP_CHANNELS; i++) {
+		row = &strip->rows[i];
+		for (col = 0; col < STRIP_VALUES; col++) {
+			row->val[col] = bar_info[col].defval;
+			row->drawn[col] = convert_drawn(col, row->val[col]);
+		}
+	}
+	gtk_widget_set_size_request(GTK_WIDGET(strip), x,
+				    ROW_HEIGHT * (STRIP_CHANNELS + 1));
+	return GTK_WIDGET(strip);
+}
+
+/*
+ * update a bar value
+ */
+void
+channel_strip_set_value(GtkWidget *w, int ch, int col, int val)
+{
+	ChannelStrip *strip = CHANNEL_STRIP(w);
+	strip_row_t *row = &strip->rows[ch];
+	int drawn;
+
+	row->val[col] = val;
+	drawn = convert_drawn(col, val);
+	if (drawn == row->drawn[col])
+		return;
+	row->drawn[col] = drawn;
+	if (col == STRIP_VEL) {
+		level_peak_fall(&row->peak, drawn, bar_info[col].width,
+				g_get_monotonic_time());
+		if (row->peak.level > drawn && !strip->tick)
+			strip->tick = gtk_widget_add_tick_callback(w, peak_tick,
+								   NULL, NULL);
+	}
+	queue_row(strip, ch);
+}
+
+/*
+ * set the color of velocity bar
+ */
+void
+channel_strip_set_drum(GtkWidget *w, int ch, int is_drum)
+{
+	ChannelStrip *strip = CHANNEL_STRIP(w);
+
+	if (strip->rows[ch].is_drum == !!is_drum)
+		return;
+	strip->rows[ch].is_drum = !!is_drum;
+	queue_row(strip, ch);
+}
+
+void
+channel_strip_set_program(GtkWidget *w, int ch, const char *name)
+{
+	ChannelStrip *strip = CHANNEL_STRIP(w);
+	strip_row_t *row = &strip->rows[ch];
+
+	if (!strncmp(row->progname, name, PROG_NAME_LEN))
+		return;
+	strncpy(row->progname, name, PROG_NAME_LEN);
+	row->progname[PROG_NAME_LEN] = 0;
+	queue_row(strip, ch);
+}
+
+void
+channel_strip_set_poly(GtkWidget *w, int ch, int poly)
+{
+	ChannelStrip *strip = CHANNEL_STRIP(w);
+
+	if (strip->rows[ch].poly == poly)
+		return;
+	strip->rows[ch].poly = poly;
+	queue_row(strip, ch);
+}
+
+void
+channel_strip_set_icon(GtkWidget *w, int ch, cairo_surface_t *icon)
+{
+	ChannelStrip *strip = CHANNEL_STRIP(w);
+
+	if (strip->rows[ch].icon == icon)
+		return;
+	strip->rows[ch].icon = icon;
+	queue_row(strip, ch);
+}
+
+void
+channel_strip_set_key(GtkWidget *w, int ch, int key, int on)
+{
+	ChannelStrip *strip = CHANNEL_STRIP(w);
+	unsigned int *keys = &strip->rows[ch].keys[key / 32];
+	unsigned int bit = 1U << (key % 32);
+
+	if (!(*keys & bit) == !on)
+		return;
+	*keys ^= bit;
+	if (strip->show_piano)
+		queue_row(strip, ch);
+}
+
+/*
+ * change the mute state; notified like a click on the channel number
+ */
+void
+channel_strip_set_mute(GtkWidget *w, int ch, int mute)
+{
+	ChannelStrip *strip = CHANNEL_STRIP(w);
+
+	if (strip->rows[ch].mute == !!mute)
+		return;
+	strip->rows[ch].mute = !!mute;
+	queue_row(strip, ch);
+	g_signal_emit(G_OBJECT(strip), strip_signals[MUTE_TOGGLED], 0, ch);
+}
+
+int
+channel_strip_get_mute(GtkWidget *w, int ch)
+{
+	return CHANNEL_STRIP(w)->rows[ch].mute;
+}
+
+/*
+ * invalidate only the row where the toolkit allows it
+ */
+static void
+queue_row(ChannelStrip *strip, int ch)
+{
+#ifdef USE_GTK4
+	gtk_widget_queue_draw(GTK_WIDGET(strip));
+#else
+	gtk_widget_queue_draw_area(GTK_WIDGET(strip), 0, ROW_HEIGHT * (ch + 1),
+				   strip->col_x[NUM_COLS], ROW_HEIGHT);
+#endif
+}
+
+/*
+ * let the velocity peaks fall from the elapsed time
+ */
+static gboolean
+peak_tick(GtkWidget *w, GdkFrameClock *clock, gpointer data)
+{
+	ChannelStrip *strip = CHANNEL_STRIP(w);
+	gint64 now = gdk_frame_clock_get_frame_time(clock);
+	strip_row_t *row;
+	int i, moving = FALSE;
+
+	for (i = 0; i < STRIP_CHANNELS; i++) {
+		row = &strip->rows[i];
+		if (level_peak_fall(&row->peak, row->drawn[STRIP_VEL],
+				    bar_info[STRIP_VEL].width, now))
+			queue_row(strip, i);
+		if (row->peak.level > row->drawn[STRIP_VEL])
+			moving = TRUE;
+	}
+	if (moving)
+		return G_SOURCE_CONTINUE;
+	strip->tick = 0;
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * draw all rows within the clip
+ */
+static void
+strip_draw(ChannelStrip *strip, cairo_t *cr)
+{
+	double x1, y1, x2, y2;
+	int first, last, col, ch;
+
+	if (!strip->layout)
+		strip->layout = gtk_widget_create_pango_layout(GTK_WIDGET(strip), NULL);
+	if (strip->show_piano && !strip->keyboard)
+		draw_keyboard(strip);
+	cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+	first = (int) y1 / ROW_HEIGHT;
+	last = ((int) y2 + ROW_HEIGHT - 1) / ROW_HEIGHT;
+	if (first == 0) {
+		cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+		for (col = 0; col < NUM_COLS; col++) {
+			if (!*col_titles[col] ||
+			    (col == COL_PIANO && !strip->show_piano))
+				continue;
+			pango_layout_set_text(strip->layout, col_titles[col], -1);
+			cairo_move_to(cr, strip->col_x[col], 0);
+			pango_cairo_show_layout(cr, strip->layout);
+		}
+		first = 1;
+	}
+	if (last > STRIP_CHANNELS + 1)
+		last = STRIP_CHANNELS + 1;
+	for (ch = first - 1; ch < last - 1; ch++)
+		draw_row(strip, cr, ch);
+}
+
+/*
+ * the segments of the velocity bars, in red on drum channels
+ */
+static cairo_pattern_t *
+vel_segments(ChannelStrip *strip, int is_drum)
+{
+	const struct bar_info *info = &bar_info[STRIP_VEL];
+	GdkRGBA color = { info->r, info->g, info->b, 1.0 };
+
+	if (strip->segments[is_drum])
+		return strip->segments[is_drum];
+	if (is_drum) {
+		color.red = 1.0;
+		color.green = color.blue = 0x4000 / 65535.0;
+	}
+	strip->segments[is_drum] = level_segments_new(&color);
+	return strip->segments[is_drum];
+}
+
+/*
+ * draw a bar of the given column
+ */
+static void
+draw_bar(ChannelStrip *strip, cairo_t *cr, strip_row_t *row, int col,
+	 int x, int y)
+{
+	const struct bar_info *info = &bar_info[col];
+	int width = info->width, height = BAR_HEIGHT, drawn = row->drawn[col];
+
+	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+	cairo_rectangle(cr, x, y, width, height);
+	cairo_fill(cr);
+
+	if (col == STRIP_VEL) {
+		level_segments_fill(cr, vel_segments(strip, row->is_drum),
+				    x, y, drawn, height);
+		cairo_set_source_rgb(cr, 1.0, 1.0, 0x4000 / 65535.0);
+		cairo_rectangle(cr, x + row->peak.drawn, y, LEVEL_STEP - 1, height);
+		cairo_fill(cr);
+		return;
+	}
+	cairo_set_source_rgb(cr, info->r, info->g, info->b);
+	if (info->arrow) {
+		cairo_move_to(cr, x + drawn + 1, y + height / 2);
+		cairo_line_to(cr, x + width - drawn - 1, y);
+		cairo_line_to(cr, x + width - drawn - 1, y + height - 1);
+		cairo_close_path(cr);
+		cairo_fill(cr);
+	} else {
+		cairo_rectangle(cr, x, y, drawn + 1, height);
+		cairo_fill(cr);
+	}
+}
+
+/*
+ * left edge of a white key, or the center of a black key
+ */
+static inline int
+key_xpos(int key)
+{
+	return (key / 12 * 7 + white_index[key % 12]) * PIANO_KEY_XWID;
+}
+
+/*
+ * draw a channel row
+ */
+static void
+draw_row(ChannelStrip *strip, cairo_t *cr, int ch)
+{
+	strip_row_t *row = &strip->rows[ch];
+	int y = ROW_HEIGHT * (ch + 1), by = y + (ROW_HEIGHT - BAR_HEIGHT) / 2;
+	int col, x, n, key;
+	unsigned int bits;
+	char tmp[4];
+
+	/* channel number, drawn as a button */
+	x = strip->col_x[COL_CHNUM];
+	if (row->mute)
+		cairo_set_source_rgb(cr, 0.4, 0.4, 0.4);
+	else
+		cairo_set_source_rgb(cr, 0.85, 0.85, 0.85);
+	cairo_rectangle(cr, x, y + 1, CHNUM_WIDTH, ROW_HEIGHT - 2);
+	cairo_fill(cr);
+	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+	sprintf(tmp, "%d", ch);
+	pango_layout_set_text(strip->layout, tmp, -1);
+	cairo_move_to(cr, x + 4, y + 1);
+	pango_cairo_show_layout(cr, strip->layout);
+
+	/* program */
+	pango_layout_set_text(strip->layout, row->progname, -1);
+	cairo_move_to(cr, strip->col_x[COL_PROG], y + 1);
+	pango_cairo_show_layout(cr, strip->layout);
+
+	for (col = 0; col < STRIP_VALUES; col++)
+		draw_bar(strip, cr, row, col, strip->col_x[COL_VEL + col], by);
+
+	/* polyphony */
+	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+	sprintf(tmp, "%d", row->poly);
+	pango_layout_set_text(strip->layout, tmp, -1);
+	cairo_move_to(cr, strip->col_x[COL_POLY], y + 1);
+	pango_cairo_show_layout(cr, strip->layout);
+
+	if (row->icon) {
+		cairo_set_source_surface(cr, row->icon, strip->col_x[COL_TEMPER],
+				y + (ROW_HEIGHT - strip->icon_height) / 2);
+		cairo_paint(cr);
+	}
+
+	if (!strip->show_piano)
+		return;
+	x = strip->col_x[COL_PIANO];
+	cairo_set_source_surface(cr, strip->keyboard, x, y);
+	cairo_paint(cr);
+	cairo_set_source_rgb(cr, 1.0, 0.0, 0.0);
+	for (n = 0; n < NUM_KEYS / 32; n++) {
+		bits = row->keys[n];
+		while (bits) {
+			key = n * 32 + __builtin_ctz(bits);
+			bits &= bits - 1;
+			if (black_key[key % 12])
+				cairo_rectangle(cr, x + key_xpos(key) - PIANO_KEY_XWID / 3,
+						y + 4, PIANO_KEY_XWID * 2 / 3, 6);
+			else
+				cairo_rectangle(cr, x + key_xpos(key) + 1,
+						y + ROW_HEIGHT - 8, PIANO_KEY_XWID - 2, 6);
+		}
+	}
+	cairo_fill(cr);
+}
+
+/*
+ * render the empty keyboard once
+ */
+static void
+draw_keyboard(ChannelStrip *strip)
+{
+	cairo_t *cr;
+	int i, x;
+
+	strip->keyboard = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+			PIANO_DEFAULT_SIZEX, ROW_HEIGHT);
+	cr = cairo_create(strip->keyboard);
+	cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+	cairo_paint(cr);
+	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
+	cairo_set_line_width(cr, 1.0);
+	for (x = 0; x < PIANO_DEFAULT_SIZEX; x += PIANO_KEY_XWID) {
+		cairo_move_to(cr, x + 0.5, 0);
+		cairo_line_to(cr, x + 0.5, ROW_HEIGHT);
+	}
+	cairo_stroke(cr);
+	for (i = 0; i < NUM_KEYS; i++) {
+		if (!black_key[i % 12])
+			continue;
+		x = key_xpos(i);
+		cairo_rectangle(cr, x - PIANO_KEY_XWID / 3, 0,
+				PIANO_KEY_XWID * 2 / 3, ROW_HEIGHT * 3 / 5);
+	}
+	cairo_fill(cr);
+	cairo_destroy(cr);
+}
+
+/*
+ * toggle the mute of the channel number under the pointer
+ */
+static void
+toggle_mute(ChannelStrip *strip, double x, double y)
+{
+	int ch = (int) y / ROW_HEIGHT - 1;
+
+	if (ch < 0 || ch >= STRIP_CHANNELS ||
+	    x < strip->col_x[COL_CHNUM] || x >= strip->col_x[COL_CHNUM] + CHNUM_WIDTH)
+		return;
+	channel_strip_set_mute(GTK_WIDGET(strip), ch, !strip->rows[ch].mute);
+}
+
+#ifdef USE_GTK4
+static void
+strip_draw_func(GtkDrawingArea *da, cairo_t *cr, int width, int height,
+		gpointer data)
+{
+	strip_draw(CHANNEL_STRIP(da), cr);
+}
+
+static void
+strip_pressed(GtkGestureClick *gesture, int n_press, double x, double y,
+	      gpointer data)
+{
+	toggle_mute(CHANNEL_STRIP(data), x, y);
+}
+#else
+static gboolean
+channel_strip_draw(GtkWidget *w, cairo_t *cr)
+{
+	strip_draw(CHANNEL_STRIP(w), cr);
+	return FALSE;
+}
+
+static gboolean
+channel_strip_button_press(GtkWidget *w, GdkEventButton *ev)
+{
+	if (ev->type == GDK_BUTTON_PRESS && ev->button == 1)
+		toggle_mute(CHANNEL_STRIP(w), ev->x, ev->y);
+	return TRUE;
+}
+#endif
@@ -0,0 +1,53 @@
+/*
+ * channelstrip.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef CHANNELSTRIP_H_DEF
+#define CHANNELSTRIP_H_DEF
+
+#include <gtk/gtk.h>
+
+#define CHANNEL_STRIP(obj)	G_TYPE_CHECK_INSTANCE_CAST(obj, channel_strip_get_type(), ChannelStrip)
+#define IS_CHANNEL_STRIP(obj)	G_TYPE_CHECK_INSTANCE_TYPE(obj, channel_strip_get_type())
+
+#define STRIP_CHANNELS		16
+
+/* bar columns of a strip */
+enum {
+	STRIP_VEL,
+	STRIP_MAIN,
+	STRIP_EXP,
+	STRIP_PAN,
+	STRIP_PITCH,
+	STRIP_VALUES
+};
+
+typedef struct _ChannelStrip ChannelStrip;
+typedef struct _ChannelStripClass ChannelStripClass;
+
+GType channel_strip_get_type(void);
+GtkWidget *channel_strip_new(int show_piano, int icon_width, int icon_height);
+void channel_strip_set_value(GtkWidget *w, int ch, int col, int val);
+void channel_strip_set_drum(GtkWidget *w, int ch, int is_drum);
+void channel_strip_set_program(GtkWidget *w, int ch, const char *name);
+void channel_strip_set_poly(GtkWidget *w, int ch, int poly);
+void channel_strip_set_icon(GtkWidget *w, int ch, cairo_surface_t *icon);
+void channel_strip_set_key(GtkWidget *w, int ch, int key, int on);
+void channel_strip_set_mute(GtkWidget *w, int ch, int mute);
+int channel_strip_get_mute(GtkWidget *w, int ch);
+
+#endif
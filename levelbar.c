@@ -24,88 +24,167 @@
 #include "levelbar.h"
 #include <stdlib.h>
 
-#ifdef USE_GTK4
-/* GTK4: draw function registered via gtk_drawing_area_set_draw_func */
-static void draw_bar (GtkDrawingArea * da, cairo_t * cr,
-		      int width, int height, gpointer data);
-#else
-static gboolean draw_bar (GtkWidget * w, cairo_t * cr, gpointer data);
-#endif
-
-/*
- * RGB color stored as doubles in [0.0, 1.0]
- */
-typedef struct {
-	double r, g, b;
-} BarColor;
-
 /*
  * status bar instance record
  */
-enum {
-	BAR_TYPE_LEVEL,
-	BAR_TYPE_SOLID,
-	BAR_TYPE_ARROW,
-};
-
-typedef struct status_bar_t status_bar_t;
-struct status_bar_t {
-	unsigned short type;	/* enum type */
+struct _StatusBar {
+	GtkWidget widget;
 	unsigned short width, height;	/* widget size */
 	int minval, maxval, defval, curval, cached_val;	/* values */
 	unsigned short drawn, step;
-	BarColor color;
+	GdkRGBA color;
 	char delayed, updated;
-	guint32 timer;
+	char animating;		/* in the list of the driver */
 };
 
+struct _StatusBarClass {
+	GtkWidgetClass parent_class;
+
+	/* draw the bar at the current value */
+	void (*draw_bar)(StatusBar *bar, cairo_t *cr);
+#ifdef USE_GTK4
+	void (*snapshot_bar)(StatusBar *bar, GtkSnapshot *snapshot);
+#endif
+};
 
 /*
  * level bar instance record
  */
-typedef struct level_bar_t level_bar_t;
-struct level_bar_t {
-	status_bar_t st;	/* inherited */
-	int level_count;
-	int level;
-	unsigned short lv_drawn;
-	int fall_dec;
-	BarColor lv_color;
+struct _LevelBar {
+	StatusBar st;		/* inherited */
+	level_peak_t peak;
+	GdkRGBA lv_color;
+#ifndef USE_GTK4
+	cairo_pattern_t *segments;	/* one lit segment, repeated */
+#endif
+};
+
+struct _LevelBarClass {
+	StatusBarClass parent_class;
 };
 
-/* constants for level bar */
-#define LEVEL_STEP		3	/* step */
-#define BAR_TIMER_PERIOD	20	/* msec */
-#define FALLING_COUNT		40	/* larger is longer */
-#define FALLING_SCALE		10	/* larger is slower */
+typedef struct bar_driver_t bar_driver_t;
+
+/*
+ * animation driver of a toplevel: advances all of its delayed bars
+ * on the frame clock, and only while any of them is moving
+ */
+struct bar_driver_t {
+	GtkWidget *toplevel;
+	GPtrArray *bars;	/* animating bars */
+	guint tick;
+};
 
 /*
  * protoypes
  */
-static GtkWidget *bar_widget_new(status_bar_t *bar, int type, int width, int height, int minval, int maxval, int defval, int delayed, int step);
-static gboolean update_timer(gpointer data);
-static void fall_level(GtkWidget *w, level_bar_t *lv);
-static void draw_level(cairo_t *cr, level_bar_t *arg);
-static void draw_solid(cairo_t *cr, status_bar_t *arg);
-static void draw_arrow(cairo_t *cr, status_bar_t *arg);
-static void update_bar(GtkWidget *w, status_bar_t *arg, int curval);
+static GtkWidget *bar_widget_new(GType type, int width, int height, int minval, int maxval, int defval, int delayed, int step);
+static void start_animation(StatusBar *bar);
+static gboolean animation_tick(GtkWidget *w, GdkFrameClock *clock, gpointer data);
+static int advance_bar(StatusBar *bar, gint64 now);
+static void draw_solid(StatusBar *bar, cairo_t *cr);
+static void draw_arrow(StatusBar *bar, cairo_t *cr);
+static void update_bar(StatusBar *bar, int curval);
+#ifdef USE_GTK4
+static void status_bar_snapshot(GtkWidget *w, GtkSnapshot *snapshot);
+static void snapshot_cairo(StatusBar *bar, GtkSnapshot *snapshot);
+static void snapshot_level(StatusBar *bar, GtkSnapshot *snapshot);
+static void snapshot_solid(StatusBar *bar, GtkSnapshot *snapshot);
+#else
+static void draw_level(StatusBar *bar, cairo_t *cr);
+static gboolean status_bar_draw(GtkWidget *w, cairo_t *cr);
+static void level_bar_finalize(GObject *obj);
+#endif
+
+G_DEFINE_ABSTRACT_TYPE(StatusBar, status_bar, GTK_TYPE_WIDGET)
+G_DEFINE_TYPE(LevelBar, level_bar, status_bar_get_type())
+G_DEFINE_TYPE(SolidBar, solid_bar, status_bar_get_type())
+G_DEFINE_TYPE(ArrowBar, arrow_bar, status_bar_get_type())
+
+/*
+ * class and instance initializers
+ */
+static void
+status_bar_class_init(StatusBarClass *klass)
+{
+	GtkWidgetClass *widget_class = GTK_WIDGET_CLASS(klass);
+
+#ifdef USE_GTK4
+	widget_class->snapshot = status_bar_snapshot;
+	klass->snapshot_bar = snapshot_cairo;
+#else
+	widget_class->draw = status_bar_draw;
+#endif
+}
+
+static void
+status_bar_init(StatusBar *bar)
+{
+#ifndef USE_GTK4
+	gtk_widget_set_has_window(GTK_WIDGET(bar), FALSE);
+#endif
+}
+
+static void
+level_bar_class_init(LevelBarClass *klass)
+{
+	StatusBarClass *bar_class = STATUS_BAR_CLASS(klass);
+
+#ifdef USE_GTK4
+	bar_class->snapshot_bar = snapshot_level;
+#else
+	bar_class->draw_bar = draw_level;
+	G_OBJECT_CLASS(klass)->finalize = level_bar_finalize;
+#endif
+}
+
+static void
+level_bar_init(LevelBar *lv)
+{
+}
+
+static void
+solid_bar_class_init(SolidBarClass *klass)
+{
+	klass->draw_bar = draw_solid;
+#ifdef USE_GTK4
+	klass->snapshot_bar = snapshot_solid;
+#endif
+}
+
+static void
+solid_bar_init(SolidBar *bar)
+{
+}
+
+static void
+arrow_bar_class_init(ArrowBarClass *klass)
+{
+	klass->draw_bar = draw_arrow;
+}
+
+static void
+arrow_bar_init(ArrowBar *bar)
+{
+}
 
 /*
  * store color as doubles
  */
 static void
-alloc_color(BarColor *color, int red, int green, int blue)
+alloc_color(GdkRGBA *color, int red, int green, int blue)
 {
-	color->r = red / 65535.0;
-	color->g = green / 65535.0;
-	color->b = blue / 65535.0;
+	color->red = red / 65535.0;
+	color->green = green / 65535.0;
+	color->blue = blue / 65535.0;
+	color->alpha = 1.0;
 }
 
 /*
  * align to the step size (for level bar)
  */
 static inline int
-align_step(status_bar_t *bar, int val)
+align_step(StatusBar *bar, int val)
 {
 	if (bar->step > 1)
 		return (val / bar->step) * bar->step;
@@ -116,7 +195,7 @@ align_step(status_bar_t *bar, int val)
  * convert to pixel
  */
 static inline int
-convert_drawn(status_bar_t *bar, int val)
+convert_drawn(StatusBar *bar, int val)
 {
 	val = (val - bar->minval) * (bar->width - 1);
 	val /= (bar->maxval - bar->minval);
@@ -129,15 +208,13 @@ convert_drawn(status_bar_t *bar, int val)
 GtkWidget *
 level_bar_new(int width, int height, int minval, int maxval, int defval)
 {
-	level_bar_t *lv;
+	LevelBar *lv;
 	GtkWidget *w;
 
-	lv = g_malloc0(sizeof(*lv));
-	w = bar_widget_new(&lv->st, BAR_TYPE_LEVEL, width, height,
+	w = bar_widget_new(level_bar_get_type(), width, height,
 			   minval, maxval, defval, TRUE, LEVEL_STEP);
-	lv->level_count = 0;
-	lv->fall_dec = (width + FALLING_SCALE - 1) / FALLING_SCALE;
-	lv->level = lv->lv_drawn = lv->st.drawn;
+	lv = LEVEL_BAR(w);
+	level_peak_init(&lv->peak, lv->st.drawn);
 	alloc_color(&lv->lv_color, 0xffff, 0xffff, 0xffff);
 
 	return w;
@@ -149,7 +226,7 @@ level_bar_new(int width, int height, int minval, int maxval, int defval)
 GtkWidget *
 solid_bar_new(int width, int height, int minval, int maxval, int defval, int delayed)
 {
-	return bar_widget_new(NULL, BAR_TYPE_SOLID, width, height,
+	return bar_widget_new(solid_bar_get_type(), width, height,
 			      minval, maxval, defval, delayed, 1);
 }
 
@@ -159,7 +236,7 @@ solid_bar_new(int width, int height, int minval, int maxval, int defval, int del
 GtkWidget *
 arrow_bar_new(int width, int height, int minval, int maxval, int defval, int delayed)
 {
-	return bar_widget_new(NULL, BAR_TYPE_ARROW, width, height,
+	return bar_widget_new(arrow_bar_get_type(), width, height,
 			      minval, maxval, defval, delayed, 1);
 }
 
@@ -169,9 +246,9 @@ arrow_bar_new(int width, int height, int minval, int maxval, int defval, int del
 void
 channel_status_bar_update(GtkWidget *w, int val)
 {
-	status_bar_t *bar = g_object_get_data(G_OBJECT(w), "bar_data");
+	StatusBar *bar = STATUS_BAR(w);
 	if (bar->curval != val)
-		update_bar(w, bar, val);
+		update_bar(bar, val);
 }
 
 /*
@@ -180,8 +257,16 @@ channel_status_bar_update(GtkWidget *w, int val)
 void
 channel_status_bar_set_color_rgb(GtkWidget *w, int r, int g, int b)
 {
-	status_bar_t *bar = g_object_get_data(G_OBJECT(w), "bar_data");
+	StatusBar *bar = STATUS_BAR(w);
+
 	alloc_color(&bar->color, r, g, b);
+#ifndef USE_GTK4
+	if (IS_LEVEL_BAR(w) && LEVEL_BAR(w)->segments) {
+		cairo_pattern_destroy(LEVEL_BAR(w)->segments);
+		LEVEL_BAR(w)->segments = NULL;
+	}
+#endif
+	gtk_widget_queue_draw(w);
 }
 
 /*
@@ -190,22 +275,20 @@ channel_status_bar_set_color_rgb(GtkWidget *w, int r, int g, int b)
 void
 level_bar_set_level_color_rgb(GtkWidget *w, int r, int g, int b)
 {
-	level_bar_t *bar = g_object_get_data(G_OBJECT(w), "bar_data");
-	alloc_color(&bar->lv_color, r, g, b);
+	alloc_color(&LEVEL_BAR(w)->lv_color, r, g, b);
+	gtk_widget_queue_draw(w);
 }
 
 /*
  * skeleton to create widget and to initialize instance
  */
 static GtkWidget *
-bar_widget_new(status_bar_t *bar, int type, int width, int height,
+bar_widget_new(GType type, int width, int height,
 	       int minval, int maxval, int defval, int delayed, int step)
 {
-	GtkWidget *w;
+	StatusBar *bar;
 
-	if (bar == NULL)
-		bar = g_malloc0(sizeof(*bar));
-	bar->type = type;
+	bar = g_object_new(type, NULL);
 	bar->width = width;
 	bar->height = height;
 	bar->minval = minval;
@@ -219,115 +302,269 @@ bar_widget_new(status_bar_t *bar, int type, int width, int height,
 
 	alloc_color(&bar->color, 0xffff, 0xffff, 0xffff);
 
-	w = gtk_drawing_area_new();
-	gtk_widget_set_size_request(w, width, height);
-	g_object_set_data(G_OBJECT(w), "bar_data", bar);
+	gtk_widget_set_size_request(GTK_WIDGET(bar), width, height);
+	return GTK_WIDGET(bar);
+}
+
+/*
+ * free the driver with its toplevel
+ */
+static void
+free_driver(gpointer data)
+{
+	bar_driver_t *driver = data;
+
+	g_ptr_array_free(driver->bars, TRUE);
+	g_free(driver);
+}
+
+/*
+ * the driver of the toplevel of the bar, created on demand
+ */
+static bar_driver_t *
+get_driver(GtkWidget *w)
+{
+	GtkWidget *top;
+	bar_driver_t *driver;
+
 #ifdef USE_GTK4
-	gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(w), draw_bar, NULL, NULL);
+	top = GTK_WIDGET(gtk_widget_get_root(w));
 #else
-	gtk_widget_set_events(w, GDK_EXPOSURE_MASK);
-	g_signal_connect(G_OBJECT(w), "draw", G_CALLBACK(draw_bar), NULL);
+	top = gtk_widget_get_toplevel(w);
+	if (!gtk_widget_is_toplevel(top))
+		top = NULL;
 #endif
-	if (delayed)
-		bar->timer = g_timeout_add(BAR_TIMER_PERIOD, update_timer, w);
+	if (!top)
+		return NULL;
+	driver = g_object_get_data(G_OBJECT(top), "bar_driver");
+	if (!driver) {
+		driver = g_malloc0(sizeof(*driver));
+		driver->toplevel = top;
+		driver->bars = g_ptr_array_new();
+		g_object_set_data_full(G_OBJECT(top), "bar_driver", driver,
+				       free_driver);
+	}
+	return driver;
+}
 
-	return w;
+/*
+ * add the bar to the driver of its toplevel
+ */
+static void
+start_animation(StatusBar *bar)
+{
+	bar_driver_t *driver;
+
+	if (bar->animating)
+		return;
+	driver = get_driver(GTK_WIDGET(bar));
+	if (!driver) {
+		/* not in a window yet; nothing to animate */
+		bar->updated = FALSE;
+		bar->drawn = convert_drawn(bar, bar->curval);
+		gtk_widget_queue_draw(GTK_WIDGET(bar));
+		return;
+	}
+	g_ptr_array_add(driver->bars, bar);
+	bar->animating = TRUE;
+	if (!driver->tick)
+		driver->tick = gtk_widget_add_tick_callback(driver->toplevel,
+						animation_tick, driver, NULL);
 }
 
 /*
- * timer callback
+ * frame clock callback of the driver:
+ * advance all moving bars, and drop the ones at rest
  */
 static gboolean
-update_timer(gpointer data)
+animation_tick(GtkWidget *w, GdkFrameClock *clock, gpointer data)
 {
-	GtkWidget *w = GTK_WIDGET(data);
-	status_bar_t *bar = g_object_get_data(G_OBJECT(w), "bar_data");
-	int drawn;
+	bar_driver_t *driver = data;
+	gint64 now = gdk_frame_clock_get_frame_time(clock);
+	StatusBar *bar;
+	guint i;
+
+	for (i = 0; i < driver->bars->len; ) {
+		bar = g_ptr_array_index(driver->bars, i);
+		if (advance_bar(bar, now)) {
+			i++;
+			continue;
+		}
+		bar->animating = FALSE;
+		g_ptr_array_remove_index_fast(driver->bars, i);
+	}
+	if (driver->bars->len)
+		return G_SOURCE_CONTINUE;
+	driver->tick = 0;
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * show the highest value since the last frame, then the current one;
+ * returns TRUE while the bar is still moving
+ */
+static int
+advance_bar(StatusBar *bar, gint64 now)
+{
+	int drawn, redraw = FALSE;
 
 	if (bar->updated) {
+		bar->updated = FALSE;
 		drawn = convert_drawn(bar, bar->cached_val);
-		if (drawn == bar->drawn)
-			bar->updated = FALSE;
-		else
+		if (drawn != bar->drawn) {
 			bar->drawn = drawn;
+			redraw = TRUE;
+		}
+		if (bar->cached_val != bar->curval) {
+			bar->cached_val = bar->curval;
+			bar->updated = TRUE;
+		}
 	}
-	if (bar->type == BAR_TYPE_LEVEL)
-		fall_level(w, (level_bar_t*)bar);
+	if (IS_LEVEL_BAR(bar) &&
+	    level_peak_fall(&LEVEL_BAR(bar)->peak, bar->drawn, bar->width, now))
+		redraw = TRUE;
+	if (redraw)
+		gtk_widget_queue_draw(GTK_WIDGET(bar));
 	if (bar->updated)
-		gtk_widget_queue_draw(w);
-	if (bar->cached_val != bar->curval) {
-		bar->cached_val = bar->curval;
-		bar->updated = TRUE;
-	} else
-		bar->updated = FALSE;
+		return TRUE;
+	return IS_LEVEL_BAR(bar) && LEVEL_BAR(bar)->peak.level != bar->drawn;
+}
+
+/*
+ * start the peak at the given level
+ */
+void
+level_peak_init(level_peak_t *peak, int drawn)
+{
+	peak->level = peak->drawn = peak->fall_from = drawn;
+	peak->fall_start = 0;
+}
+
+/*
+ * update the peak over a bar of the given width and drawn level
+ * from the elapsed time, so that the speed doesn't depend on the
+ * frame rate; returns TRUE if the peak is to be drawn again
+ */
+int
+level_peak_fall(level_peak_t *peak, int drawn, int width, gint64 now)
+{
+	int level;
+
+	if (peak->level < drawn) {
+		/* new peak: hold it for a while */
+		peak->level = peak->drawn = peak->fall_from = drawn;
+		peak->fall_start = now + FALLING_HOLD * 1000;
+		return TRUE;
+	}
+	if (peak->level == drawn || now <= peak->fall_start)
+		return FALSE;
+	level = peak->fall_from - (int)((now - peak->fall_start) * width /
+					(FALLING_TIME * 1000));
+	if (level <= drawn) {
+		/* landed on the bar: hold again before the next fall */
+		level = peak->fall_from = drawn;
+		peak->fall_start = now + FALLING_HOLD * 1000;
+	}
+	peak->level = level;
+	level = (level / LEVEL_STEP) * LEVEL_STEP;
+	if (level == peak->drawn)
+		return FALSE;
+	peak->drawn = level;
 	return TRUE;
 }
 
 /*
- * update level bar
+ * the pattern of the lit segments: one segment and a gap,
+ * repeated over the whole bar, so that the bar is drawn by
+ * a single fill
  */
+cairo_pattern_t *
+level_segments_new(const GdkRGBA *color)
+{
+	cairo_surface_t *surface;
+	cairo_pattern_t *segments;
+	cairo_t *cr;
+
+	surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, LEVEL_STEP, 1);
+	cr = cairo_create(surface);
+	gdk_cairo_set_source_rgba(cr, color);
+	cairo_rectangle(cr, 0, 0, LEVEL_STEP - 1, 1);
+	cairo_fill(cr);
+	cairo_destroy(cr);
+	segments = cairo_pattern_create_for_surface(surface);
+	cairo_pattern_set_extend(segments, CAIRO_EXTEND_REPEAT);
+	cairo_surface_destroy(surface);
+	return segments;
+}
+
+/*
+ * fill the lit segments of a bar at the given position
+ */
+void
+level_segments_fill(cairo_t *cr, cairo_pattern_t *segments,
+		    int x, int y, int width, int height)
+{
+	cairo_matrix_t matrix;
+
+	cairo_matrix_init_translate(&matrix, -x, 0);
+	cairo_pattern_set_matrix(segments, &matrix);
+	cairo_set_source(cr, segments);
+	cairo_rectangle(cr, x, y, width, height);
+	cairo_fill(cr);
+}
+
+#ifndef USE_GTK4
+static cairo_pattern_t *
+level_segments(LevelBar *lv)
+{
+	if (!lv->segments)
+		lv->segments = level_segments_new(&lv->st.color);
+	return lv->segments;
+}
+
 static void
-fall_level(GtkWidget *w, level_bar_t *lv)
+level_bar_finalize(GObject *obj)
 {
-	int drawn;
+	LevelBar *lv = LEVEL_BAR(obj);
 
-	if (lv->level < lv->st.drawn) {
-		lv->level = lv->lv_drawn = lv->st.drawn;
-		lv->level_count = FALLING_COUNT;
-		lv->st.updated = TRUE;
-	} else if (lv->level_count > 0) {
-		lv->level_count--;
-	} else if (lv->level > 0) {
-		lv->level -= lv->fall_dec;
-		if (lv->level < 0)
-			lv->level = 0;
-		if (lv->level < lv->st.drawn) {
-			lv->level = lv->st.drawn;
-			lv->level_count = FALLING_COUNT;
-		}
-		drawn = align_step(&lv->st, lv->level);
-		if (drawn != lv->lv_drawn) {
-			lv->lv_drawn = drawn;
-			lv->st.updated = TRUE;
-		}
-	}
+	if (lv->segments)
+		cairo_pattern_destroy(lv->segments);
+	G_OBJECT_CLASS(level_bar_parent_class)->finalize(obj);
 }
 
 /*
- * draw level bar
+ * draw level bar; GTK4 takes snapshot_level instead
  */
 static void
-draw_level(cairo_t *cr, level_bar_t *arg)
+draw_level(StatusBar *bar, cairo_t *cr)
 {
-	int i;
+	LevelBar *lv = LEVEL_BAR(bar);
 
 	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
-	cairo_rectangle(cr, 0, 0, arg->st.width, arg->st.height);
+	cairo_rectangle(cr, 0, 0, bar->width, bar->height);
 	cairo_fill(cr);
 
-	cairo_set_source_rgb(cr, arg->st.color.r, arg->st.color.g, arg->st.color.b);
-	for (i = 0; i < arg->st.drawn; i += LEVEL_STEP) {
-		cairo_rectangle(cr, i, 0, LEVEL_STEP - 1, arg->st.height);
-		cairo_fill(cr);
-	}
+	level_segments_fill(cr, level_segments(lv), 0, 0,
+			    bar->drawn, bar->height);
 
-	cairo_set_source_rgb(cr, arg->lv_color.r, arg->lv_color.g, arg->lv_color.b);
-	cairo_rectangle(cr, arg->lv_drawn, 0, LEVEL_STEP - 1, arg->st.height);
+	gdk_cairo_set_source_rgba(cr, &lv->lv_color);
+	cairo_rectangle(cr, lv->peak.drawn, 0, LEVEL_STEP - 1, bar->height);
 	cairo_fill(cr);
 }
+#endif
 
 /*
  * draw solid bar
  */
 static void
-draw_solid(cairo_t *cr, status_bar_t *arg)
+draw_solid(StatusBar *bar, cairo_t *cr)
 {
 	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
-	cairo_rectangle(cr, 0, 0, arg->width, arg->height);
+	cairo_rectangle(cr, 0, 0, bar->width, bar->height);
 	cairo_fill(cr);
 
-	cairo_set_source_rgb(cr, arg->color.r, arg->color.g, arg->color.b);
-	cairo_rectangle(cr, 0, 0, arg->drawn + 1, arg->height);
+	gdk_cairo_set_source_rgba(cr, &bar->color);
+	cairo_rectangle(cr, 0, 0, bar->drawn + 1, bar->height);
 	cairo_fill(cr);
 }
 
@@ -335,22 +572,21 @@ draw_solid(cairo_t *cr, status_bar_t *arg)
  * draw arrow bar
  */
 static void
-draw_arrow(cairo_t *cr, status_bar_t *arg)
+draw_arrow(StatusBar *bar, cairo_t *cr)
 {
 	cairo_set_source_rgb(cr, 0.0, 0.0, 0.0);
-	cairo_rectangle(cr, 0, 0, arg->width, arg->height);
+	cairo_rectangle(cr, 0, 0, bar->width, bar->height);
 	cairo_fill(cr);
 
-	cairo_set_source_rgb(cr, arg->color.r, arg->color.g, arg->color.b);
-	cairo_move_to(cr, arg->drawn + 1, arg->height / 2);
-	cairo_line_to(cr, arg->width - arg->drawn - 1, 0);
-	cairo_line_to(cr, arg->width - arg->drawn - 1, arg->height - 1);
+	gdk_cairo_set_source_rgba(cr, &bar->color);
+	cairo_move_to(cr, bar->drawn + 1, bar->height / 2);
+	cairo_line_to(cr, bar->width - bar->drawn - 1, 0);
+	cairo_line_to(cr, bar->width - bar->drawn - 1, bar->height - 1);
 	cairo_close_path(cr);
 	cairo_fill(cr);
 
-	cairo_set_source_rgb(cr, arg->color.r, arg->color.g, arg->color.b);
-	cairo_move_to(cr, arg->width - arg->drawn - 1, 0);
-	cairo_line_to(cr, arg->width - arg->drawn - 1, arg->height - 1);
+	cairo_move_to(cr, bar->width - bar->drawn - 1, 0);
+	cairo_line_to(cr, bar->width - bar->drawn - 1, bar->height - 1);
 	cairo_stroke(cr);
 }
 
@@ -358,9 +594,9 @@ draw_arrow(cairo_t *cr, status_bar_t *arg)
  * calculate the absolute distance
  */
 static inline int
-val_diff(status_bar_t *arg, int val)
+val_diff(StatusBar *bar, int val)
 {
-	val -= arg->defval;
+	val -= bar->defval;
 	return abs(val);
 }
 
@@ -368,63 +604,92 @@ val_diff(status_bar_t *arg, int val)
  * update current value
  */
 static void
-update_bar(GtkWidget *w, status_bar_t *arg, int curval)
+update_bar(StatusBar *bar, int curval)
 {
 	int drawn;
 
-	arg->curval = curval;
-	if (arg->delayed) {
-		/* redrawn in timeout callback -
+	bar->curval = curval;
+	if (bar->delayed) {
+		/* redrawn in the next frame -
 		 * we here only check the highest value
 		 */
-		int delta = val_diff(arg, curval);
-		int delta_c = val_diff(arg, arg->cached_val);
-		if (delta < delta_c)
-			return;
-		arg->cached_val = curval; /* remember the highest value */
-		arg->updated = TRUE;
+		int delta = val_diff(bar, curval);
+		int delta_c = val_diff(bar, bar->cached_val);
+		if (delta >= delta_c)
+			bar->cached_val = curval; /* remember the highest value */
+		bar->updated = TRUE;
+		start_animation(bar);
 	} else {
 		/* redraw now if necessary */
-		drawn = convert_drawn(arg, curval);
-		if (drawn == arg->drawn)
+		drawn = convert_drawn(bar, curval);
+		if (drawn == bar->drawn)
 			return;
-		arg->drawn = drawn;
-		gtk_widget_queue_draw(w);
+		bar->drawn = drawn;
+		gtk_widget_queue_draw(GTK_WIDGET(bar));
 	}
 }
 
+#ifdef USE_GTK4
 /*
- * draw callback — implementation shared between GTK3 and GTK4
+ * GTK4 renders the simple bars from color nodes, and the segments
+ * of the level bar from a single repeat node
  */
 static void
-draw_bar_impl(GObject *obj, cairo_t *cr)
-{
-	status_bar_t *arg = g_object_get_data(obj, "bar_data");
-
-	switch (arg->type) {
-	case BAR_TYPE_LEVEL:
-		draw_level(cr, (level_bar_t*)arg);
-		break;
-	case BAR_TYPE_SOLID:
-		draw_solid(cr, arg);
-		break;
-	case BAR_TYPE_ARROW:
-		draw_arrow(cr, arg);
-		break;
+status_bar_snapshot(GtkWidget *w, GtkSnapshot *snapshot)
+{
+	StatusBar *bar = STATUS_BAR(w);
+
+	STATUS_BAR_GET_CLASS(bar)->snapshot_bar(bar, snapshot);
+}
+
+static void
+snapshot_cairo(StatusBar *bar, GtkSnapshot *snapshot)
+{
+	graphene_rect_t rect = GRAPHENE_RECT_INIT(0, 0, bar->width, bar->height);
+	cairo_t *cr;
+
+	cr = gtk_snapshot_append_cairo(snapshot, &rect);
+	STATUS_BAR_GET_CLASS(bar)->draw_bar(bar, cr);
+	cairo_destroy(cr);
+}
+
+static const GdkRGBA bar_black = { 0.0, 0.0, 0.0, 1.0 };
+
+static void
+snapshot_level(StatusBar *bar, GtkSnapshot *snapshot)
+{
+	LevelBar *lv = LEVEL_BAR(bar);
+
+	gtk_snapshot_append_color(snapshot, &bar_black,
+			&GRAPHENE_RECT_INIT(0, 0, bar->width, bar->height));
+	if (bar->drawn > 0) {
+		gtk_snapshot_push_repeat(snapshot,
+				&GRAPHENE_RECT_INIT(0, 0, bar->drawn, bar->height),
+				&GRAPHENE_RECT_INIT(0, 0, LEVEL_STEP, bar->height));
+		gtk_snapshot_append_color(snapshot, &bar->color,
+				&GRAPHENE_RECT_INIT(0, 0, LEVEL_STEP - 1, bar->height));
+		gtk_snapshot_pop(snapshot);
 	}
+	gtk_snapshot_append_color(snapshot, &lv->lv_color,
+			&GRAPHENE_RECT_INIT(lv->peak.drawn, 0, LEVEL_STEP - 1,
+					    bar->height));
 }
 
-#ifdef USE_GTK4
 static void
-draw_bar(GtkDrawingArea *da, cairo_t *cr, int width, int height, gpointer data)
+snapshot_solid(StatusBar *bar, GtkSnapshot *snapshot)
 {
-	draw_bar_impl(G_OBJECT(da), cr);
+	gtk_snapshot_append_color(snapshot, &bar_black,
+			&GRAPHENE_RECT_INIT(0, 0, bar->width, bar->height));
+	gtk_snapshot_append_color(snapshot, &bar->color,
+			&GRAPHENE_RECT_INIT(0, 0, bar->drawn + 1, bar->height));
 }
 #else
 static gboolean
-draw_bar(GtkWidget *w, cairo_t *cr, gpointer data)
+status_bar_draw(GtkWidget *w, cairo_t *cr)
 {
-	draw_bar_impl(G_OBJECT(w), cr);
+	StatusBar *bar = STATUS_BAR(w);
+
+	STATUS_BAR_GET_CLASS(bar)->draw_bar(bar, cr);
 	return FALSE;
 }
 #endif
@@ -23,6 +23,42 @@
 
 #include <gtk/gtk.h>
 
+#define STATUS_BAR(obj)		G_TYPE_CHECK_INSTANCE_CAST(obj, status_bar_get_type(), StatusBar)
+#define STATUS_BAR_CLASS(klass)	G_TYPE_CHECK_CLASS_CAST(klass, status_bar_get_type(), StatusBarClass)
+#define STATUS_BAR_GET_CLASS(obj)	G_TYPE_INSTANCE_GET_CLASS(obj, status_bar_get_type(), StatusBarClass)
+#define IS_STATUS_BAR(obj)	G_TYPE_CHECK_INSTANCE_TYPE(obj, status_bar_get_type())
+#define LEVEL_BAR(obj)		G_TYPE_CHECK_INSTANCE_CAST(obj, level_bar_get_type(), LevelBar)
+#define IS_LEVEL_BAR(obj)	G_TYPE_CHECK_INSTANCE_TYPE(obj, level_bar_get_type())
+
+typedef struct _StatusBar StatusBar;
+typedef struct _StatusBarClass StatusBarClass;
+typedef struct _LevelBar LevelBar;
+typedef struct _LevelBarClass LevelBarClass;
+typedef struct _StatusBar SolidBar;
+typedef struct _StatusBarClass SolidBarClass;
+typedef struct _StatusBar ArrowBar;
+typedef struct _StatusBarClass ArrowBarClass;
+
+/* level bar metrics, shared by the velocity bars of the channel strip */
+#define LEVEL_STEP		3	/* step */
+#define FALLING_HOLD		800	/* msec to hold the peak */
+#define FALLING_TIME		200	/* msec to fall the whole bar */
+
+/*
+ * falling peak of a level bar
+ */
+typedef struct {
+	int level;		/* current level, in pixels */
+	int drawn;		/* level aligned to the segments */
+	int fall_from;		/* level when falling starts */
+	gint64 fall_start;	/* frame time when falling starts */
+} level_peak_t;
+
+GType status_bar_get_type(void);
+GType level_bar_get_type(void);
+GType solid_bar_get_type(void);
+GType arrow_bar_get_type(void);
+
 GtkWidget *level_bar_new(int width, int height, int minval, int maxval, int curval);
 GtkWidget *solid_bar_new(int width, int height, int minval, int maxval, int curval, int delayed);
 GtkWidget *arrow_bar_new(int width, int height, int minval, int maxval, int curval, int delayed);
@@ -30,4 +66,10 @@ void channel_status_bar_update(GtkWidget *w, int val);
 void channel_status_bar_set_color_rgb(GtkWidget *w, int r, int g, int b);
 void level_bar_set_level_color_rgb(GtkWidget *w, int r, int g, int b);
 
+void level_peak_init(level_peak_t *peak, int drawn);
+int level_peak_fall(level_peak_t *peak, int drawn, int width, gint64 now);
+cairo_pattern_t *level_segments_new(const GdkRGBA *color);
+void level_segments_fill(cairo_t *cr, cairo_pattern_t *segments,
+			 int x, int y, int width, int height);
+
 #endif
@@ -33,7 +33,6 @@
 
 static void piano_class_init (PianoClass * klass);
 static void piano_init (Piano * piano);
-static void piano_destroy (GObject * object);
 #ifdef USE_GTK4
 static void piano_snapshot (GtkWidget * widget, GtkSnapshot * snapshot);
 static void piano_measure (GtkWidget * widget, GtkOrientation orientation,
@@ -46,8 +45,10 @@ static void piano_get_preferred_height (GtkWidget * widget, gint * min, gint * n
 static void piano_size_allocate (GtkWidget * widget, GtkAllocation * allocation);
 static gboolean piano_draw (GtkWidget * widget, cairo_t * cr);
 #endif
-static void draw_keyboard_surface (Piano * piano);
-static void draw_key_on_surface (Piano * piano, int note, gboolean pressed);
+static cairo_surface_t *get_keyboard_surface (void);
+static void draw_key (cairo_t * cr, int note, gboolean pressed);
+static void draw_pressed_keys (Piano * piano, cairo_t * cr);
+static void piano_mark_key (Piano * piano, guint8 keynum);
 
 #define POFSY 0
 
@@ -86,11 +87,8 @@ G_DEFINE_TYPE(Piano, piano, GTK_TYPE_WIDGET)
 static void
 piano_class_init (PianoClass * klass)
 {
-  GObjectClass *object_class = G_OBJECT_CLASS (klass);
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
 
-  object_class->finalize = piano_destroy;
-
 #ifdef USE_GTK4
   widget_class->snapshot = piano_snapshot;
   widget_class->measure = piano_measure;
@@ -131,84 +129,61 @@ piano_init (Piano * piano)
 }
 
 GtkWidget *
-piano_new (gboolean * selkeys)
+piano_new (void)
 {
-  Piano *piano;
-
-  piano = g_object_new (piano_get_type (), NULL);
-
-  if (selkeys == NULL)
-    selkeys = g_malloc0 (sizeof (gboolean) * 128);
-  piano->selkeys = selkeys;
-
-  return GTK_WIDGET (piano);
+  return GTK_WIDGET (g_object_new (piano_get_type (), NULL));
 }
 
-/* draws specified key in its "on" state */
+#define PIANO_KEY_IS_SET(piano, key) \
+  ((piano)->selkeys[(key) / 32] & (1U << ((key) % 32)))
+
+/* marks specified key to be drawn in its "on" state */
 void
 piano_note_on (Piano * piano, guint8 keynum)
 {
-  gint xval, mod;
-
   g_return_if_fail (piano != NULL);
   g_return_if_fail (IS_PIANO (piano));
   g_return_if_fail (keynum < 128);
 
-  if (piano->selkeys[keynum])
+  if (PIANO_KEY_IS_SET (piano, keynum))
     return;			/* already selected */
 
   g_signal_emit (G_OBJECT (piano), piano_signals[NOTE_ON], 0, keynum);
 
-  piano->selkeys[keynum] = TRUE;
-
-  if (!piano->keyb_surface)
-    return;
-
-  draw_key_on_surface (piano, keynum, TRUE);
-
-  mod = keynum % 12;
-  xval = keynum / 12 * (PIANO_KEY_XWID * 7) + keyinfo[mod].dispx;
-#ifdef USE_GTK4
-  gtk_widget_queue_draw (GTK_WIDGET (piano));
-#else
-  if (keyinfo[mod].white)
-    gtk_widget_queue_draw_area (GTK_WIDGET (piano),
-      xval - 1, PIANO_DEFAULT_SIZEY - 8 + POFSY,
-      PIANO_KEY_XWID - 1, 8);
-  else
-    gtk_widget_queue_draw_area (GTK_WIDGET (piano),
-      xval, PIANO_DEFAULT_SIZEY / 5 + POFSY,
-      PIANO_KEY_XWID / 2 + 1, 8);
-#endif
+  piano->selkeys[keynum / 32] |= 1U << (keynum % 32);
+  piano_mark_key (piano, keynum);
 }
 
-/* draws specified key in its "released" state */
+/* marks specified key to be drawn in its "released" state */
 void
 piano_note_off (Piano * piano, guint8 keynum)
 {
-  gint xval, mod;
-
   g_return_if_fail (piano != NULL);
   g_return_if_fail (IS_PIANO (piano));
   g_return_if_fail (keynum < 128);
 
-  if (!piano->selkeys[keynum])
+  if (!PIANO_KEY_IS_SET (piano, keynum))
     return;			/* already unselected */
 
   g_signal_emit (G_OBJECT (piano), piano_signals[NOTE_OFF], 0, keynum);
 
-  piano->selkeys[keynum] = FALSE;
-
-  if (!piano->keyb_surface)
-    return;
-
-  draw_key_on_surface (piano, keynum, FALSE);
+  piano->selkeys[keynum / 32] &= ~(1U << (keynum % 32));
+  piano_mark_key (piano, keynum);
+}
 
-  mod = keynum % 12;
-  xval = keynum / 12 * 7 * PIANO_KEY_XWID + keyinfo[mod].dispx;
+/* invalidates a changed key; the whole widget is redrawn under GTK4,
+ * only the key rectangle under GTK3
+ */
+static void
+piano_mark_key (Piano * piano, guint8 keynum)
+{
 #ifdef USE_GTK4
   gtk_widget_queue_draw (GTK_WIDGET (piano));
 #else
+  gint xval, mod;
+
+  mod = keynum % 12;
+  xval = keynum / 12 * (PIANO_KEY_XWID * 7) + keyinfo[mod].dispx;
   if (keyinfo[mod].white)
     gtk_widget_queue_draw_area (GTK_WIDGET (piano),
       xval - 1, PIANO_DEFAULT_SIZEY - 8 + POFSY,
@@ -220,6 +195,24 @@ piano_note_off (Piano * piano, guint8 keynum)
 #endif
 }
 
+/* draws the held keys over the shared keyboard background */
+static void
+draw_pressed_keys (Piano * piano, cairo_t * cr)
+{
+  guint32 bits;
+  int i;
+
+  for (i = 0; i < 4; i++)
+    {
+      bits = piano->selkeys[i];
+      while (bits)
+        {
+          draw_key (cr, i * 32 + __builtin_ctz (bits), TRUE);
+          bits &= bits - 1;
+        }
+    }
+}
+
 /* converts a key number to x position in pixels to center of key */
 gint
 piano_key_to_xpos (guint8 keynum)
@@ -265,57 +258,45 @@ piano_xpos_to_key (gint xpos)
   return (keynum);
 }
 
-static void
-piano_destroy (GObject * object)
-{
-  Piano *piano;
-
-  g_return_if_fail (object != NULL);
-  g_return_if_fail (IS_PIANO (object));
-
-  piano = PIANO (object);
-
-  if (piano->keyb_surface)
-    {
-      cairo_surface_destroy (piano->keyb_surface);
-      piano->keyb_surface = NULL;
-    }
-  g_free (piano->selkeys);
-  piano->selkeys = NULL;
-
-  G_OBJECT_CLASS (piano_parent_class)->finalize (object);
-}
-
 #ifdef USE_GTK4
 
+/* the keyboard background as a texture, shared by all pianos */
+static GdkTexture *keyb_texture;
+
 static void
 piano_snapshot (GtkWidget * widget, GtkSnapshot * snapshot)
 {
   Piano *piano;
   graphene_rect_t rect;
+  cairo_surface_t *surface;
   cairo_t *cr;
-  int width, height;
+  GBytes *bytes;
 
   g_return_if_fail (widget != NULL);
   g_return_if_fail (IS_PIANO (widget));
 
   piano = PIANO (widget);
-  width = gtk_widget_get_width (widget);
-  height = gtk_widget_get_height (widget);
 
-  if (!piano->keyb_surface)
+  if (!keyb_texture)
     {
-      piano->keyb_surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24,
-        PIANO_DEFAULT_SIZEX, PIANO_DEFAULT_SIZEY);
-      draw_keyboard_surface (piano);
+      surface = get_keyboard_surface ();
+      cairo_surface_flush (surface);
+      bytes = g_bytes_new (cairo_image_surface_get_data (surface),
+        cairo_image_surface_get_stride (surface) * PIANO_DEFAULT_SIZEY);
+      keyb_texture = gdk_memory_texture_new (PIANO_DEFAULT_SIZEX,
+        PIANO_DEFAULT_SIZEY, GDK_MEMORY_DEFAULT, bytes,
+        cairo_image_surface_get_stride (surface));
+      g_bytes_unref (bytes);
     }
 
-  if (piano->keyb_surface)
+  rect = GRAPHENE_RECT_INIT (0, 0, PIANO_DEFAULT_SIZEX, PIANO_DEFAULT_SIZEY);
+  gtk_snapshot_append_texture (snapshot, keyb_texture, &rect);
+
+  if (piano->selkeys[0] | piano->selkeys[1] |
+      piano->selkeys[2] | piano->selkeys[3])
     {
-      rect = GRAPHENE_RECT_INIT (0, 0, width, height);
       cr = gtk_snapshot_append_cairo (snapshot, &rect);
-      cairo_set_source_surface (cr, piano->keyb_surface, 0, 0);
-      cairo_paint (cr);
+      draw_pressed_keys (piano, cr);
       cairo_destroy (cr);
     }
 }
@@ -340,7 +321,6 @@ piano_measure (GtkWidget * widget, GtkOrientation orientation, int for_size,
 static void
 piano_realize (GtkWidget * widget)
 {
-  Piano *piano;
   GdkWindowAttr attributes;
   GtkAllocation allocation;
   GdkWindow *window;
@@ -348,7 +328,6 @@ piano_realize (GtkWidget * widget)
   g_return_if_fail (widget != NULL);
   g_return_if_fail (IS_PIANO (widget));
 
-  piano = PIANO (widget);
   gtk_widget_set_realized (widget, TRUE);
   gtk_widget_get_allocation (widget, &allocation);
 
@@ -368,12 +347,6 @@ piano_realize (GtkWidget * widget)
     &attributes, GDK_WA_X | GDK_WA_Y | GDK_WA_VISUAL);
   gtk_widget_set_window (widget, window);
   gdk_window_set_user_data (window, widget);
-
-  if (piano->keyb_surface)
-    cairo_surface_destroy (piano->keyb_surface);
-  piano->keyb_surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24,
-    PIANO_DEFAULT_SIZEX, PIANO_DEFAULT_SIZEY);
-  draw_keyboard_surface (piano);
 }
 
 static void
@@ -403,47 +376,31 @@ piano_size_allocate (GtkWidget * widget, GtkAllocation * allocation)
       allocation->width, allocation->height);
 }
 
-/* Fast blit of the pre-rendered backing surface */
+/* Fast blit of the shared keyboard background, then the held keys */
 static gboolean
 piano_draw (GtkWidget * widget, cairo_t * cr)
 {
-  Piano *piano;
-
   g_return_val_if_fail (widget != NULL, FALSE);
   g_return_val_if_fail (IS_PIANO (widget), FALSE);
 
-  piano = PIANO (widget);
-
-  if (piano->keyb_surface)
-    {
-      cairo_set_source_surface (cr, piano->keyb_surface, 0, 0);
-      cairo_paint (cr);
-    }
+  cairo_set_source_surface (cr, get_keyboard_surface (), 0, 0);
+  cairo_paint (cr);
+  draw_pressed_keys (PIANO (widget), cr);
 
   return FALSE;
 }
 
 #endif /* USE_GTK4 */
 
-/* Draw (or redraw) a single key into the backing surface */
+/* Draw a key tile at the given position: the lower part of a white
+ * key or a black key, pressed or released
+ */
 static void
-draw_key_on_surface (Piano * piano, int note, gboolean pressed)
+draw_tile (cairo_t * cr, gboolean white, gboolean pressed, int x, int y)
 {
-  cairo_t *cr;
-  int mod, xval;
-
-  if (!piano->keyb_surface)
-    return;
-
-  mod = note % 12;
-  xval = (note / 12) * (PIANO_KEY_XWID * 7) + keyinfo[mod].dispx;
-
-  cr = cairo_create (piano->keyb_surface);
-
-  if (keyinfo[mod].white)
+  cairo_save (cr);
+  if (white)
     {
-      int x = xval - 1;
-      int y = PIANO_DEFAULT_SIZEY - 8 + POFSY;
       int w = PIANO_KEY_XWID - 1;	/* = 4 */
 
       /* White key bottom region: restore to white */
@@ -467,26 +424,24 @@ draw_key_on_surface (Piano * piano, int note, gboolean pressed)
           /* Restore the horizontal lines erased by the white fill */
           cairo_set_line_width (cr, 1.0);
           cairo_set_source_rgb (cr, 0.0, 0.0, 0.0);
-          cairo_move_to (cr, x, PIANO_DEFAULT_SIZEY - 3.5 + POFSY);
-          cairo_line_to (cr, x + w, PIANO_DEFAULT_SIZEY - 3.5 + POFSY);
+          cairo_move_to (cr, x, y + 4.5);
+          cairo_line_to (cr, x + w, y + 4.5);
           cairo_stroke (cr);
           cairo_set_source_rgb (cr, 0.75, 0.75, 0.75);
-          cairo_move_to (cr, x, PIANO_DEFAULT_SIZEY - 2.5 + POFSY);
-          cairo_line_to (cr, x + w, PIANO_DEFAULT_SIZEY - 2.5 + POFSY);
+          cairo_move_to (cr, x, y + 5.5);
+          cairo_line_to (cr, x + w, y + 5.5);
           cairo_stroke (cr);
-          cairo_move_to (cr, x, PIANO_DEFAULT_SIZEY - 1.5 + POFSY);
-          cairo_line_to (cr, x + w, PIANO_DEFAULT_SIZEY - 1.5 + POFSY);
+          cairo_move_to (cr, x, y + 6.5);
+          cairo_line_to (cr, x + w, y + 6.5);
           cairo_stroke (cr);
           cairo_set_source_rgb (cr, 0.0, 0.0, 0.0);
-          cairo_move_to (cr, x, PIANO_DEFAULT_SIZEY - 0.5 + POFSY);
-          cairo_line_to (cr, x + w, PIANO_DEFAULT_SIZEY - 0.5 + POFSY);
+          cairo_move_to (cr, x, y + 7.5);
+          cairo_line_to (cr, x + w, y + 7.5);
           cairo_stroke (cr);
         }
     }
   else
     {
-      int x = xval;
-      int y = PIANO_DEFAULT_SIZEY / 5 + POFSY;	/* = 4 */
       int w = PIANO_KEY_XWID / 2 + 1;	/* = 3 */
 
       if (pressed)
@@ -512,21 +467,85 @@ draw_key_on_surface (Piano * piano, int note, gboolean pressed)
           cairo_fill (cr);
         }
     }
+  cairo_restore (cr);
+}
 
+/* The key tiles, rendered once and shared by all pianos:
+ * white keys in the upper row and black keys in the lower one,
+ * released on the left and pressed on the right.  The middle-C
+ * marker lies above the white key tile, so it needs no variant.
+ */
+#define TILE_WIDTH	PIANO_KEY_XWID
+#define TILE_HEIGHT	8
+
+static cairo_surface_t *key_atlas;
+
+static cairo_surface_t *
+get_key_atlas (void)
+{
+  cairo_t *cr;
+
+  if (key_atlas)
+    return key_atlas;
+  key_atlas = cairo_image_surface_create (CAIRO_FORMAT_RGB24,
+    TILE_WIDTH * 2, TILE_HEIGHT * 2);
+  cr = cairo_create (key_atlas);
+  draw_tile (cr, TRUE, FALSE, 0, 0);
+  draw_tile (cr, TRUE, TRUE, TILE_WIDTH, 0);
+  draw_tile (cr, FALSE, FALSE, 0, TILE_HEIGHT);
+  draw_tile (cr, FALSE, TRUE, TILE_WIDTH, TILE_HEIGHT);
   cairo_destroy (cr);
+  return key_atlas;
 }
 
-/* Draw the full keyboard into the backing surface (all keys unpressed) */
+/* Redraw a single key into the backing surface: one blit from the atlas */
 static void
-draw_keyboard_surface (Piano * piano)
+draw_key (cairo_t * cr, int note, gboolean pressed)
+{
+  int mod, x, y, w;
+  gboolean white;
+
+  mod = note % 12;
+  white = keyinfo[mod].white;
+  x = (note / 12) * (PIANO_KEY_XWID * 7) + keyinfo[mod].dispx;
+  if (white)
+    {
+      x -= 1;
+      y = PIANO_DEFAULT_SIZEY - 8 + POFSY;
+      w = PIANO_KEY_XWID - 1;
+    }
+  else
+    {
+      y = PIANO_DEFAULT_SIZEY / 5 + POFSY;
+      w = PIANO_KEY_XWID / 2 + 1;
+    }
+
+  cairo_set_source_surface (cr, get_key_atlas (),
+    x - (pressed ? TILE_WIDTH : 0), y - (white ? 0 : TILE_HEIGHT));
+  cairo_rectangle (cr, x, y, w, TILE_HEIGHT);
+  cairo_fill (cr);
+}
+
+/* The full keyboard with all keys unpressed, rendered once and shared
+ * by all pianos
+ */
+static cairo_surface_t *keyb_surface;
+
+static cairo_surface_t *
+get_keyboard_surface (void)
 {
   cairo_t *cr;
   int i, x, mod;
 
-  if (!piano->keyb_surface)
-    return;
+  if (keyb_surface)
+    return keyb_surface;
+  keyb_surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+    PIANO_DEFAULT_SIZEX, PIANO_DEFAULT_SIZEY);
+  cr = cairo_create (keyb_surface);
 
-  cr = cairo_create (piano->keyb_surface);
+  /* opaque, so that it can be uploaded as is to a texture */
+  cairo_set_source_rgb (cr, 0.0, 0.0, 0.0);
+  cairo_paint (cr);
 
   /* White background */
   cairo_set_source_rgb (cr, 1.0, 1.0, 1.0);
@@ -587,4 +606,5 @@ draw_keyboard_surface (Piano * piano)
   cairo_fill (cr);
 
   cairo_destroy (cr);
+  return keyb_surface;
 }
@@ -43,9 +43,7 @@ struct _Piano
 {
   GtkWidget widget;
 
-  cairo_surface_t *keyb_surface;	/* backing surface for the full keyboard */
-
-  gboolean *selkeys;		/* array of 128 boolean flags of active keys */
+  guint32 selkeys[4];		/* bitset of the 128 active keys */
 };
 
 struct _PianoClass
@@ -56,7 +54,7 @@ struct _PianoClass
   void (*note_off) (Piano * piano, guint keynum);
 };
 
-GtkWidget *piano_new (gboolean * selkeys);
+GtkWidget *piano_new (void);
 GType piano_get_type (void);
 void piano_note_on (Piano * piano, guint8 keynum);
 void piano_note_off (Piano * piano, guint8 keynum);
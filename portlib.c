@@ -20,22 +20,84 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include "portlib.h"
 
 
 /*
  * callbacks
  */
-#define PORT_NUM_CBS	(PORT_MIDI_EVENT_CB + 1)
-
-typedef struct port_callback_list_t port_callback_list_t;
+#define PORT_NUM_CBS	(PORT_OVERRUN_CB + 1)
 
 typedef struct {
 	port_callback_t func;
 	void *private_data;
 } cb_pair_t;
 
+/*
+ * dispatch table size; both ALSA port ids and event types are 8bit
+ */
+#define PORT_TABLE_SIZE	256
+
+/*
+ * input batch and output flush defaults
+ */
+#define PORT_MAX_BATCH		256
+#define PORT_DEFAULT_BATCH	32
+#define PORT_DEFAULT_HOLD	1000	/* usec */
+
+/*
+ * submission queue for events written from other threads than the
+ * event loop; bounded MPSC ring, the size must be a power of two
+ */
+#define PORT_QUEUE_SIZE		1024
+#define PORT_QSLOT_DATA		256	/* bytes of variable-length data */
+#define PORT_QUEUE_CHUNKS	64	/* max slots taken by a sysex */
+
+/*
+ * max number of descriptors in the epoll set
+ */
+#define PORT_MAX_POLLFDS	8
+
+/*
+ * output backlog defaults
+ */
+#define PORT_MAX_BACKLOG	4096
+#define PORT_DEFAULT_BACKLOG	256
+#define PORT_BACKLOG_ARENA	16384	/* bytes of variable-length data */
+
+#define PORT_CTL_ALL_SOUNDS_OFF	0x78
+#define PORT_CTL_ALL_NOTES_OFF	0x7b
+
+/*
+ * output backlog of a port; events the sequencer refused are kept
+ * here in order and retried when the output gets writable again.
+ * the events go to the subscribers of the port, and the sequencer
+ * refuses them for the client as a whole, so there is no backlog
+ * per destination.
+ */
+typedef struct {
+	snd_seq_event_t *ev;		/* ring of size entries */
+	int *charge;			/* arena bytes freed with each entry */
+	int size, head, count;
+	unsigned char *arena;		/* variable-length data, a ring */
+	int arena_in, arena_used;
+	port_backlog_stats_t stats;
+} port_backlog_t;
+
+typedef struct {
+	atomic_uint seq;	/* slot sequence number */
+	snd_seq_event_t ev;
+	unsigned char data[PORT_QSLOT_DATA];
+} port_qslot_t;
+
 /*
  * client data
  */
@@ -45,25 +107,107 @@ struct port_client_t {
 	int mode;
 	int num_ports;
 	port_t *ports;
-	int running;
+	port_t *port_table[PORT_TABLE_SIZE];	/* indexed by port id */
+	atomic_int running;		/* cleared by port_client_stop */
 	int use_pthread;
-	pthread_mutex_t lock;
+	/* event loop thread; only it talks to the sequencer output */
+	pthread_t loop_thread;
+	atomic_int has_loop;
+	/* submission queue */
+	port_qslot_t queue[PORT_QUEUE_SIZE];
+	atomic_uint queue_head;		/* next slot to fill */
+	unsigned int queue_tail;	/* next slot to drain (loop only) */
+	atomic_int wake_pending;
+	int wake_fd;
+	int epoll_fd;			/* sequencer descriptors + wake_fd */
+	struct {
+		int fd;
+		int in, out;		/* watch input / output */
+	} pollfds[PORT_MAX_POLLFDS];
+	int num_pollfds;
+	int out_armed;			/* EPOLLOUT is watched */
+	/* one-shot timer run on the loop thread */
+	int timer_fd;
+	port_timer_t timer_func;
+	void *timer_data;
+	unsigned long long timer_expire;	/* usec; 0 = not armed */
+	/* called on each wakeup of the loop */
+	port_timer_t hook_func;
+	void *hook_data;
+	/* output backlog */
+	int backlog_size;
+	int overload;
+	/* pool sizes requested from other threads; 0 = unchanged */
+	atomic_int pool_req[PORT_NUM_POOLS];
+	atomic_int pool_pending;
+	atomic_int filter_pending;	/* the kernel event filter is stale */
+	atomic_ulong queue_full;
+	/* input batch */
+	snd_seq_event_t *batch[PORT_MAX_BATCH];
+	int batch_size;
+	/* output flush */
+	int flush_policy;
+	int max_hold;			/* usec */
+	unsigned long long hold_start;	/* first unflushed output; 0 = none */
+	port_client_stats_t stats;
 };
 
 struct port_t {
 	port_client_t *client;
 	int port;
 	cb_pair_t callback[PORT_NUM_CBS];
+	/* handler vectors indexed by event type, NULL-terminated */
+	cb_pair_t *handlers[PORT_TABLE_SIZE];
 	int num_subscribed;
 	int num_used;
+	unsigned long overruns;
+	/* event types rejected before dispatch, and their count */
+	atomic_uint reject[PORT_TABLE_SIZE / 32];
+	unsigned long rejected;
+	int can_output;
+	port_backlog_t backlog;
 	struct port_t *next;
 };
 
+/*
+ * the client whose loop runs on this thread
+ */
+static __thread port_client_t *loop_client;
+
 /*
  * prototypes
  */
 static void error(char *msg);
 static int call_callbacks(port_client_t *client, snd_seq_event_t *ev);
+static int flush_output(port_client_t *client);
+static int is_loop_thread(port_client_t *client);
+static int queue_event(port_client_t *client, snd_seq_event_t *ev);
+static void drain_queue(port_client_t *client);
+static void wake_loop(port_client_t *client);
+static void watch_fd(port_client_t *client, int fd, int in, int out);
+static void update_fd(port_client_t *client, int idx, int op);
+static void arm_output(port_client_t *client, int on);
+static void setup_poll(port_client_t *client);
+static void input_overrun(port_client_t *client);
+static int set_pool(port_client_t *client, int pool, int size);
+static void apply_pools(port_client_t *client);
+static void apply_filter(port_client_t *client);
+static void backlog_alloc(port_t *p, int size);
+static snd_seq_event_t *backlog_at(port_backlog_t *b, int i);
+static void backlog_remove(port_backlog_t *b, int i);
+static void backlog_pop(port_backlog_t *b);
+static int is_note_off(snd_seq_event_t *ev);
+static int event_channel(snd_seq_event_t *ev);
+static int coalesce_event(port_backlog_t *b, snd_seq_event_t *ev);
+static int output_event(port_client_t *client, port_t *p, snd_seq_event_t *ev);
+static int backlog_push(port_t *p, snd_seq_event_t *ev);
+static void retry_backlog(port_client_t *client);
+static int drain_output(port_client_t *client);
+static int output_blocking(port_client_t *client, snd_seq_event_t *ev);
+static int is_port_event(int type);
+static int port_event(port_t *p, int type, snd_seq_event_t *ev, void *private_data);
+static void add_handler(port_t *p, int type, port_callback_t func, void *private_data);
+static void remove_handler(port_t *p, int type, port_callback_t func);
 
 
 /*
@@ -87,30 +231,14 @@ static void error_handler(const char *file, int line, const char *func, int err,
 
 
 /*
+ * current monotonic time in usec
  */
-static void MUTEX_INIT(port_client_t *client, int use_pthread)
-{
-	client->use_pthread = use_pthread;
-	if (use_pthread)
-		pthread_mutex_init(&client->lock, NULL);
-}
-
-static void MUTEX_DESTROY(port_client_t *client)
-{
-	if (client->use_pthread)
-		pthread_mutex_destroy(&client->lock);
-}
-
-static void MUTEX_LOCK(port_client_t *client)
+static unsigned long long get_usec(void)
 {
-	if (client->use_pthread)
-		pthread_mutex_lock(&client->lock);
-}
+	struct timespec ts;
 
-static void MUTEX_UNLOCK(port_client_t *client)
-{
-	if (client->use_pthread)
-		pthread_mutex_unlock(&client->lock);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 /*
@@ -119,6 +247,7 @@ static void MUTEX_UNLOCK(port_client_t *client)
 port_client_t *port_client_new(char *name, int mode, int use_pthread)
 {
 	port_client_t *client;
+	unsigned int i;
 
 	if ((client = malloc(sizeof(*client))) == NULL)
 		error("can't malloc");
@@ -136,7 +265,15 @@ port_client_t *port_client_new(char *name, int mode, int use_pthread)
 	client->mode = mode;
 	client->num_ports = 0;
 	client->ports = NULL;
-	MUTEX_INIT(client, use_pthread);
+	client->batch_size = PORT_DEFAULT_BATCH;
+	client->flush_policy = PORT_FLUSH_TIMED;
+	client->max_hold = PORT_DEFAULT_HOLD;
+	client->backlog_size = PORT_DEFAULT_BACKLOG;
+	client->overload = PORT_OVERLOAD_DROP_OLDEST;
+	client->use_pthread = use_pthread;
+	for (i = 0; i < PORT_QUEUE_SIZE; i++)
+		atomic_init(&client->queue[i].seq, i);
+	setup_poll(client);
 	
 	if (snd_seq_set_client_name(client->seq, name) < 0)
 		error("set client info");
@@ -151,12 +288,18 @@ void port_client_delete(port_client_t *client)
 {
 	if (client) {
 		port_t *p, *next;
+		int i;
 		snd_seq_close(client->seq);
 		for (p = client->ports; p; p = next) {
 			next = p->next;
+			for (i = 0; i < PORT_TABLE_SIZE; i++)
+				free(p->handlers[i]);
+			backlog_alloc(p, 0);
 			free(p);
 		}
-		MUTEX_DESTROY(client);
+		close(client->wake_fd);
+		close(client->timer_fd);
+		close(client->epoll_fd);
 		free(client);
 	}
 }
@@ -168,6 +311,7 @@ void port_client_delete(port_client_t *client)
 port_t *port_attach(port_client_t *client, char *name, unsigned int cap, unsigned int type)
 {
 	port_t *p, *q;
+	int i;
 
 	p = malloc(sizeof(*p));
 	if (p == NULL)
@@ -176,8 +320,20 @@ port_t *port_attach(port_client_t *client, char *name, unsigned int cap, unsigne
 	p->client = client;
 
 	p->port = snd_seq_create_simple_port(client->seq, name, cap, type);
-	if (p->port < 0)
+	if (p->port < 0 || p->port >= PORT_TABLE_SIZE)
 		error("create port");
+	if (cap & SND_SEQ_PORT_CAP_READ) {
+		p->can_output = 1;
+		backlog_alloc(p, client->backlog_size);
+	}
+	/* subscription accounting is always dispatched */
+	for (i = 0; i < PORT_TABLE_SIZE; i++)
+		if (is_port_event(i))
+			add_handler(p, i, port_event, NULL);
+	client->port_table[p->port] = p;
+	/* a new port takes all events */
+	atomic_store(&client->filter_pending, 1);
+	wake_loop(client);
 
 	client->num_ports++;
 	if (client->ports == NULL)
@@ -198,11 +354,13 @@ int port_detach(port_t *p)
 {
 	port_client_t *client;
 	port_t *q, *prev;
+	int i;
 
 	if (snd_seq_delete_simple_port(p->client->seq, p->port) < 0)
 		error("delete port");
 
 	client = p->client;
+	client->port_table[p->port] = NULL;
 	prev = NULL;
 	for (q = client->ports; q; prev = q, q = q->next) {
 		if (q == p) {
@@ -214,99 +372,882 @@ int port_detach(port_t *p)
 			break;
 		}
 	}
+	atomic_store(&client->filter_pending, 1);
+	wake_loop(client);
+	for (i = 0; i < PORT_TABLE_SIZE; i++)
+		free(p->handlers[i]);
+	backlog_alloc(p, 0);
 	free(p);
 	return 0;
 }
 
 /*
- * main loop
+ * add a descriptor to the epoll set; output descriptors are
+ * watched only while there is pending output
  */
-void port_client_do_loop(port_client_t *client, int timeout)
+static void watch_fd(port_client_t *client, int fd, int in, int out)
+{
+	int i;
+
+	for (i = 0; i < client->num_pollfds; i++)
+		if (client->pollfds[i].fd == fd)
+			break;
+	if (i < client->num_pollfds) {
+		client->pollfds[i].in |= in;
+		client->pollfds[i].out |= out;
+		update_fd(client, i, EPOLL_CTL_MOD);
+		return;
+	}
+	if (i == PORT_MAX_POLLFDS)
+		error("too many descriptors");
+	client->pollfds[i].fd = fd;
+	client->pollfds[i].in = in;
+	client->pollfds[i].out = out;
+	client->num_pollfds++;
+	update_fd(client, i, EPOLL_CTL_ADD);
+}
+
+/*
+ * set the epoll events of a descriptor
+ */
+static void update_fd(port_client_t *client, int idx, int op)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	if (client->pollfds[idx].in)
+		ev.events |= EPOLLIN;
+	if (client->pollfds[idx].out && client->out_armed)
+		ev.events |= EPOLLOUT;
+	ev.data.fd = client->pollfds[idx].fd;
+	if (epoll_ctl(client->epoll_fd, op, ev.data.fd, &ev) < 0)
+		error("epoll_ctl");
+}
+
+/*
+ * start or stop watching the sequencer output
+ */
+static void arm_output(port_client_t *client, int on)
+{
+	int i;
+
+	if (client->out_armed == on)
+		return;
+	client->out_armed = on;
+	for (i = 0; i < client->num_pollfds; i++)
+		if (client->pollfds[i].out)
+			update_fd(client, i, EPOLL_CTL_MOD);
+}
+
+/*
+ * create the epoll set carrying the sequencer descriptors
+ * and the wakeup eventfd
+ */
+static void setup_poll(port_client_t *client)
 {
 #if SND_LIB_MAJOR > 0 || SND_LIB_MINOR > 5
-	int npfds = snd_seq_poll_descriptors_count(client->seq, POLLIN);
+	int i, npfds;
 	struct pollfd *pfd;
+#endif
+
+	if ((client->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		error("epoll_create");
+	if ((client->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		error("eventfd");
+	watch_fd(client, client->wake_fd, 1, 0);
+	client->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+	if (client->timer_fd < 0)
+		error("timerfd");
+	watch_fd(client, client->timer_fd, 1, 0);
+#if SND_LIB_MAJOR > 0 || SND_LIB_MINOR > 5
+	npfds = snd_seq_poll_descriptors_count(client->seq, POLLIN);
 	if (npfds <= 0)
-		return;
+		error("poll descriptors");
 	pfd = alloca(sizeof(*pfd) * npfds);
 	if (snd_seq_poll_descriptors(client->seq, pfd, npfds, POLLIN) < 0)
-		return;
-	client->running = 1;
-	while (client->running) {
-		if (poll(pfd, npfds, timeout) < 0)
-			continue;
-		if (port_client_do_event(client))
-			break;
+		error("poll descriptors");
+	for (i = 0; i < npfds; i++)
+		watch_fd(client, pfd[i].fd, 1, 0);
+	npfds = snd_seq_poll_descriptors_count(client->seq, POLLOUT);
+	if (npfds > 0) {
+		pfd = alloca(sizeof(*pfd) * npfds);
+		if (snd_seq_poll_descriptors(client->seq, pfd, npfds, POLLOUT) < 0)
+			error("poll descriptors");
+		for (i = 0; i < npfds; i++)
+			watch_fd(client, pfd[i].fd, 0, 1);
 	}
 #else
-	fd_set rfds;
-	int fd = snd_seq_file_descriptor(client->seq);
-	struct timeval tval;
-	
-	tval.tv_sec = timeout / 1000;
-	tval.tv_usec = timeout * 1000;
-
-	client->running = 1;
-	while (client->running) {
-		FD_ZERO(&rfds);
-		FD_SET(fd, &rfds);
-		if (select(fd + 1, &rfds, NULL, NULL, timeout < 0 ? NULL : &tval) < 0)
-			error("select");
-		if (FD_ISSET(fd, &rfds)) {
-			if (port_client_do_event(client))
-				break;
-		}
-	}
+	watch_fd(client, snd_seq_file_descriptor(client->seq), 1, 1);
 #endif
 }
 
+/*
+ * main loop
+ *
+ * the calling thread becomes the loop thread; events written from
+ * other threads are queued and drained here.  the loop sleeps until
+ * input arrives or another thread wakes it, so a negative timeout
+ * is fine.
+ */
+void port_client_do_loop(port_client_t *client, int timeout)
+{
+	client->loop_thread = pthread_self();
+	loop_client = client;
+	atomic_store(&client->has_loop, 1);
+	atomic_store(&client->running, 1);
+	apply_pools(client);
+	apply_filter(client);
+	while (atomic_load(&client->running)) {
+		if (port_client_dispatch(client, timeout))
+			break;
+	}
+	atomic_store(&client->has_loop, 0);
+	loop_client = NULL;
+}
+
+/*
+ * wait up to timeout msec for input or a wakeup, and handle it;
+ * returns non-zero when the loop should stop
+ */
+int port_client_dispatch(port_client_t *client, int timeout)
+{
+	struct epoll_event evs[PORT_MAX_POLLFDS];
+	eventfd_t val;
+	uint64_t expired;
+	int i, n, writable = 0, timer = 0;
+
+	n = epoll_wait(client->epoll_fd, evs, PORT_MAX_POLLFDS, timeout);
+	if (n < 0)
+		return errno == EINTR ? 0 : -errno;
+	if (n == 0)
+		return 0;
+	for (i = 0; i < n; i++) {
+		if (evs[i].data.fd == client->wake_fd)
+			eventfd_read(client->wake_fd, &val);
+		else if (evs[i].data.fd == client->timer_fd &&
+			 read(client->timer_fd, &expired, sizeof(expired)) > 0)
+			timer = 1;
+		if (evs[i].events & EPOLLOUT)
+			writable = 1;
+	}
+	if (writable)
+		retry_backlog(client);
+	if (timer) {
+		client->timer_expire = 0;
+		if (client->timer_func)
+			client->timer_func(client, client->timer_data);
+	}
+	if (client->hook_func)
+		client->hook_func(client, client->hook_data);
+	return port_client_do_event(client);
+}
 
 /*
  * do one event
+ *
+ * events are read in batches; a batch holds only the events already
+ * sitting in the input buffer, so the pointers stay valid until the
+ * whole batch has been dispatched.  the output is drained according
+ * to the flush policy, and always when the input backlog is empty.
+ * the submission queue is drained and pending pool changes are
+ * applied before each batch.  an input overrun can be reported only
+ * when the input buffer is refilled, i.e. at the start of a batch.
  */
 int
 port_client_do_event(port_client_t *client)
 {
 	snd_seq_event_t *ev;
-	int rc, cells;
+	int i, n, err, rc = 0;
 
-	while ((cells = snd_seq_event_input(client->seq, &ev)) >= 0 && ev != NULL) {
-		rc = call_callbacks(client, ev);
-		snd_seq_free_event(ev);
+	for (;;) {
+		apply_pools(client);
+		apply_filter(client);
+		drain_queue(client);
+		for (n = 0; n < client->batch_size; ) {
+			if (n > 0 && snd_seq_event_input_pending(client->seq, 0) <= 0)
+				break;
+			err = snd_seq_event_input(client->seq, &ev);
+			if (err == -ENOSPC) {
+				input_overrun(client);
+				continue;
+			}
+			if (err < 0 || ev == NULL)
+				break;
+			client->batch[n++] = ev;
+		}
+		if (n == 0)
+			break;
+		client->stats.batches++;
+		client->stats.events += n;
+		if (n > client->stats.max_batch)
+			client->stats.max_batch = n;
+		for (i = 0; i < n; i++) {
+			if (rc >= 0)
+				rc = call_callbacks(client, client->batch[i]);
+			snd_seq_free_event(client->batch[i]);
+			if (client->flush_policy == PORT_FLUSH_IMMEDIATE)
+				flush_output(client);
+		}
 		if (rc < 0)
-			return rc;
+			break;
+		if (client->flush_policy == PORT_FLUSH_BATCH ||
+		    (client->flush_policy == PORT_FLUSH_TIMED && client->hold_start &&
+		     get_usec() - client->hold_start >= client->max_hold))
+			flush_output(client);
 	}
-	MUTEX_LOCK(client);
-	snd_seq_flush_output(client->seq);
-	MUTEX_UNLOCK(client);
-	return 0;
+	flush_output(client);
+	return rc;
 }
 
+/*
+ * drain the pending output and account the hold time;
+ * called from the loop thread only
+ */
+static int flush_output(port_client_t *client)
+{
+	unsigned long latency;
+	int err;
+
+	if (!client->hold_start)
+		return 0;
+	err = snd_seq_flush_output(client->seq);
+	if (err)
+		arm_output(client, 1);	/* the rest goes when writable */
+	latency = get_usec() - client->hold_start;
+	client->hold_start = 0;
+	client->stats.flushes++;
+	client->stats.total_latency += latency;
+	if (latency > client->stats.max_latency)
+		client->stats.max_latency = latency;
+	return err;
+}
 
 /*
- * search specified port
+ * the kernel dropped the input fifo; which ports lost events is
+ * unknown, so the overrun is charged to all ports of the client
  */
-port_t *port_client_search_port(port_client_t *client, int port)
+static void input_overrun(port_client_t *client)
+{
+	port_t *p;
+	port_callback_t func;
+
+	client->stats.overruns++;
+	for (p = client->ports; p; p = p->next) {
+		p->overruns++;
+		func = p->callback[PORT_OVERRUN_CB].func;
+		if (func)
+			func(p, PORT_OVERRUN_CB, NULL,
+			     p->callback[PORT_OVERRUN_CB].private_data);
+	}
+}
+
+/*
+ * resize a pool or a buffer; called from the loop thread only,
+ * since resizing the input buffer discards the events in it
+ */
+static int set_pool(port_client_t *client, int pool, int size)
+{
+#if SND_LIB_MAJOR > 0 || SND_LIB_MINOR > 5
+	switch (pool) {
+	case PORT_POOL_INPUT:
+		return snd_seq_set_client_pool_input(client->seq, size);
+	case PORT_POOL_OUTPUT:
+		return snd_seq_set_client_pool_output(client->seq, size);
+	case PORT_BUFFER_INPUT:
+		return snd_seq_set_input_buffer_size(client->seq, size);
+	case PORT_BUFFER_OUTPUT:
+		flush_output(client);
+		return snd_seq_set_output_buffer_size(client->seq, size);
+	}
+	return -EINVAL;
+#else
+	return -ENOSYS;
+#endif
+}
+
+/*
+ * apply the pool sizes requested from other threads
+ */
+static void apply_pools(port_client_t *client)
 {
+	int i, size;
+
+	if (!atomic_exchange(&client->pool_pending, 0))
+		return;
+	for (i = 0; i < PORT_NUM_POOLS; i++) {
+		size = atomic_exchange(&client->pool_req[i], 0);
+		if (size > 0)
+			set_pool(client, i, size);
+	}
+}
+
+/*
+ * push the event types rejected by all ports down to the kernel,
+ * so that they are not delivered at all.  the kernel filter lists
+ * the accepted types; subscription notices can't be rejected, so
+ * they are always in it.
+ */
+static void apply_filter(port_client_t *client)
+{
+#ifdef ALSA_API_ENCAP
+	snd_seq_client_info_t *info;
+	unsigned int common[PORT_TABLE_SIZE / 32];
 	port_t *p;
+	int i, any = 0;
 
+	if (!atomic_exchange(&client->filter_pending, 0))
+		return;
+	memset(common, client->ports ? 0xff : 0, sizeof(common));
 	for (p = client->ports; p; p = p->next)
-		if (p->port == port)
-			return p;
-	return NULL;
+		for (i = 0; i < PORT_TABLE_SIZE / 32; i++)
+			common[i] &= atomic_load(&p->reject[i]);
+	for (i = 0; i < PORT_TABLE_SIZE / 32; i++)
+		any |= common[i];
+	snd_seq_client_info_alloca(&info);
+	if (snd_seq_get_client_info(client->seq, info) < 0)
+		return;
+	snd_seq_client_info_event_filter_clear(info);
+	if (any) {
+		for (i = 0; i < PORT_TABLE_SIZE; i++)
+			if (!(common[i / 32] & (1U << (i % 32))))
+				snd_seq_client_info_event_filter_add(info, i);
+	}
+	snd_seq_set_client_info(client->seq, info);
+#else
+	atomic_store(&client->filter_pending, 0);
+#endif
+}
+
+/*
+ * check whether the caller may output directly; without threads
+ * everything runs in one context.  before the loop runs, all threads
+ * go through the queue.
+ */
+static int is_loop_thread(port_client_t *client)
+{
+	if (!client->use_pthread)
+		return 1;
+	return atomic_load(&client->has_loop) &&
+		pthread_equal(client->loop_thread, pthread_self());
+}
+
+/*
+ * put an event to the submission queue;
+ * the variable-length data is copied to the slot, and a longer sysex
+ * is split over consecutive slots.  returns -EAGAIN if the queue is
+ * full and no loop drains it, or the caller runs a loop itself, as
+ * waiting there could stall the loops on each other.
+ */
+static int queue_event(port_client_t *client, snd_seq_event_t *ev)
+{
+	port_qslot_t *slot;
+	unsigned int pos, seq, i, n = 1;
+	int diff, len = 0, chunk;
+	unsigned char *data = NULL;
+
+	if (snd_seq_ev_is_variable(ev)) {
+		data = ev->data.ext.ptr;
+		len = ev->data.ext.len;
+		if (len > PORT_QSLOT_DATA) {
+			if (ev->type != SND_SEQ_EVENT_SYSEX)
+				return -E2BIG;
+			n = (len + PORT_QSLOT_DATA - 1) / PORT_QSLOT_DATA;
+			if (n > PORT_QUEUE_CHUNKS)
+				return -E2BIG;
+		}
+	}
+	pos = atomic_load_explicit(&client->queue_head, memory_order_relaxed);
+	for (;;) {
+		/* the slots are released in order, so the last one tells */
+		slot = &client->queue[(pos + n - 1) & (PORT_QUEUE_SIZE - 1)];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		diff = (int)(seq - (pos + n - 1));
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&client->queue_head,
+					&pos, pos + n, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			/* full; wait for the loop to make room */
+			if (!atomic_load(&client->running) || loop_client) {
+				atomic_fetch_add(&client->queue_full, 1);
+				return -EAGAIN;
+			}
+			wake_loop(client);
+			sched_yield();
+			pos = atomic_load_explicit(&client->queue_head,
+						   memory_order_relaxed);
+		} else
+			pos = atomic_load_explicit(&client->queue_head,
+						   memory_order_relaxed);
+	}
+	for (i = 0; i < n; i++, pos++) {
+		slot = &client->queue[pos & (PORT_QUEUE_SIZE - 1)];
+		slot->ev = *ev;
+		if (data) {
+			chunk = len < PORT_QSLOT_DATA ? len : PORT_QSLOT_DATA;
+			memcpy(slot->data, data, chunk);
+			slot->ev.data.ext.ptr = slot->data;
+			slot->ev.data.ext.len = chunk;
+			data += chunk;
+			len -= chunk;
+		}
+		atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	}
+	return 0;
 }
 
+/*
+ * move the queued events to the sequencer output;
+ * called from the loop thread only
+ */
+static void drain_queue(port_client_t *client)
+{
+	port_qslot_t *slot;
+	unsigned int pos, depth;
+	int n = 0;
+
+	atomic_store(&client->wake_pending, 0);
+	/* re-arm the wakeup before looking at the slots */
+	atomic_thread_fence(memory_order_seq_cst);
+	depth = atomic_load(&client->queue_head) - client->queue_tail;
+	if (depth > client->stats.queue_max)
+		client->stats.queue_max = depth;
+	for (;;) {
+		pos = client->queue_tail;
+		slot = &client->queue[pos & (PORT_QUEUE_SIZE - 1)];
+		if ((int)(atomic_load_explicit(&slot->seq, memory_order_acquire)
+			  - (pos + 1)) < 0)
+			break;
+		if (output_event(client,
+				 client->port_table[slot->ev.source.port],
+				 &slot->ev) < 0)
+			client->stats.queue_lost++;
+		if (!client->hold_start)
+			client->hold_start = get_usec();
+		atomic_store_explicit(&slot->seq, pos + PORT_QUEUE_SIZE,
+				      memory_order_release);
+		client->queue_tail = pos + 1;
+		n++;
+	}
+	if (n) {
+		client->stats.queued += n;
+		flush_output(client);
+	}
+}
+
+/*
+ * (re)allocate the backlog of a port; size 0 frees it
+ */
+static void backlog_alloc(port_t *p, int size)
+{
+	port_backlog_t *b = &p->backlog;
+
+	free(b->ev);
+	free(b->charge);
+	free(b->arena);
+	memset(b, 0, sizeof(*b));
+	if (size <= 0)
+		return;
+	b->ev = malloc(sizeof(*b->ev) * size);
+	b->charge = malloc(sizeof(*b->charge) * size);
+	b->arena = malloc(PORT_BACKLOG_ARENA);
+	if (b->ev == NULL || b->charge == NULL || b->arena == NULL)
+		error("can't malloc");
+	b->size = size;
+}
 
 /*
- * call a callback function
+ * i-th queued event from the oldest
+ */
+static snd_seq_event_t *backlog_at(port_backlog_t *b, int i)
+{
+	return &b->ev[(b->head + i) % b->size];
+}
+
+/*
+ * remove the i-th queued event, keeping the order of the others;
+ * its data is in the middle of the arena, so the older neighbour
+ * frees it later
+ */
+static void backlog_remove(port_backlog_t *b, int i)
+{
+	int *charge;
+
+	if (!i) {
+		backlog_pop(b);
+		return;
+	}
+	charge = &b->charge[(b->head + i - 1) % b->size];
+	*charge += b->charge[(b->head + i) % b->size];
+	for (; i < b->count - 1; i++) {
+		*backlog_at(b, i) = *backlog_at(b, i + 1);
+		b->charge[(b->head + i) % b->size] =
+			b->charge[(b->head + i + 1) % b->size];
+	}
+	b->count--;
+}
+
+/*
+ * remove the oldest queued event and free its arena space
+ */
+static void backlog_pop(port_backlog_t *b)
+{
+	b->arena_used -= b->charge[b->head];
+	b->head = (b->head + 1) % b->size;
+	if (!--b->count)
+		b->arena_in = b->arena_used = 0;
+}
+
+/*
+ * take len bytes from the arena, wrapping to its start when the end
+ * is too short; the skipped end is charged to the event, too.
+ * returns the offset, or -1 if there is no room.
+ */
+static int arena_alloc(port_backlog_t *b, int len, int *charge)
+{
+	int ofs = b->arena_in, skip = 0;
+
+	if (ofs + len > PORT_BACKLOG_ARENA) {
+		skip = PORT_BACKLOG_ARENA - ofs;
+		ofs = 0;
+	}
+	if (b->arena_used + skip + len > PORT_BACKLOG_ARENA)
+		return -1;
+	b->arena_in = ofs + len;
+	b->arena_used += skip + len;
+	*charge = skip + len;
+	return ofs;
+}
+
+/*
+ * events which must never be dropped
+ */
+static int is_note_off(snd_seq_event_t *ev)
+{
+	switch (ev->type) {
+	case SND_SEQ_EVENT_NOTEOFF:
+		return 1;
+	case SND_SEQ_EVENT_NOTEON:
+		return ev->data.note.velocity == 0;
+	case SND_SEQ_EVENT_CONTROLLER:
+		return ev->data.control.param == PORT_CTL_ALL_SOUNDS_OFF ||
+			ev->data.control.param == PORT_CTL_ALL_NOTES_OFF;
+	}
+	return 0;
+}
+
+/*
+ * MIDI channel of a voice message, or -1
+ */
+static int event_channel(snd_seq_event_t *ev)
+{
+	switch (ev->type) {
+	case SND_SEQ_EVENT_NOTE:
+	case SND_SEQ_EVENT_NOTEON:
+	case SND_SEQ_EVENT_NOTEOFF:
+	case SND_SEQ_EVENT_KEYPRESS:
+		return ev->data.note.channel;
+	case SND_SEQ_EVENT_CONTROLLER:
+	case SND_SEQ_EVENT_PGMCHANGE:
+	case SND_SEQ_EVENT_CHANPRESS:
+	case SND_SEQ_EVENT_PITCHBEND:
+	case SND_SEQ_EVENT_CONTROL14:
+	case SND_SEQ_EVENT_NONREGPARAM:
+	case SND_SEQ_EVENT_REGPARAM:
+		return ev->data.control.channel;
+	}
+	return -1;
+}
+
+/*
+ * merge a continuous controller into a queued one of the same
+ * channel and parameter; events of other types on the channel
+ * in between keep the order, so the search stops there
+ */
+static int coalesce_event(port_backlog_t *b, snd_seq_event_t *ev)
+{
+	snd_seq_event_t *q;
+	int i, ch;
+
+	switch (ev->type) {
+	case SND_SEQ_EVENT_CONTROLLER:
+		if (is_note_off(ev))
+			return 0;
+		break;
+	case SND_SEQ_EVENT_KEYPRESS:
+	case SND_SEQ_EVENT_CHANPRESS:
+	case SND_SEQ_EVENT_PITCHBEND:
+		break;
+	default:
+		return 0;
+	}
+	ch = event_channel(ev);
+	for (i = b->count - 1; i >= 0; i--) {
+		q = backlog_at(b, i);
+		if (q->dest.client != ev->dest.client ||
+		    q->dest.port != ev->dest.port ||
+		    event_channel(q) != ch)
+			continue;
+		if (q->type != ev->type) {
+			if (q->type == SND_SEQ_EVENT_CONTROLLER ||
+			    q->type == SND_SEQ_EVENT_KEYPRESS ||
+			    q->type == SND_SEQ_EVENT_CHANPRESS ||
+			    q->type == SND_SEQ_EVENT_PITCHBEND)
+				continue;
+			return 0;
+		}
+		if ((ev->type == SND_SEQ_EVENT_CONTROLLER &&
+		     q->data.control.param != ev->data.control.param) ||
+		    (ev->type == SND_SEQ_EVENT_KEYPRESS &&
+		     q->data.note.note != ev->data.note.note))
+			continue;
+		if (is_note_off(q))
+			return 0;
+		q->data = ev->data;
+		b->stats.coalesced++;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * put an event to the backlog of the port, applying the overload
+ * policy of the client when it is full
+ */
+static int backlog_push(port_t *p, snd_seq_event_t *ev)
+{
+	port_client_t *client = p->client;
+	port_backlog_t *b = &p->backlog;
+	snd_seq_event_t *q;
+	int i, len, ofs = 0, charge = 0;
+
+	if (client->overload == PORT_OVERLOAD_COALESCE && coalesce_event(b, ev))
+		return 0;
+	len = snd_seq_ev_is_variable(ev) ? ev->data.ext.len : 0;
+	if (b->count == b->size) {
+		switch (client->overload) {
+		case PORT_OVERLOAD_BLOCK:
+			return output_blocking(client, ev);
+		case PORT_OVERLOAD_DROP_NEWEST:
+			b->stats.dropped++;
+			return -EAGAIN;
+		default:
+			for (i = 0; i < b->count; i++)
+				if (!is_note_off(backlog_at(b, i)))
+					break;
+			if (i < b->count) {
+				backlog_remove(b, i);
+				b->stats.dropped++;
+				break;
+			}
+			/* only note-offs are queued */
+			if (is_note_off(ev))
+				return output_blocking(client, ev);
+			b->stats.dropped++;
+			return -EAGAIN;
+		}
+	}
+	while (len && (ofs = arena_alloc(b, len, &charge)) < 0) {
+		/* only dropping the oldest frees its arena space */
+		if (client->overload == PORT_OVERLOAD_BLOCK)
+			return output_blocking(client, ev);
+		if (client->overload == PORT_OVERLOAD_DROP_NEWEST ||
+		    !b->count || is_note_off(backlog_at(b, 0))) {
+			b->stats.dropped++;
+			return -EAGAIN;
+		}
+		backlog_pop(b);
+		b->stats.dropped++;
+	}
+	q = backlog_at(b, b->count);
+	*q = *ev;
+	if (len) {
+		memcpy(b->arena + ofs, ev->data.ext.ptr, len);
+		q->data.ext.ptr = b->arena + ofs;
+	}
+	b->charge[(b->head + b->count) % b->size] = charge;
+	b->count++;
+	b->stats.queued++;
+	if (b->count > b->stats.max_depth)
+		b->stats.max_depth = b->count;
+	arm_output(client, 1);
+	return 0;
+}
+
+/*
+ * output an event from the loop thread; when the sequencer doesn't
+ * take it, or older events of the port are still waiting, it goes
+ * to the backlog of the port
+ */
+static int output_event(port_client_t *client, port_t *p, snd_seq_event_t *ev)
+{
+	int rc;
+
+	if (p && p->backlog.count)
+		return backlog_push(p, ev);
+	rc = snd_seq_event_output(client->seq, ev);
+	if (rc == -EAGAIN && p && p->backlog.size)
+		return backlog_push(p, ev);
+	return rc;
+}
+
+/*
+ * the output got writable; pass the backlog to the sequencer
+ * and stop watching the output when all is gone
+ */
+static void retry_backlog(port_client_t *client)
+{
+	port_backlog_t *b;
+	port_t *p;
+	int rc;
+
+	if (drain_output(client))
+		return;
+	for (p = client->ports; p; p = p->next) {
+		b = &p->backlog;
+		while (b->count) {
+			rc = snd_seq_event_output(client->seq, backlog_at(b, 0));
+			if (rc == -EAGAIN)
+				return;
+			if (rc < 0)
+				b->stats.dropped++;
+			else
+				b->stats.retried++;
+			backlog_pop(b);
+		}
+	}
+	if (drain_output(client))
+		return;
+	arm_output(client, 0);
+}
+
+/*
+ * drain the sequencer output; an event the sequencer refuses for
+ * good, e.g. to a vanished destination, is dropped, as it would
+ * keep the output writable and the loop spinning otherwise.
+ * returns non-zero while events are still waiting.
+ */
+static int drain_output(port_client_t *client)
+{
+	snd_seq_event_t *ev;
+	port_t *p;
+	int rc;
+
+	while ((rc = snd_seq_drain_output(client->seq)) < 0 && rc != -EAGAIN) {
+		if (snd_seq_extract_output(client->seq, &ev) < 0)
+			return 0;
+		p = port_client_search_port(client, ev->source.port);
+		if (p)
+			p->backlog.stats.dropped++;
+	}
+	return rc;
+}
+
+/*
+ * wait until the sequencer took the backlog and the given event
+ */
+static int output_blocking(port_client_t *client, snd_seq_event_t *ev)
+{
+	int rc;
+
+#if SND_LIB_MAJOR > 0 || SND_LIB_MINOR > 5
+	snd_seq_nonblock(client->seq, 0);
+#else
+	snd_seq_block_mode(client->seq, 1);
+#endif
+	retry_backlog(client);
+	rc = snd_seq_event_output(client->seq, ev);
+	snd_seq_drain_output(client->seq);
+#if SND_LIB_MAJOR > 0 || SND_LIB_MINOR > 5
+	snd_seq_nonblock(client->seq, 1);
+#else
+	snd_seq_block_mode(client->seq, 0);
+#endif
+	return rc;
+}
+
+/*
+ * kick the loop thread to drain the queue
+ */
+static void wake_loop(port_client_t *client)
+{
+	if (!atomic_exchange(&client->wake_pending, 1))
+		eventfd_write(client->wake_fd, 1);
+}
+
+
+/*
+ * search specified port
+ */
+port_t *port_client_search_port(port_client_t *client, int port)
+{
+	if (port < 0 || port >= PORT_TABLE_SIZE)
+		return NULL;
+	return client->port_table[port];
+}
+
+
+/*
+ * call a callback function:
+ * look up the port and the handler vector of the event type;
+ * events nobody handles are dropped here
  */
 static int call_callbacks(port_client_t *client, snd_seq_event_t *ev)
 {
-	port_t *p = port_client_search_port(client, ev->dest.port);
+	port_t *p = client->port_table[ev->dest.port];
 
 	if (p == NULL)
 		return 0;
+	if ((atomic_load_explicit(&p->reject[ev->type / 32],
+				  memory_order_relaxed) >> (ev->type % 32)) & 1) {
+		p->rejected++;
+		return 0;
+	}
+	return port_dispatch_event(p, ev);
+}
+
+/*
+ * pass the event to the handlers registered for its type
+ */
+int port_dispatch_event(port_t *p, snd_seq_event_t *ev)
+{
+	cb_pair_t *h = p->handlers[ev->type];
+	int rc = 0;
 
+	if (h == NULL)
+		return 0;
+	for (; h->func; h++) {
+		rc = h->func(p, PORT_MIDI_EVENT_CB, ev, h->private_data);
+		if (rc < 0)
+			break;
+	}
+	return rc;
+}
+
+/*
+ * check whether the event type is a subscription notice
+ */
+static int is_port_event(int type)
+{
+	switch (type) {
+	case SND_SEQ_EVENT_PORT_SUBSCRIBED:
+	case SND_SEQ_EVENT_PORT_UNSUBSCRIBED:
+#ifndef ALSA_API_ENCAP
+	case SND_SEQ_EVENT_PORT_USED:
+	case SND_SEQ_EVENT_PORT_UNUSED:
+#endif
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * subscription notice handler
+ */
+static int port_event(port_t *p, int type, snd_seq_event_t *ev, void *private_data)
+{
 	switch (ev->type) {
 #ifdef ALSA_API_ENCAP
 #define snd_seq_addr_equal(a,b)	((a)->client == (b)->client && (a)->port == (b)->port)
@@ -342,12 +1283,51 @@ static int call_callbacks(port_client_t *client, snd_seq_event_t *ev)
 		p->num_used--;
 		return port_call_callback(p, PORT_UNUSE_CB, ev);
 #endif
-	default:
-		return port_call_callback(p, PORT_MIDI_EVENT_CB, ev);
 	}
 	return 0;
 }
 
+/*
+ * append a handler to the vector of the event type
+ */
+static void add_handler(port_t *p, int type, port_callback_t func, void *private_data)
+{
+	cb_pair_t *h = p->handlers[type];
+	int n = 0;
+
+	if (h)
+		for (; h[n].func; n++)
+			;
+	h = realloc(h, sizeof(*h) * (n + 2));
+	if (h == NULL)
+		error("can't malloc");
+	h[n].func = func;
+	h[n].private_data = private_data;
+	h[n + 1].func = NULL;
+	h[n + 1].private_data = NULL;
+	p->handlers[type] = h;
+}
+
+/*
+ * remove a handler from the vector of the event type
+ */
+static void remove_handler(port_t *p, int type, port_callback_t func)
+{
+	cb_pair_t *h = p->handlers[type];
+	int i, n;
+
+	if (h == NULL)
+		return;
+	for (i = n = 0; h[i].func; i++)
+		if (h[i].func != func)
+			h[n++] = h[i];
+	if (n == 0) {
+		free(h);
+		p->handlers[type] = NULL;
+	} else
+		h[n] = h[i];
+}
+
 /*
  * exported methods
  */
@@ -371,9 +1351,191 @@ int port_get_port(port_t *p)
 	return p->port;
 }
 
+/*
+ * descriptor to poll from an external main loop;
+ * readable whenever port_client_dispatch() has work to do
+ */
+int port_client_get_fd(port_client_t *client)
+{
+	return client->epoll_fd;
+}
+
+/*
+ * wake the loop up to drain the queued output
+ */
+void port_client_wakeup(port_client_t *client)
+{
+	wake_loop(client);
+}
+
+/*
+ * stop the loop; it returns without waiting for further input
+ */
 void port_client_stop(port_client_t *client)
 {
-	client->running = 0;
+	atomic_store(&client->running, 0);
+	atomic_store(&client->wake_pending, 0);
+	wake_loop(client);
+}
+
+/*
+ * set the max number of input events dispatched per batch
+ */
+int port_client_set_batch(port_client_t *client, int size)
+{
+	if (size < 1 || size > PORT_MAX_BATCH)
+		return -EINVAL;
+	client->batch_size = size;
+	return 0;
+}
+
+/*
+ * set the output flush policy;
+ * max_hold is the longest time (in usec) output may be held
+ * with PORT_FLUSH_TIMED
+ */
+int port_client_set_flush_policy(port_client_t *client, int policy, int max_hold)
+{
+	switch (policy) {
+	case PORT_FLUSH_IMMEDIATE:
+	case PORT_FLUSH_BATCH:
+		break;
+	case PORT_FLUSH_TIMED:
+		if (max_hold < 0)
+			return -EINVAL;
+		client->max_hold = max_hold;
+		break;
+	default:
+		return -EINVAL;
+	}
+	client->flush_policy = policy;
+	return 0;
+}
+
+/*
+ * copy the statistics of the client;
+ * the counters are updated without lock, so the values are
+ * only approximate while the loop is running
+ */
+void port_client_get_stats(port_client_t *client, port_client_stats_t *stats)
+{
+	*stats = client->stats;
+	stats->queue_depth = atomic_load(&client->queue_head) - client->queue_tail;
+	stats->queue_full = atomic_load(&client->queue_full);
+}
+
+/*
+ * set the length of the per-port output backlogs and the policy
+ * when they are full; size 0 disables the backlog, and a negative
+ * size or policy keeps the current one.  the size can't be changed
+ * while events are waiting.
+ */
+int port_client_set_backlog(port_client_t *client, int size, int policy)
+{
+	port_t *p;
+
+	if (size < 0)
+		size = client->backlog_size;
+	if (policy < 0)
+		policy = client->overload;
+	if (size > PORT_MAX_BACKLOG || policy > PORT_OVERLOAD_COALESCE)
+		return -EINVAL;
+	if (size != client->backlog_size) {
+		for (p = client->ports; p; p = p->next)
+			if (p->backlog.count)
+				return -EBUSY;
+		for (p = client->ports; p; p = p->next)
+			if (p->can_output)
+				backlog_alloc(p, size);
+		client->backlog_size = size;
+	}
+	client->overload = policy;
+	return 0;
+}
+
+/*
+ * set the function called on the loop thread when the timer expires
+ */
+void port_client_set_timer(port_client_t *client, port_timer_t func, void *private_data)
+{
+	client->timer_func = func;
+	client->timer_data = private_data;
+}
+
+/*
+ * run the timer function after usec at latest; an earlier pending
+ * expiry is kept.  called from the loop thread only.
+ */
+int port_client_schedule(port_client_t *client, int usec)
+{
+	unsigned long long expire = get_usec() + usec;
+	struct itimerspec its;
+
+	if (client->timer_expire && client->timer_expire <= expire)
+		return 0;
+	client->timer_expire = expire;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = expire / 1000000;
+	its.it_value.tv_nsec = (expire % 1000000) * 1000;
+	if (timerfd_settime(client->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		return -errno;
+	return 0;
+}
+
+/*
+ * set the function called on the loop thread each time the loop
+ * wakes up, before the input is handled;
+ * other threads trigger it with port_client_wakeup()
+ */
+void port_client_set_hook(port_client_t *client, port_timer_t func, void *private_data)
+{
+	client->hook_func = func;
+	client->hook_data = private_data;
+}
+
+/*
+ * set the size of a kernel pool or a buffer;
+ * from other threads the request is passed to the loop, which
+ * applies it between input batches
+ */
+int port_client_set_pool(port_client_t *client, int pool, int size)
+{
+	if (pool < 0 || pool >= PORT_NUM_POOLS || size <= 0)
+		return -EINVAL;
+	if (is_loop_thread(client))
+		return set_pool(client, pool, size);
+	atomic_store(&client->pool_req[pool], size);
+	atomic_store(&client->pool_pending, 1);
+	wake_loop(client);
+	return 0;
+}
+
+/*
+ * get the current size of a kernel pool or a buffer
+ */
+int port_client_get_pool(port_client_t *client, int pool)
+{
+#if SND_LIB_MAJOR > 0 || SND_LIB_MINOR > 5
+	snd_seq_client_pool_t *info;
+
+	switch (pool) {
+	case PORT_POOL_INPUT:
+	case PORT_POOL_OUTPUT:
+		snd_seq_client_pool_alloca(&info);
+		if (snd_seq_get_client_pool(client->seq, info) < 0)
+			return -EIO;
+		if (pool == PORT_POOL_INPUT)
+			return snd_seq_client_pool_get_input_pool(info);
+		return snd_seq_client_pool_get_output_pool(info);
+	case PORT_BUFFER_INPUT:
+		return snd_seq_get_input_buffer_size(client->seq);
+	case PORT_BUFFER_OUTPUT:
+		return snd_seq_get_output_buffer_size(client->seq);
+	}
+	return -EINVAL;
+#else
+	return -ENOSYS;
+#endif
 }
 
 /*
@@ -391,22 +1553,29 @@ int port_call_callback(port_t *p, int cb, snd_seq_event_t *ev)
 }
 
 /*
- * write an event
+ * write an event;
+ * events from other threads than the loop are passed via the
+ * submission queue, and the loop flushes them after draining
  */
 int port_write_event(port_t *p, snd_seq_event_t *ev, int flush)
 {
+	port_client_t *client = p->client;
 	int rc;
 
 	snd_seq_ev_set_source(ev, p->port);
-	MUTEX_LOCK(p->client);
-	rc = snd_seq_event_output(p->client->seq, ev);
-	if (rc < 0) {
-		MUTEX_UNLOCK(p->client);
+	if (!is_loop_thread(client)) {
+		rc = queue_event(client, ev);
+		if (rc >= 0)
+			wake_loop(client);
 		return rc;
 	}
+	rc = output_event(client, p, ev);
+	if (rc < 0)
+		return rc;
+	if (!client->hold_start)
+		client->hold_start = get_usec();
 	if (flush)
-		snd_seq_flush_output(p->client->seq);
-	MUTEX_UNLOCK(p->client);
+		flush_output(client);
 	return rc;
 }
 
@@ -415,22 +1584,30 @@ int port_write_event(port_t *p, snd_seq_event_t *ev, int flush)
  */
 int port_flush_event(port_t *p)
 {
-	int err;
-	MUTEX_LOCK(p->client);
-	err = snd_seq_flush_output(p->client->seq);
-	MUTEX_UNLOCK(p->client);
-	return err;
+	if (!is_loop_thread(p->client)) {
+		wake_loop(p->client);
+		return 0;
+	}
+	return flush_output(p->client);
 }
 
 /*
- * add a callback function to the port
+ * add a callback function to the port;
+ * PORT_MIDI_EVENT_CB is called for all event types
+ * but the subscription notices
  */
 int port_add_callback(port_t *p, int cb, port_callback_t func, void *private_data)
 {
-	if (cb < 0 || cb >= PORT_NUM_CBS)
-		error("invalid callback");
+	int i;
+
+	port_remove_callback(p, cb);
 	p->callback[cb].func = func;
 	p->callback[cb].private_data = private_data;
+	if (cb == PORT_MIDI_EVENT_CB && func) {
+		for (i = 0; i < PORT_TABLE_SIZE; i++)
+			if (!is_port_event(i))
+				add_handler(p, i, func, private_data);
+	}
 	return 0;
 }
 
@@ -439,13 +1616,45 @@ int port_add_callback(port_t *p, int cb, port_callback_t func, void *private_dat
  */
 int port_remove_callback(port_t *p, int cb)
 {
+	int i;
+
 	if (cb < 0 || cb >= PORT_NUM_CBS)
 		error("invalid callback");
+	if (cb == PORT_MIDI_EVENT_CB && p->callback[cb].func) {
+		for (i = 0; i < PORT_TABLE_SIZE; i++)
+			if (!is_port_event(i))
+				remove_handler(p, i, p->callback[cb].func);
+	}
 	p->callback[cb].func = NULL;
 	p->callback[cb].private_data = NULL;
 	return 0;
 }
 
+/*
+ * add a handler for the given event type;
+ * handlers of the same type are called in the order of addition.
+ * the handler vectors are not locked, so handlers must be set up
+ * before the event loop runs.
+ */
+int port_add_event_callback(port_t *p, int type, port_callback_t func, void *private_data)
+{
+	if (type < 0 || type >= PORT_TABLE_SIZE || is_port_event(type))
+		return -EINVAL;
+	add_handler(p, type, func, private_data);
+	return 0;
+}
+
+/*
+ * remove a handler of the given event type
+ */
+int port_remove_event_callback(port_t *p, int type, port_callback_t func)
+{
+	if (type < 0 || type >= PORT_TABLE_SIZE || is_port_event(type))
+		return -EINVAL;
+	remove_handler(p, type, func);
+	return 0;
+}
+
 /*
  * subscribe from this port to the specified port (write)
  */
@@ -490,3 +1699,121 @@ int port_num_subscription(port_t *p, int type)
 	}
 	return 0;
 }
+
+/*
+ * get the addresses subscribed to the port;
+ * SND_SEQ_QUERY_SUBS_READ gives the destinations, and
+ * SND_SEQ_QUERY_SUBS_WRITE the sources.  returns the number of
+ * addresses, at most max.
+ */
+int port_get_subscribers(port_t *p, int type, snd_seq_addr_t *addrs, int max)
+{
+#ifdef ALSA_API_ENCAP
+	snd_seq_query_subscribe_t *subs;
+	snd_seq_addr_t root;
+	int n;
+
+	snd_seq_query_subscribe_alloca(&subs);
+	root.client = p->client->client;
+	root.port = p->port;
+	snd_seq_query_subscribe_set_root(subs, &root);
+	snd_seq_query_subscribe_set_type(subs, type);
+	for (n = 0; n < max; n++) {
+		snd_seq_query_subscribe_set_index(subs, n);
+		if (snd_seq_query_port_subscribers(p->client->seq, subs) < 0)
+			break;
+		addrs[n] = *snd_seq_query_subscribe_get_addr(subs);
+	}
+	return n;
+#else
+	return -ENOSYS;
+#endif
+}
+
+/*
+ * connect two foreign ports directly in the kernel
+ */
+int port_client_subscribe(port_client_t *client, snd_seq_addr_t *src, snd_seq_addr_t *dst)
+{
+#ifdef ALSA_API_ENCAP
+	snd_seq_port_subscribe_t *sub;
+
+	snd_seq_port_subscribe_alloca(&sub);
+	snd_seq_port_subscribe_set_sender(sub, src);
+	snd_seq_port_subscribe_set_dest(sub, dst);
+	return snd_seq_subscribe_port(client->seq, sub);
+#else
+	return -ENOSYS;
+#endif
+}
+
+/*
+ * remove a connection made by port_client_subscribe()
+ */
+int port_client_unsubscribe(port_client_t *client, snd_seq_addr_t *src, snd_seq_addr_t *dst)
+{
+#ifdef ALSA_API_ENCAP
+	snd_seq_port_subscribe_t *sub;
+
+	snd_seq_port_subscribe_alloca(&sub);
+	snd_seq_port_subscribe_set_sender(sub, src);
+	snd_seq_port_subscribe_set_dest(sub, dst);
+	return snd_seq_unsubscribe_port(client->seq, sub);
+#else
+	return -ENOSYS;
+#endif
+}
+
+/*
+ * reject or accept an event type on the port; rejected events are
+ * dropped before dispatch, and the types rejected by all ports of
+ * the client are not delivered by the kernel at all.  subscription
+ * notices are always accepted.
+ */
+int port_set_event_filter(port_t *p, int type, int reject)
+{
+	unsigned int bit;
+
+	if (type < 0 || type >= PORT_TABLE_SIZE || is_port_event(type))
+		return -EINVAL;
+	bit = 1U << (type % 32);
+	if (reject)
+		atomic_fetch_or(&p->reject[type / 32], bit);
+	else
+		atomic_fetch_and(&p->reject[type / 32], ~bit);
+	atomic_store(&p->client->filter_pending, 1);
+	wake_loop(p->client);
+	return 0;
+}
+
+int port_get_event_filter(port_t *p, int type)
+{
+	if (type < 0 || type >= PORT_TABLE_SIZE)
+		return -EINVAL;
+	return (atomic_load(&p->reject[type / 32]) >> (type % 32)) & 1;
+}
+
+/*
+ * number of events rejected by the filter of the port
+ */
+unsigned long port_get_rejected(port_t *p)
+{
+	return p->rejected;
+}
+
+/*
+ * number of input overruns seen while the port was attached
+ */
+unsigned long port_get_overruns(port_t *p)
+{
+	return p->overruns;
+}
+
+/*
+ * copy the output backlog statistics of the port
+ */
+void port_get_backlog_stats(port_t *p, port_backlog_stats_t *stats)
+{
+	*stats = p->backlog.stats;
+	stats->depth = p->backlog.count;
+}
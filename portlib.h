@@ -46,10 +46,72 @@ enum port_callback_type_t {
 	PORT_USE_CB,
 	PORT_UNSUBSCRIBE_CB,
 	PORT_UNUSE_CB,
-	PORT_MIDI_EVENT_CB
+	PORT_MIDI_EVENT_CB,
+	PORT_OVERRUN_CB		/* input overrun; ev is NULL */
 };
 
 typedef int (*port_callback_t)(port_t *p, int type, snd_seq_event_t *ev, void *private_data);
+typedef void (*port_timer_t)(port_client_t *c, void *private_data);
+
+/*
+ * output flush policy
+ */
+enum port_flush_policy_t {
+	PORT_FLUSH_IMMEDIATE,	/* drain after each dispatched event */
+	PORT_FLUSH_BATCH,	/* drain once per input batch */
+	PORT_FLUSH_TIMED	/* drain when input is idle or output is held too long */
+};
+
+/*
+ * what to do when the output backlog of a port is full
+ */
+enum port_overload_t {
+	PORT_OVERLOAD_BLOCK,		/* wait until the sequencer takes events */
+	PORT_OVERLOAD_DROP_NEWEST,	/* drop the event being written */
+	PORT_OVERLOAD_DROP_OLDEST,	/* drop the oldest event but note-offs */
+	PORT_OVERLOAD_COALESCE		/* merge controllers, else drop oldest */
+};
+
+/*
+ * kernel pools and buffers of the client
+ */
+enum port_pool_t {
+	PORT_POOL_INPUT,	/* kernel input pool (events) */
+	PORT_POOL_OUTPUT,	/* kernel output pool (events) */
+	PORT_BUFFER_INPUT,	/* user-space input buffer (bytes) */
+	PORT_BUFFER_OUTPUT,	/* user-space output buffer (bytes) */
+	PORT_NUM_POOLS
+};
+
+/*
+ * client statistics
+ */
+typedef struct port_client_stats_t {
+	unsigned long events;		/* dispatched input events */
+	unsigned long batches;		/* input batches */
+	unsigned int max_batch;		/* largest batch */
+	unsigned long flushes;		/* drains of pending output */
+	unsigned long max_latency;	/* longest output hold (usec) */
+	unsigned long long total_latency;	/* sum of output holds (usec) */
+	unsigned long queued;		/* events passed via submission queue */
+	unsigned int queue_depth;	/* events waiting in the queue */
+	unsigned int queue_max;		/* queue high-watermark */
+	unsigned long queue_full;	/* events refused by a full queue */
+	unsigned long queue_lost;	/* queued events failed to output */
+	unsigned long overruns;		/* input overruns */
+} port_client_stats_t;
+
+/*
+ * output backlog statistics of a port
+ */
+typedef struct port_backlog_stats_t {
+	unsigned long queued;		/* events put in the backlog */
+	unsigned long retried;		/* backlog events output later */
+	unsigned long dropped;		/* events dropped by overload */
+	unsigned long coalesced;	/* events merged into queued ones */
+	unsigned int depth;		/* events waiting */
+	unsigned int max_depth;		/* backlog high-watermark */
+} port_backlog_stats_t;
 
 /*
  * capabilities
@@ -63,7 +125,10 @@ void port_client_delete(port_client_t *p);
 port_t *port_attach(port_client_t *p, char *name, unsigned int cap, unsigned int type);
 int port_detach(port_t *p);
 void port_client_do_loop(port_client_t *p, int timeout);
+int port_client_dispatch(port_client_t *p, int timeout);
 int port_client_do_event(port_client_t *p);
+int port_client_get_fd(port_client_t *p);
+void port_client_wakeup(port_client_t *p);
 port_t *port_client_search_port(port_client_t *client, int port);
 
 port_client_t *port_get_client(port_t *c);
@@ -72,15 +137,35 @@ int port_client_get_id(port_client_t *p);
 int port_get_port(port_t *p);
 int port_client_get_port(port_client_t *c);
 void port_client_stop(port_client_t *c);
+int port_client_set_batch(port_client_t *c, int size);
+int port_client_set_flush_policy(port_client_t *c, int policy, int max_hold);
+void port_client_get_stats(port_client_t *c, port_client_stats_t *stats);
+int port_client_set_pool(port_client_t *c, int pool, int size);
+int port_client_get_pool(port_client_t *c, int pool);
+int port_client_set_backlog(port_client_t *c, int size, int policy);
+void port_client_set_timer(port_client_t *c, port_timer_t func, void *private_data);
+int port_client_schedule(port_client_t *c, int usec);
+void port_client_set_hook(port_client_t *c, port_timer_t func, void *private_data);
+int port_client_subscribe(port_client_t *c, snd_seq_addr_t *src, snd_seq_addr_t *dst);
+int port_client_unsubscribe(port_client_t *c, snd_seq_addr_t *src, snd_seq_addr_t *dst);
 
 int port_connect_to(port_t *p, int client, int port);
 int port_connect_from(port_t *p, int client, int port);
 
 int port_add_callback(port_t *p, int type, port_callback_t ptr, void *private_data);
 int port_remove_callback(port_t *p, int type);
+int port_add_event_callback(port_t *p, int ev_type, port_callback_t ptr, void *private_data);
+int port_remove_event_callback(port_t *p, int ev_type, port_callback_t ptr);
 int port_call_callback(port_t *p, int type, snd_seq_event_t *ev);
+int port_dispatch_event(port_t *p, snd_seq_event_t *ev);
 int port_write_event(port_t *p, snd_seq_event_t *ev, int flush);
 int port_flush_event(port_t *p);
 int port_num_subscription(port_t *p, int type);
+int port_get_subscribers(port_t *p, int type, snd_seq_addr_t *addrs, int max);
+int port_set_event_filter(port_t *p, int type, int reject);
+int port_get_event_filter(port_t *p, int type);
+unsigned long port_get_rejected(port_t *p);
+unsigned long port_get_overruns(port_t *p);
+void port_get_backlog_stats(port_t *p, port_backlog_stats_t *stats);
 
 #endif